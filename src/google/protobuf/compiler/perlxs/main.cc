@@ -28,9 +28,16 @@ int main(int argc, char* argv[]) {
   // process Perl/XS command line options first, and filter them out
   // of the argument list.  we really need to be able to register
   // options with the CLI instead of doing this stupid hack here.
+  // (the same options can also be given as --out=opt1,opt2:dir, or
+  // to the protoc-gen-perlxs plugin as --perlxs_out=opt1,opt2:dir.)
 
   int j = 1;
   for (int i = 1; i < argc; i++) {
+    // --out dir, as two arguments: the generator needs to see the
+    // directory too (for --perlxs-incremental).
+    if (string(argv[i]) == "--out" && i + 1 < argc) {
+      perlxs_generator.ProcessOption(string("--out=") + argv[i + 1]);
+    }
     if (perlxs_generator.ProcessOption(argv[i]) == false) {
       argv[j++] = argv[i];
     }
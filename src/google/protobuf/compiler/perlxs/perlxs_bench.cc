@@ -0,0 +1,331 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <google/protobuf/compiler/perlxs/perlxs_generator.h>
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/descriptor.pb.h>
+#include <google/protobuf/stubs/common.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+
+// Benchmarks PerlXSGenerator::Generate() in-process over synthetic
+// FileDescriptors of increasing size, so regressions in the emission
+// code show up without running protoc over a real source tree.
+//
+//   protoxs_bench [iterations]
+//
+// Prints one line per case with the wall time per Generate() call, the
+// number of bytes emitted and the peak RSS of the process so far.
+
+using namespace std;
+using namespace google::protobuf;
+using namespace google::protobuf::compiler;
+
+namespace {
+
+// Collects the generated files in memory instead of writing them out.
+
+class MemoryOutputDirectory : public OutputDirectory {
+ public:
+  MemoryOutputDirectory() {}
+  virtual ~MemoryOutputDirectory() {}
+
+  virtual io::ZeroCopyOutputStream* Open(const string& filename) {
+    string& contents = files_[filename];
+
+    contents.clear();
+    return new io::StringOutputStream(&contents);
+  }
+
+  size_t TotalBytes() const {
+    size_t total = 0;
+
+    for ( map<string, string>::const_iterator i = files_.begin();
+	  i != files_.end(); ++i ) {
+      total += i->second.size();
+    }
+    return total;
+  }
+
+ private:
+  map<string, string> files_;
+
+  GOOGLE_DISALLOW_EVIL_CONSTRUCTORS(MemoryOutputDirectory);
+};
+
+
+string Name(const char* prefix, int n)
+{
+  ostringstream ost;
+
+  ost << prefix << n;
+  return ost.str();
+}
+
+
+// Adds a field of every scalar kind to the message, cycling through
+// labels and types by index.
+
+void AddScalarField(DescriptorProto* message, int index)
+{
+  static const FieldDescriptorProto::Type types[] = {
+    FieldDescriptorProto::TYPE_INT32,
+    FieldDescriptorProto::TYPE_INT64,
+    FieldDescriptorProto::TYPE_UINT64,
+    FieldDescriptorProto::TYPE_DOUBLE,
+    FieldDescriptorProto::TYPE_BOOL,
+    FieldDescriptorProto::TYPE_STRING,
+    FieldDescriptorProto::TYPE_BYTES,
+    FieldDescriptorProto::TYPE_FIXED32
+  };
+  static const int ntypes = sizeof(types) / sizeof(types[0]);
+
+  FieldDescriptorProto* field = message->add_field();
+
+  field->set_name(Name("field_", index));
+  field->set_number(index + 1);
+  field->set_type(types[index % ntypes]);
+  field->set_label(index % 3 == 0 ?
+		   FieldDescriptorProto::LABEL_REPEATED :
+		   FieldDescriptorProto::LABEL_OPTIONAL);
+}
+
+
+void AddMessageField(DescriptorProto* message, int index,
+		     const string& type_name)
+{
+  FieldDescriptorProto* field = message->add_field();
+
+  field->set_name(Name("field_", index));
+  field->set_number(index + 1);
+  field->set_type(FieldDescriptorProto::TYPE_MESSAGE);
+  field->set_type_name(type_name);
+  field->set_label(FieldDescriptorProto::LABEL_OPTIONAL);
+}
+
+
+void AddEnum(FileDescriptorProto* file, const string& name, int values)
+{
+  EnumDescriptorProto* enum_type = file->add_enum_type();
+
+  enum_type->set_name(name);
+  for ( int i = 0; i < values; i++ ) {
+    EnumValueDescriptorProto* value = enum_type->add_value();
+
+    value->set_name(name + Name("_VALUE_", i));
+    value->set_number(i);
+  }
+}
+
+
+// Many small top-level messages.
+
+void BuildManyMessages(int scale, vector<FileDescriptorProto>* files)
+{
+  FileDescriptorProto file;
+
+  file.set_name("bench_messages.proto");
+  file.set_package("bench.messages");
+  AddEnum(&file, "Kind", 8);
+  for ( int i = 0; i < scale * 16; i++ ) {
+    DescriptorProto* message = file.add_message_type();
+
+    message->set_name(Name("Message", i));
+    for ( int j = 0; j < 8; j++ ) {
+      AddScalarField(message, j);
+    }
+    if ( i > 0 ) {
+      AddMessageField(message, 8, ".bench.messages.Message0");
+    }
+  }
+  files->push_back(file);
+}
+
+
+// One chain of nested messages, each containing the next.  libprotobuf
+// refuses nesting much deeper than 32 levels, so the depth is capped.
+
+void BuildDeepNesting(int scale, vector<FileDescriptorProto>* files)
+{
+  FileDescriptorProto file;
+  DescriptorProto*    message = file.add_message_type();
+  string              type_name = ".bench.nesting.Level0";
+  int                 levels = scale + 1 < 24 ? scale + 1 : 24;
+
+  file.set_name("bench_nesting.proto");
+  file.set_package("bench.nesting");
+  message->set_name("Level0");
+  for ( int i = 1; i <= levels; i++ ) {
+    DescriptorProto* nested = message->add_nested_type();
+
+    nested->set_name(Name("Level", i));
+    type_name += Name(".Level", i);
+    AddScalarField(message, 0);
+    AddScalarField(message, 1);
+    AddMessageField(message, 2, type_name);
+    message = nested;
+  }
+  AddScalarField(message, 0);
+  files->push_back(file);
+}
+
+
+// One message with a very large number of fields.
+
+void BuildWideFields(int scale, vector<FileDescriptorProto>* files)
+{
+  FileDescriptorProto file;
+  DescriptorProto*    message = file.add_message_type();
+
+  file.set_name("bench_wide.proto");
+  file.set_package("bench.wide");
+  message->set_name("Wide");
+  for ( int i = 0; i < scale * 64; i++ ) {
+    AddScalarField(message, i);
+  }
+  files->push_back(file);
+}
+
+
+// A file whose messages reference types from many dependencies.
+
+void BuildManyDependencies(int scale, vector<FileDescriptorProto>* files)
+{
+  FileDescriptorProto file;
+  DescriptorProto*    message = file.add_message_type();
+
+  file.set_name("bench_deps.proto");
+  file.set_package("bench.deps");
+  message->set_name("Root");
+
+  for ( int i = 0; i < scale * 8; i++ ) {
+    FileDescriptorProto dep;
+    DescriptorProto*    leaf = dep.add_message_type();
+
+    dep.set_name(Name("bench_dep_", i) + ".proto");
+    dep.set_package(Name("bench.dep", i));
+    leaf->set_name("Leaf");
+    for ( int j = 0; j < 4; j++ ) {
+      AddScalarField(leaf, j);
+    }
+    files->push_back(dep);
+
+    file.add_dependency(dep.name());
+    AddMessageField(message, i, "." + dep.package() + ".Leaf");
+  }
+  files->push_back(file);
+}
+
+
+struct BenchCase {
+  const char* name;
+  void (*build)(int scale, vector<FileDescriptorProto>* files);
+};
+
+const BenchCase kCases[] = {
+  { "messages", BuildManyMessages },
+  { "nesting",  BuildDeepNesting },
+  { "wide",     BuildWideFields },
+  { "deps",     BuildManyDependencies }
+};
+
+const int kScales[] = { 1, 4, 16, 64 };
+
+
+double Now()
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+
+long PeakRSS()
+{
+  struct rusage usage;
+
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;  // kilobytes on Linux
+}
+
+}  // namespace
+
+
+int main(int argc, char* argv[])
+{
+  int iterations = 10;
+
+  if ( argc > 1 ) {
+    iterations = atoi(argv[1]);
+    if ( iterations <= 0 ) {
+      cerr << "usage: " << argv[0] << " [iterations]" << endl;
+      return 1;
+    }
+  }
+
+  printf("%-10s %6s %8s %8s %12s %12s %12s\n",
+	 "case", "scale", "messages", "fields", "bytes", "ms/generate",
+	 "peak_rss_kb");
+
+  for ( size_t c = 0; c < sizeof(kCases) / sizeof(kCases[0]); c++ ) {
+    for ( size_t s = 0; s < sizeof(kScales) / sizeof(kScales[0]); s++ ) {
+      vector<FileDescriptorProto> protos;
+      DescriptorPool              pool;
+      const FileDescriptor*       file = NULL;
+
+      kCases[c].build(kScales[s], &protos);
+      for ( size_t i = 0; i < protos.size(); i++ ) {
+	file = pool.BuildFile(protos[i]);
+	if ( file == NULL ) {
+	  cerr << kCases[c].name << ": failed to build "
+	       << protos[i].name() << endl;
+	  return 1;
+	}
+      }
+
+      // The last file built is the one that depends on the others.
+
+      int messages = 0;
+      int fields = 0;
+
+      for ( int i = 0; i < file->message_type_count(); i++ ) {
+	const Descriptor* descriptor = file->message_type(i);
+
+	while ( descriptor != NULL ) {
+	  messages++;
+	  fields += descriptor->field_count();
+	  descriptor = descriptor->nested_type_count() > 0 ?
+	    descriptor->nested_type(0) : NULL;
+	}
+      }
+
+      perlxs::PerlXSGenerator generator;
+      MemoryOutputDirectory   outdir;
+      string                  error;
+      double                  start = Now();
+
+      for ( int i = 0; i < iterations; i++ ) {
+	if ( !generator.Generate(file, "", &outdir, &error) ) {
+	  cerr << kCases[c].name << ": " << error << endl;
+	  return 1;
+	}
+      }
+
+      double elapsed = Now() - start;
+
+      printf("%-10s %6d %8d %8d %12lu %12.3f %12ld\n",
+	     kCases[c].name, kScales[s], messages, fields,
+	     (unsigned long)outdir.TotalBytes(),
+	     elapsed * 1000 / iterations, PeakRSS());
+      fflush(stdout);
+    }
+  }
+
+  return 0;
+}
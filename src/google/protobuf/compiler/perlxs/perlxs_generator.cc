@@ -1,7 +1,12 @@
 #include <iostream>
 #include <sstream>
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+#include <pthread.h>
 #include <google/protobuf/compiler/perlxs/perlxs_generator.h>
 #include <google/protobuf/compiler/perlxs/perlxs_helpers.h>
+#include <google/protobuf/compiler/perlxs/perlxs_output.h>
 #include <google/protobuf/compiler/perlxs/perlxs_config.h>
 #include <google/protobuf/descriptor.h>
 #include <google/protobuf/descriptor.pb.h>
@@ -18,6 +23,18 @@ namespace perlxs {
 PerlXSGenerator::PerlXSGenerator() {
 	perlxs_package_ = "ProtobufXS"; // default perlxs_package name
 	grpc_base_ = "Grpc::Client::BaseStub"; // default grpc_base name in service module
+	stats_ = false;
+	bench_ = false;
+	aggregate_ = false;
+	shards_ = 0;
+	incremental_ = false;
+	enum_as_name_ = false;
+	lazy_boot_ = false;
+	frozen_defaults_ = false;
+	ithreads_ = false;
+	custom_ops_ = false;
+	gzip_ = false;
+	jobs_ = 1;
 }
 PerlXSGenerator::~PerlXSGenerator() {}
 
@@ -68,10 +85,272 @@ PerlXSGenerator::Generate(const FileDescriptor* file,
 			  OutputDirectory* outdir,
 			  string* error) const
 {
-	GenerateMakefilePL(file, outdir);
-	GenerateXS(file,outdir);
-	GenerateModule(file,outdir);
+	vector<const FileDescriptor*> files(1, file);
 
+	return GenerateAll(files, parameter, outdir, error);
+}
+
+bool
+PerlXSGenerator::GenerateAll(const vector<const FileDescriptor*>& files,
+			     const string& parameter,
+			     OutputDirectory* outdir,
+			     string* error) const
+{
+  // Options in the parameter apply on top of those given on the
+  // command line, to this run only.
+
+  if ( !parameter.empty() ) {
+    PerlXSGenerator generator;
+
+    generator.CopyOptions(*this);
+    if ( !generator.ParseParameter(parameter, error) ) {
+      return false;
+    }
+    return generator.GenerateAll(files, "", outdir, error);
+  }
+
+  // A bad option value is only reported here: ProcessOption has no
+  // way to return an error.
+
+  if ( !option_error_.empty() ) {
+    *error = option_error_;
+    return false;
+  }
+
+  if ( shards_ > 0 && stats_ ) {
+    *error = "--perlxs-shards cannot be combined with --perlxs-stats";
+    return false;
+  }
+
+  if ( incremental_ && out_dir_.empty() ) {
+    *error = "--perlxs-incremental needs the output directory "
+      "(--out=dir, or out=dir for the plugin)";
+    return false;
+  }
+
+  if ( jobs_ > 1 && !aggregate_ ) {
+    *error = "--perlxs-jobs requires --perlxs-aggregate";
+    return false;
+  }
+
+  // --perlxs-incremental: only files whose contents changed are handed
+  // on to protoc, which leaves the others untouched.
+
+  if ( incremental_ ) {
+    BufferedOutputDirectory buffered(outdir, out_dir_);
+
+    GenerateFiles(files, &buffered);
+    buffered.Flush();
+  } else {
+    GenerateFiles(files, outdir);
+  }
+
+  return true;
+}
+
+// One output (or group of outputs) of an aggregated run.  "index" is
+// the shard for XS_SHARD, and the file for MODULE and FILE_MODULES.
+
+struct PerlXSGenerator::GenerateTask {
+  enum Kind {
+    MAKEFILE_PL,
+    XS,
+    XS_SHARD,
+    XS_BOOT,
+    LOADER_MODULE,
+    MODULE,
+    FILE_MODULES
+  };
+
+  GenerateTask(Kind k, size_t i) : kind(k), index(i) {}
+
+  Kind   kind;
+  size_t index;
+};
+
+// --perlxs-jobs: the tasks are run on a pool of threads, each into a
+// buffer of its own.  The buffers are written out in the order of the
+// tasks, so the output does not depend on scheduling.
+
+struct PerlXSGenerator::GenerateJob {
+  const PerlXSGenerator*                      generator;
+  const vector<const FileDescriptor*>*        files;
+  vector<vector<const Descriptor*> >          shards;
+  vector<GenerateTask>                        tasks;
+  vector<BufferedOutputDirectory*>            buffers;
+  pthread_mutex_t                             lock;
+  size_t                                      next;
+};
+
+void
+PerlXSGenerator::GenerateFiles(const vector<const FileDescriptor*>& files,
+			       OutputDirectory* outdir) const
+{
+  GenerateRuntime(outdir);
+
+  if ( !aggregate_ ) {
+    for ( size_t i = 0; i < files.size(); i++ ) {
+      GenerateFile(files[i], outdir);
+    }
+    return;
+  }
+
+  // One Makefile.PL, one XS source and one loader module for all files.
+  // Files in the same package share a package module, which must only
+  // be written once.  Every output (each XS shard, each module) is a
+  // task of its own, so that --perlxs-jobs can spread them over threads.
+
+  GenerateJob job;
+  set<string> packages;
+
+  job.generator = this;
+  job.files     = &files;
+  job.next      = 0;
+
+  job.tasks.push_back(GenerateTask(GenerateTask::MAKEFILE_PL, 0));
+  if ( shards_ > 0 ) {
+    ShardMessages(files, job.shards);
+    for ( size_t k = 0; k < job.shards.size(); k++ ) {
+      job.tasks.push_back(GenerateTask(GenerateTask::XS_SHARD, k));
+    }
+    job.tasks.push_back(GenerateTask(GenerateTask::XS_BOOT, 0));
+  } else {
+    job.tasks.push_back(GenerateTask(GenerateTask::XS, 0));
+  }
+  job.tasks.push_back(GenerateTask(GenerateTask::LOADER_MODULE, 0));
+
+  for ( size_t i = 0; i < files.size(); i++ ) {
+    if ( packages.insert(files[i]->package()).second ) {
+      job.tasks.push_back(GenerateTask(GenerateTask::MODULE, i));
+    }
+    job.tasks.push_back(GenerateTask(GenerateTask::FILE_MODULES, i));
+  }
+
+  RunTasks(job, outdir);
+}
+
+// Everything for one file, when not aggregating.
+
+void
+PerlXSGenerator::GenerateFile(const FileDescriptor* file,
+			      OutputDirectory* outdir) const
+{
+  vector<const FileDescriptor*> files(1, file);
+
+  GenerateMakefilePL(files, outdir);
+  GenerateXS(files, outdir);
+  GenerateModule(file, outdir);
+  GenerateFileModules(file, outdir);
+}
+
+
+void
+PerlXSGenerator::RunTask(const GenerateJob& job, size_t t,
+			 OutputDirectory* outdir) const
+{
+  const vector<const FileDescriptor*>& files = *job.files;
+  const GenerateTask&                  task = job.tasks[t];
+
+  switch ( task.kind ) {
+  case GenerateTask::MAKEFILE_PL:
+    GenerateMakefilePL(files, outdir);
+    break;
+  case GenerateTask::XS:
+    GenerateXS(files, outdir);
+    break;
+  case GenerateTask::XS_SHARD:
+    GenerateXSShard(files, job.shards[task.index], task.index, outdir);
+    break;
+  case GenerateTask::XS_BOOT:
+    GenerateXSShardBoot(files, job.shards.size(), outdir);
+    break;
+  case GenerateTask::LOADER_MODULE:
+    GenerateLoaderModule(outdir);
+    break;
+  case GenerateTask::MODULE:
+    GenerateModule(files[task.index], outdir);
+    break;
+  case GenerateTask::FILE_MODULES:
+    GenerateFileModules(files[task.index], outdir);
+    break;
+  }
+}
+
+void*
+PerlXSGenerator::GenerateWorker(void* arg)
+{
+  GenerateJob* job = static_cast<GenerateJob*>(arg);
+
+  for (;;) {
+    size_t i;
+
+    pthread_mutex_lock(&job->lock);
+    i = job->next++;
+    pthread_mutex_unlock(&job->lock);
+
+    if ( i >= job->tasks.size() ) {
+      break;
+    }
+    job->generator->RunTask(*job, i, job->buffers[i]);
+  }
+
+  return NULL;
+}
+
+void
+PerlXSGenerator::RunTasks(GenerateJob& job, OutputDirectory* outdir) const
+{
+  vector<pthread_t> threads;
+  size_t            workers = job.tasks.size();
+
+  if ( jobs_ <= 1 || workers <= 1 ) {
+    for ( size_t i = 0; i < job.tasks.size(); i++ ) {
+      RunTask(job, i, outdir);
+    }
+    return;
+  }
+
+  if ( workers > static_cast<size_t>(jobs_) ) {
+    workers = jobs_;
+  }
+
+  for ( size_t i = 0; i < job.tasks.size(); i++ ) {
+    job.buffers.push_back(new BufferedOutputDirectory(outdir, ""));
+  }
+
+  pthread_mutex_init(&job.lock, NULL);
+
+  // This thread is one of the workers.  If a thread can't be started,
+  // the others just pick up its share.
+
+  for ( size_t i = 1; i < workers; i++ ) {
+    pthread_t thread;
+
+    if ( pthread_create(&thread, NULL, GenerateWorker, &job) == 0 ) {
+      threads.push_back(thread);
+    }
+  }
+  GenerateWorker(&job);
+
+  for ( size_t i = 0; i < threads.size(); i++ ) {
+    pthread_join(threads[i], NULL);
+  }
+  pthread_mutex_destroy(&job.lock);
+
+  for ( size_t i = 0; i < job.buffers.size(); i++ ) {
+    job.buffers[i]->Flush();
+    delete job.buffers[i];
+  }
+  job.buffers.clear();
+}
+
+
+// Service, enum and benchmark modules for one file.
+
+void
+PerlXSGenerator::GenerateFileModules(const FileDescriptor* file,
+				     OutputDirectory* outdir) const
+{
 	if (file->service_count() > 0) {
     GenerateServiceModule(file,outdir);
   }
@@ -81,7 +360,11 @@ PerlXSGenerator::Generate(const FileDescriptor* file,
     GenerateEnumModule(enum_type, outdir);
   }
 
-  return true;
+  if ( bench_ ) {
+    for ( int i = 0; i < file->message_type_count(); i++ ) {
+      GenerateBench(file, file->message_type(i), outdir);
+    }
+  }
 }
 
 const string&
@@ -115,18 +398,138 @@ PerlXSGenerator::ProcessOption(const string& option)
       grpc_base_ = value;
       recognized = true;
     }
+
+    // --out is protoc's own option, but --perlxs-incremental needs to
+    // know where the previous output is.  Left for protoc to handle.
+    if (name == "--out") {
+      out_dir_ = OutputDirectoryName(value);
+    }
+
+    // --perlxs-jobs=N generates up to N outputs of a
+    // --perlxs-aggregate run at once.
+    if (name == "--perlxs-jobs") {
+      if ( !ParsePositive(value, &jobs_) ) {
+	option_error_ = "--perlxs-jobs must be a positive integer, not \"" +
+	  value + "\"";
+      }
+      recognized = true;
+    }
+
+    // --perlxs-shards=N splits the XS source into N files, and
+    // --perlxs-shards=message into one file per top-level message.
+    if (name == "--perlxs-shards") {
+      if ( value == "message" ) {
+	shards_ = INT_MAX;
+      } else if ( !ParsePositive(value, &shards_) ) {
+	option_error_ = "--perlxs-shards must be a positive integer or "
+	  "\"message\", not \"" + value + "\"";
+      }
+      recognized = true;
+    }
+  } else if (option == "--perlxs-stats") {
+    // Counters per message type, updated atomically.  Live objects
+    // carry magic that takes their count back out when they are freed.
+    stats_ = true;
+    recognized = true;
+  } else if (option == "--perlxs-bench") {
+    bench_ = true;
+    recognized = true;
+  } else if (option == "--perlxs-aggregate") {
+    aggregate_ = true;
+    recognized = true;
+  } else if (option == "--perlxs-incremental") {
+    incremental_ = true;
+    recognized = true;
+  } else if (option == "--perlxs-enum-as-name") {
+    enum_as_name_ = true;
+    recognized = true;
+  } else if (option == "--perlxs-lazy-boot") {
+    lazy_boot_ = true;
+    recognized = true;
+  } else if (option == "--perlxs-frozen-defaults") {
+    frozen_defaults_ = true;
+    recognized = true;
+  } else if (option == "--perlxs-ithreads") {
+    ithreads_ = true;
+    recognized = true;
+  } else if (option == "--perlxs-custom-ops") {
+    custom_ops_ = true;
+    recognized = true;
+  } else if (option == "--perlxs-gzip") {
+    gzip_ = true;
+    recognized = true;
   }
 
   return recognized;
 }
 
+// Parses the parameter protoc hands to the generator, the part before
+// the colon in --perlxs_out=package=Foo,stats:dir (or --out= for
+// protoxs).  Each comma-separated option is a command-line option
+// without its leading "--perlxs-"; "grpc-base" and "out" stand for
+// --grpc-base and --out.
+
+bool
+PerlXSGenerator::ParseParameter(const string& parameter, string* error)
+{
+  size_t start = 0;
+
+  while ( start <= parameter.length() ) {
+    size_t end = parameter.find(',', start);
+
+    if ( end == string::npos ) {
+      end = parameter.length();
+    }
+
+    string item = parameter.substr(start, end - start);
+    string name = item.substr(0, item.find('='));
+
+    start = end + 1;
+    if ( item.empty() ) {
+      continue;
+    }
+
+    if ( name == "out" ) {
+      ProcessOption("--" + item);
+    } else if ( !ProcessOption((name == "grpc-base" ? "--" : "--perlxs-") +
+			       item) ) {
+      *error = "Unknown Perl/XS generator option: " + item;
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void
+PerlXSGenerator::CopyOptions(const PerlXSGenerator& other)
+{
+  perlxs_package_ = other.perlxs_package_;
+  grpc_base_      = other.grpc_base_;
+  stats_          = other.stats_;
+  bench_          = other.bench_;
+  aggregate_      = other.aggregate_;
+  shards_         = other.shards_;
+  incremental_    = other.incremental_;
+  enum_as_name_   = other.enum_as_name_;
+  lazy_boot_      = other.lazy_boot_;
+  frozen_defaults_ = other.frozen_defaults_;
+  ithreads_       = other.ithreads_;
+  custom_ops_     = other.custom_ops_;
+  gzip_           = other.gzip_;
+  jobs_           = other.jobs_;
+  out_dir_        = other.out_dir_;
+  option_error_   = other.option_error_;
+}
+
 // Generate services
-void PerlXSGenerator::GenerateMakefilePL(const FileDescriptor* file,
+void PerlXSGenerator::GenerateMakefilePL(const vector<const FileDescriptor*>& files,
 																				 OutputDirectory* outdir) const
 {
     string filename = "Makefile.PL";
     scoped_ptr<io::ZeroCopyOutputStream> output(outdir->Open(filename));
     io::Printer printer(output.get(), '*');
+    const FileDescriptor* file = files[0];
 
 		map<string, string> vars;
 		vars["perlxs_package"] = perlxs_package_;
@@ -139,305 +542,1033 @@ void PerlXSGenerator::GenerateMakefilePL(const FileDescriptor* file,
 		vars["package_module"] = PerlPackageModule(file->package());
 		vars["package_file"]   = PerlPackageFile(file->package());
 
+		// An aggregate build is named after the loader module, and
+		// compiles the C++ sources of every file.
+
+		if ( aggregate_ ) {
+			vars["name"]         = PerlPackageModule(perlxs_package_);
+			vars["version_from"] = PerlPackageFile(perlxs_package_);
+		} else {
+			vars["name"]         = vars["perlxs_package_name"] + "::" +
+				vars["package_module"];
+			vars["version_from"] = vars["perlxs_file"] + "/" +
+				vars["package_file"];
+		}
+
+		vars["sources"] = "'" + vars["perlxs_package_name"] + ".c'";
+		if ( shards_ > 0 ) {
+			vector<vector<const Descriptor*> > shards;
+
+			ShardMessages(files, shards);
+			for ( size_t i = 0; i < shards.size(); i++ ) {
+				ostringstream ost;
+
+				ost << ",'" << vars["perlxs_package_name"] << "_" << i << ".c'";
+				vars["sources"] += ost.str();
+			}
+		}
+		// The C++ code of perlxs_options.proto is linked in along with
+		// that of the files importing it.
+
+		vector<string> protos;
+
+		for ( size_t i = 0; i < files.size(); i++ ) {
+			protos.push_back(cpp::StripProto(files[i]->name()));
+		}
+		for ( size_t i = 0; i < files.size(); i++ ) {
+			for ( int j = 0; j < files[i]->dependency_count(); j++ ) {
+				string name = cpp::StripProto(files[i]->dependency(j)->name());
+
+				if ( name == "google/protobuf/compiler/perlxs/perlxs_options" &&
+						 find(protos.begin(), protos.end(), name) == protos.end() ) {
+					protos.push_back(name);
+				}
+			}
+		}
+
+		// MakeMaker compiles every source into the current directory, so
+		// those in subdirectories get a rule that puts the object where
+		// $(O_FILES) expects it.
+
+		string rules;
+
+		for ( size_t i = 0; i < protos.size(); i++ ) {
+			vars["sources"] += ",'" + protos[i] + ".pb.cc'";
+			if ( protos[i].find('/') != string::npos ) {
+				rules += protos[i] + ".pb$(OBJ_EXT) : " + protos[i] + ".pb.cc\n"
+					"\t$(CCCMD) $(CCCDLFLAGS) \"-I$(PERL_INC)\" $(PASTHRU_DEFINE) "
+					"$(DEFINE) -o $@ $<\n";
+			}
+		}
+		vars["libs"] = gzip_ ? "-lprotobuf -lz" : "-lprotobuf";
 
 		printer.Print(vars,
 			"use ExtUtils::MakeMaker;\n"
 			"WriteMakefile(\n"
-			"              'NAME'          => '*perlxs_package_name*::*package_module*',\n"
-			"              'VERSION_FROM'  => 'lib/*perlxs_file*/*package_file*.pm',\n"
+			"              'NAME'          => '*name*',\n"
+			"              'VERSION_FROM'  => 'lib/*version_from*.pm',\n"
 			"              'OPTIMIZE'      => '-O2 -Wall',\n"
 			"              'CC'            => 'g++',\n"
 			"              'LD'            => '$(CC)',\n"
-			"              'C'             => [ '*perlxs_package_name*.c','*proto*.pb.cc' ],\n"
+			"              'C'             => [ *sources* ],\n"
 			"              'CCFLAGS'       => '-fno-strict-aliasing',\n"
 			"              'OBJECT'        => '$(O_FILES)',\n"
 			"              'INC'           => '-I.',\n"
-			"              'LIBS'          => ['-L/usr/local/lib -lprotobuf'],\n"
+			"              'LIBS'          => ['-L/usr/local/lib *libs*'],\n"
 			"              'XSOPT'         => '-C++',\n"
 			"             );\n"
 			"\n"
 		);
 
+		if ( bench_ ) {
+			rules += "bench :: pure_all\n"
+				"\tfor f in bench/*.pl; do $(FULLPERLRUN) \"-Mblib\" $$f || exit 1; done\n";
+		}
+		if ( !rules.empty() ) {
+			printer.Print(
+				"sub MY::postamble {\n"
+				"    return <<'MAKE';\n"
+				"*rules*"
+				"MAKE\n"
+				"}\n"
+				"\n",
+				"rules", rules
+			);
+		}
 }
 
 
 void
-PerlXSGenerator::GenerateXS(const FileDescriptor* file,
+PerlXSGenerator::GenerateXS(const vector<const FileDescriptor*>& files,
 													  OutputDirectory* outdir) const
 {
+  if ( shards_ > 0 ) {
+    GenerateShardedXS(files, outdir);
+    return;
+  }
+
 	string filename = PerlPackageName(perlxs_package_)+".xs";
 	scoped_ptr<io::ZeroCopyOutputStream> output(outdir->Open(filename));
 	io::Printer printer(output.get(), '$');
+	vector<const Descriptor*> messages;
+	vector<const EnumDescriptor*> enums;
 
-	map<string, string> vars;
-	vars["perlxs_package"] = perlxs_package_;
-	vars["perlxs_file"]    = PerlPackageFile(perlxs_package_);
-	vars["proto"]          = cpp::StripProto(file->name());
-	vars["proto_package_module"]  = PerlPackageModule(file->name());
-	vars["perlxs_package_name"]   = PerlPackageName(perlxs_package_);
-	vars["perlxs_package_module"] = PerlPackageModule(perlxs_package_);
-	vars["package_module"] = PerlPackageModule(file->package());
-	vars["package_file"]   = PerlPackageFile(file->package());
+  for ( size_t f = 0; f < files.size(); f++ ) {
+    for ( int i = 0; i < files[f]->message_type_count(); i++ ) {
+      messages.push_back(files[f]->message_type(i));
+    }
+    for ( int i = 0; i < files[f]->enum_type_count(); i++ ) {
+      enums.push_back(files[f]->enum_type(i));
+    }
+  }
 
-  // Boilerplate at the top of the file.
+  GenerateXSPreamble(files, printer);
+  GenerateXSMessages(messages, enums, XSModuleName(files[0]), printer);
+}
 
-  printer.Print(vars,
-		"#ifdef __cplusplus\n"
+
+// perlxs_runtime.h holds the helpers shared by all the generated XS
+// code: the type check on every method's object argument, 64-bit and
+// string conversions, and hash and array unpacking.  Keeping these out
+// of line keeps the per-accessor code small.
+
+void
+PerlXSGenerator::GenerateRuntime(OutputDirectory* outdir) const
+{
+  scoped_ptr<io::ZeroCopyOutputStream>
+    output(outdir->Open("perlxs_runtime.h"));
+  io::Printer printer(output.get(), '$');
+
+  printer.Print(
+    "#ifndef PERLXS_RUNTIME_H\n"
+    "#define PERLXS_RUNTIME_H\n"
+    "\n"
+    "// Generated by protoxs.  Runtime helpers for the generated XS code;\n"
+    "// include after EXTERN.h, perl.h and XSUB.h.\n"
+    "\n"
+    "#include <stdlib.h>\n"
+    "#include <string.h>\n"
+    "#include <string>\n"
+    "\n"
+    "#ifdef __GNUC__\n"
+    "#define PERLXS_UNUSED __attribute__((unused))\n"
+    "#else\n"
+    "#define PERLXS_UNUSED\n"
+    "#endif\n"
+    "\n"
+    "// Returns the C++ object behind \"sv\", or croaks if \"sv\" is not an\n"
+    "// object of class \"klass\".  \"name\" is the argument name.\n"
+    "\n"
+    "static PERLXS_UNUSED void *\n"
+    "perlxs_object ( pTHX_ SV * sv, const char * klass, const char * name )\n"
+    "{\n"
+    "  if ( !SvROK(sv) || !sv_derived_from(sv, klass) ) {\n"
+    "    croak(\"%s is not of type %s\", name, klass);\n"
+    "  }\n"
+    "  return INT2PTR(void *, SvIV((SV *)SvRV(sv)));\n"
+    "}\n"
+    "\n"
+    "// 64-bit integers are passed to Perl as decimal strings.\n"
+    "\n"
+    "static PERLXS_UNUSED char *\n"
+    "perlxs_u64_digits ( unsigned long long v, char * end )\n"
+    "{\n"
+    "  do {\n"
+    "    *--end = (char)('0' + v % 10);\n"
+    "    v /= 10;\n"
+    "  } while ( v != 0 );\n"
+    "  return end;\n"
+    "}\n"
+    "\n"
+    "static PERLXS_UNUSED SV *\n"
+    "perlxs_newSVu64 ( pTHX_ unsigned long long v )\n"
+    "{\n"
+    "  char   buf[24];\n"
+    "  char * p = perlxs_u64_digits(v, buf + sizeof(buf));\n"
+    "\n"
+    "  return newSVpvn(p, buf + sizeof(buf) - p);\n"
+    "}\n"
+    "\n"
+    "static PERLXS_UNUSED SV *\n"
+    "perlxs_newSVi64 ( pTHX_ long long v )\n"
+    "{\n"
+    "  char   buf[24];\n"
+    "  char * p;\n"
+    "\n"
+    "  if ( v < 0 ) {\n"
+    "    p = perlxs_u64_digits(0ULL - (unsigned long long)v,\n"
+    "                          buf + sizeof(buf));\n"
+    "    *--p = '-';\n"
+    "  } else {\n"
+    "    p = perlxs_u64_digits(v, buf + sizeof(buf));\n"
+    "  }\n"
+    "  return newSVpvn(p, buf + sizeof(buf) - p);\n"
+    "}\n"
+    "\n"
+    "// Plain integers are taken as they are when an IV holds 64 bits;\n"
+    "// anything else goes through the string form.\n"
+    "\n"
+    "static PERLXS_UNUSED long long\n"
+    "perlxs_SvI64 ( pTHX_ SV * sv )\n"
+    "{\n"
+    "#if IVSIZE >= 8\n"
+    "  if ( SvIOK(sv) && !SvIsUV(sv) ) {\n"
+    "    return SvIVX(sv);\n"
+    "  }\n"
+    "#endif\n"
+    "  return strtoll(SvPV_nolen(sv), NULL, 0);\n"
+    "}\n"
+    "\n"
+    "static PERLXS_UNUSED unsigned long long\n"
+    "perlxs_SvU64 ( pTHX_ SV * sv )\n"
+    "{\n"
+    "#if IVSIZE >= 8\n"
+    "  if ( SvIOK(sv) && (SvIsUV(sv) || SvIVX(sv) >= 0) ) {\n"
+    "    return SvUVX(sv);\n"
+    "  }\n"
+    "#endif\n"
+    "  return strtoull(SvPV_nolen(sv), NULL, 0);\n"
+    "}\n"
+    "\n"
+    "// With (perlxs.int64_as) = NATIVE, as plain integers where they fit.\n"
+    "\n"
+    "static PERLXS_UNUSED SV *\n"
+    "perlxs_newSViv64 ( pTHX_ long long v )\n"
+    "{\n"
+    "#if IVSIZE >= 8\n"
+    "  return newSViv((IV)v);\n"
+    "#else\n"
+    "  return perlxs_newSVi64(aTHX_ v);\n"
+    "#endif\n"
+    "}\n"
+    "\n"
+    "static PERLXS_UNUSED SV *\n"
+    "perlxs_newSVuv64 ( pTHX_ unsigned long long v )\n"
+    "{\n"
+    "#if IVSIZE >= 8\n"
+    "  return newSVuv((UV)v);\n"
+    "#else\n"
+    "  return perlxs_newSVu64(aTHX_ v);\n"
+    "#endif\n"
+    "}\n"
+    "\n"
+    "static PERLXS_UNUSED SV *\n"
+    "perlxs_newSVstring ( pTHX_ const std::string & s )\n"
+    "{\n"
+    "  return newSVpvn(s.data(), s.length());\n"
+    "}\n"
+    "\n"
+    "// Stores \"sv\" under \"key\", dropping it if the store fails (as it\n"
+    "// can for a tied or restricted hash).\n"
+    "\n"
+    "static PERLXS_UNUSED void\n"
+    "perlxs_hv_store ( pTHX_ HV * hv, const char * key, I32 klen, SV * sv )\n"
+    "{\n"
+    "  if ( hv_store(hv, key, klen, sv, 0) == NULL ) {\n"
+    "    SvREFCNT_dec(sv);\n"
+    "  }\n"
+    "}\n"
+    "\n"
+    "static PERLXS_UNUSED HV *\n"
+    "perlxs_hashref ( pTHX_ SV * sv )\n"
+    "{\n"
+    "  if ( SvROK(sv) && SvTYPE(SvRV(sv)) == SVt_PVHV ) {\n"
+    "    return (HV *)SvRV(sv);\n"
+    "  }\n"
+    "  return NULL;\n"
+    "}\n"
+    "\n"
+    "static PERLXS_UNUSED AV *\n"
+    "perlxs_arrayref ( pTHX_ SV * sv )\n"
+    "{\n"
+    "  if ( SvROK(sv) && SvTYPE(SvRV(sv)) == SVt_PVAV ) {\n"
+    "    return (AV *)SvRV(sv);\n"
+    "  }\n"
+    "  return NULL;\n"
+    "}\n"
+    "\n"
+    "// A new object of class \"klass\" that owns \"ptr\".\n"
+    "\n"
+    "static PERLXS_UNUSED SV *\n"
+    "perlxs_newobject ( pTHX_ const char * klass, void * ptr )\n"
+    "{\n"
+    "  SV * sv = newSV(0);\n"
+    "\n"
+    "  sv_setref_pv(sv, klass, ptr);\n"
+    "  return sv;\n"
+    "}\n"
+    "\n"
+    "// With (perlxs.getter) = BORROW, a submessage is handed out as an\n"
+    "// object that points into its parent.  Its magic holds a reference\n"
+    "// to the parent, so the parent lives at least as long, and tells\n"
+    "// DESTROY not to delete it.  The magic is found by mg_private rather\n"
+    "// than by vtable, which differs between XS shards.\n"
+    "\n"
+    "// A frozen object croaks on any method that would change it.  Objects\n"
+    "// borrowed from a frozen parent are frozen too.\n"
+    "\n"
+    "#define PERLXS_BORROW_MAGIC 0x5042\n"
+    "#define PERLXS_FROZEN_MAGIC 0x5046\n"
+    "\n"
+    "static PERLXS_UNUSED void\n"
+    "perlxs_add_magic ( pTHX_ SV * sv, SV * obj, U16 id )\n"
+    "{\n"
+    "  MAGIC * mg = sv_magicext(SvRV(sv), obj, PERL_MAGIC_ext, NULL, NULL, 0);\n"
+    "\n"
+    "  mg->mg_private = id;\n"
+    "}\n"
+    "\n"
+    "static PERLXS_UNUSED int\n"
+    "perlxs_has_magic ( pTHX_ SV * sv, U16 id )\n"
+    "{\n"
+    "  if ( SvROK(sv) && SvMAGICAL(SvRV(sv)) ) {\n"
+    "    for ( MAGIC * mg = SvMAGIC(SvRV(sv)); mg; mg = mg->mg_moremagic ) {\n"
+    "      if ( mg->mg_type == PERL_MAGIC_ext && mg->mg_private == id ) {\n"
+    "        return 1;\n"
+    "      }\n"
+    "    }\n"
+    "  }\n"
+    "  return 0;\n"
+    "}\n"
+    "\n"
+    "static PERLXS_UNUSED int\n"
+    "perlxs_borrowed ( pTHX_ SV * sv )\n"
+    "{\n"
+    "  return perlxs_has_magic(aTHX_ sv, PERLXS_BORROW_MAGIC);\n"
+    "}\n"
+    "\n"
+    "static PERLXS_UNUSED int\n"
+    "perlxs_frozen ( pTHX_ SV * sv )\n"
+    "{\n"
+    "  return perlxs_has_magic(aTHX_ sv, PERLXS_FROZEN_MAGIC);\n"
+    "}\n"
+    "\n"
+    "static PERLXS_UNUSED SV *\n"
+    "perlxs_borrow ( pTHX_ SV * parent, const char * klass, void * ptr )\n"
+    "{\n"
+    "  SV * sv = perlxs_newobject(aTHX_ klass, ptr);\n"
+    "\n"
+    "  perlxs_add_magic(aTHX_ sv, SvRV(parent), PERLXS_BORROW_MAGIC);\n"
+    "  if ( perlxs_frozen(aTHX_ parent) ) {\n"
+    "    perlxs_add_magic(aTHX_ sv, NULL, PERLXS_FROZEN_MAGIC);\n"
+    "  }\n"
+    "  return sv;\n"
+    "}\n"
+    "\n"
+    "// perlxs_object() for the methods that change the object.\n"
+    "\n"
+    "static PERLXS_UNUSED void *\n"
+    "perlxs_mutable_object ( pTHX_ SV * sv, const char * klass,\n"
+    "                        const char * name )\n"
+    "{\n"
+    "  void * ptr = perlxs_object(aTHX_ sv, klass, name);\n"
+    "\n"
+    "  if ( perlxs_frozen(aTHX_ sv) ) {\n"
+    "    croak(\"Modification of a read-only %s object\", klass);\n"
+    "  }\n"
+    "  return ptr;\n"
+    "}\n"
+    "\n"
+    "// The C++ default instance of \"klass\", as a frozen object.  There\n"
+    "// is one per class and interpreter.  BOOT makes it, so that it is\n"
+    "// in place before a preforking parent forks and its pages are not\n"
+    "// written to in the children.\n"
+    "\n"
+    "static PERLXS_UNUSED SV *\n"
+    "perlxs_default_instance ( pTHX_ const char * klass, const void * ptr )\n"
+    "{\n"
+    "  std::string key = std::string(\"perlxs::default::\") + klass;\n"
+    "  SV **      svp = hv_fetch(PL_modglobal, key.data(), key.length(), 1);\n"
+    "\n"
+    "  if ( !sv_isobject(*svp) ) {\n"
+    "    SV * sv = perlxs_newobject(aTHX_ klass, (void *)ptr);\n"
+    "\n"
+    "    perlxs_add_magic(aTHX_ sv, NULL, PERLXS_BORROW_MAGIC);\n"
+    "    perlxs_add_magic(aTHX_ sv, NULL, PERLXS_FROZEN_MAGIC);\n"
+    "    sv_setsv(*svp, sv);\n"
+    "    SvREFCNT_dec(sv);\n"
+    "  }\n"
+    "  return newSVsv(*svp);\n"
+    "}\n"
+    "\n"
+    "// How to copy and delete the C++ objects of one message type.\n"
+    "\n"
+    "struct perlxs_class {\n"
+    "  void * (*copy)(const void *);\n"
+    "  void   (*destroy)(void *);\n"
+    "};\n"
+    "\n"
+    "// freeze() makes a frozen object whose C++ message is shared,\n"
+    "// without copying, with every interpreter the object is cloned\n"
+    "// into.  The last one to let go of it deletes it.\n"
+    "\n"
+    "#define PERLXS_SHARED_MAGIC 0x5053\n"
+    "\n"
+    "struct perlxs_shared {\n"
+    "  unsigned long        refcnt;\n"
+    "  void *               msg;\n"
+    "  const perlxs_class * klass;\n"
+    "};\n"
+    "\n"
+    "// Adds \"n\" to the count of interpreters sharing the message and\n"
+    "// returns the new count.  Without the GCC atomic builtins, perl's\n"
+    "// own op refcount mutex guards it (which is a no-op on a perl\n"
+    "// without threads).\n"
+    "\n"
+    "static unsigned long\n"
+    "perlxs_shared_refcnt ( pTHX_ perlxs_shared * shared, long n )\n"
+    "{\n"
+    "#ifdef __GNUC__\n"
+    "  PERL_UNUSED_CONTEXT;\n"
+    "  return __sync_add_and_fetch(&shared->refcnt, (unsigned long)n);\n"
+    "#else\n"
+    "  unsigned long refcnt;\n"
+    "\n"
+    "  OP_REFCNT_LOCK;\n"
+    "  refcnt = shared->refcnt += (unsigned long)n;\n"
+    "  OP_REFCNT_UNLOCK;\n"
+    "  return refcnt;\n"
+    "#endif\n"
+    "}\n"
+    "\n"
+    "static int\n"
+    "perlxs_shared_free ( pTHX_ SV * sv, MAGIC * mg )\n"
+    "{\n"
+    "  perlxs_shared * shared = (perlxs_shared *)mg->mg_ptr;\n"
+    "\n"
+    "  PERL_UNUSED_ARG(sv);\n"
+    "  if ( perlxs_shared_refcnt(aTHX_ shared, -1) == 0 ) {\n"
+    "    shared->klass->destroy(shared->msg);\n"
+    "    delete shared;\n"
+    "  }\n"
+    "  return 0;\n"
+    "}\n"
+    "\n"
+    "#ifdef USE_ITHREADS\n"
+    "static int\n"
+    "perlxs_shared_dup ( pTHX_ MAGIC * mg, CLONE_PARAMS * param )\n"
+    "{\n"
+    "  PERL_UNUSED_ARG(param);\n"
+    "  perlxs_shared_refcnt(aTHX_ (perlxs_shared *)mg->mg_ptr, 1);\n"
+    "  return 0;\n"
+    "}\n"
+    "#else\n"
+    "#define perlxs_shared_dup NULL\n"
+    "#endif\n"
+    "\n"
+    "static MGVTBL perlxs_shared_vtbl = {\n"
+    "  NULL, NULL, NULL, NULL, perlxs_shared_free, NULL, perlxs_shared_dup, NULL\n"
+    "};\n"
+    "\n"
+    "static PERLXS_UNUSED SV *\n"
+    "perlxs_share ( pTHX_ const char * klass, void * msg,\n"
+    "               const perlxs_class * k )\n"
+    "{\n"
+    "  SV *            sv = perlxs_newobject(aTHX_ klass, msg);\n"
+    "  perlxs_shared * shared = new perlxs_shared;\n"
+    "  MAGIC *         mg;\n"
+    "\n"
+    "  shared->refcnt = 1;\n"
+    "  shared->msg = msg;\n"
+    "  shared->klass = k;\n"
+    "  mg = sv_magicext(SvRV(sv), NULL, PERL_MAGIC_ext, &perlxs_shared_vtbl,\n"
+    "                   (const char *)shared, 0);\n"
+    "  mg->mg_private = PERLXS_SHARED_MAGIC;\n"
+    "  mg->mg_flags |= MGf_DUP;\n"
+    "  perlxs_add_magic(aTHX_ sv, NULL, PERLXS_BORROW_MAGIC);\n"
+    "  perlxs_add_magic(aTHX_ sv, NULL, PERLXS_FROZEN_MAGIC);\n"
+    "  return sv;\n"
+    "}\n"
+    "\n"
+    "// With --perlxs-ithreads, each object carries magic that gives the\n"
+    "// interpreter it is cloned into a copy of its C++ message.  The copy\n"
+    "// of an object that was borrowed is owned by the magic, not by\n"
+    "// DESTROY, since the new object is still marked as borrowed.\n"
+    "\n"
+    "#define PERLXS_CLONE_MAGIC          0x5043\n"
+    "#define PERLXS_CLONE_BORROWED_MAGIC 0x5062\n"
+    "#define PERLXS_CLONE_COPY_MAGIC     0x5063\n"
+    "\n"
+    "#ifdef USE_ITHREADS\n"
+    "static int perlxs_clone_dup ( pTHX_ MAGIC * mg, CLONE_PARAMS * param );\n"
+    "\n"
+    "static int\n"
+    "perlxs_clone_free ( pTHX_ SV * sv, MAGIC * mg )\n"
+    "{\n"
+    "  ((const perlxs_class *)mg->mg_ptr)->destroy(INT2PTR(void *, SvIVX(sv)));\n"
+    "  return 0;\n"
+    "}\n"
+    "\n"
+    "static MGVTBL perlxs_clone_vtbl = {\n"
+    "  NULL, NULL, NULL, NULL, NULL, NULL, perlxs_clone_dup, NULL\n"
+    "};\n"
+    "\n"
+    "static MGVTBL perlxs_clone_copy_vtbl = {\n"
+    "  NULL, NULL, NULL, NULL, perlxs_clone_free, NULL, perlxs_clone_dup, NULL\n"
+    "};\n"
+    "\n"
+    "static int\n"
+    "perlxs_clone_dup ( pTHX_ MAGIC * mg, CLONE_PARAMS * param )\n"
+    "{\n"
+    "  SV * sv = mg->mg_obj;\n"
+    "  const perlxs_class * k = (const perlxs_class *)mg->mg_ptr;\n"
+    "\n"
+    "  PERL_UNUSED_ARG(param);\n"
+    "  SvIV_set(sv, PTR2IV(k->copy(INT2PTR(void *, SvIVX(sv)))));\n"
+    "  if ( mg->mg_private == PERLXS_CLONE_BORROWED_MAGIC ) {\n"
+    "    mg->mg_private = PERLXS_CLONE_COPY_MAGIC;\n"
+    "    mg->mg_virtual = &perlxs_clone_copy_vtbl;\n"
+    "  }\n"
+    "  return 0;\n"
+    "}\n"
+    "#endif\n"
+    "\n"
+    "static PERLXS_UNUSED SV *\n"
+    "perlxs_cloneable ( pTHX_ SV * sv, const perlxs_class * k )\n"
+    "{\n"
+    "#ifdef USE_ITHREADS\n"
+    "  MAGIC * mg = sv_magicext(SvRV(sv), SvRV(sv), PERL_MAGIC_ext,\n"
+    "                           &perlxs_clone_vtbl, (const char *)k, 0);\n"
+    "\n"
+    "  mg->mg_private = perlxs_borrowed(aTHX_ sv) ?\n"
+    "    PERLXS_CLONE_BORROWED_MAGIC : PERLXS_CLONE_MAGIC;\n"
+    "  mg->mg_flags |= MGf_DUP;\n"
+    "#else\n"
+    "  PERL_UNUSED_ARG(k);\n"
+    "#endif\n"
+    "  return sv;\n"
+    "}\n"
+    "\n"
+    "// Enum names are looked up in a table built by protoxs, indexed by\n"
+    "// perlxs_enum_hash() of the name with a seed chosen so that no two\n"
+    "// names of the enum collide.\n"
+    "\n"
+    "struct perlxs_enum_entry {\n"
+    "  const char * name;\n"
+    "  STRLEN       len;\n"
+    "  int          value;\n"
+    "};\n"
+    "\n"
+    "static PERLXS_UNUSED U32\n"
+    "perlxs_enum_hash ( const char * s, STRLEN len, U32 seed )\n"
+    "{\n"
+    "  U32 h = 2166136261U ^ seed;\n"
+    "\n"
+    "  for ( STRLEN i = 0; i < len; i++ ) {\n"
+    "    h ^= (unsigned char)s[i];\n"
+    "    h *= 16777619U;\n"
+    "  }\n"
+    "  return h;\n"
+    "}\n"
+    "\n"
+    "// With --perlxs-enum-as-name, enums go into hashrefs by name, and\n"
+    "// are taken from them by name or by number.\n"
+    "\n"
+    "static PERLXS_UNUSED SV *\n"
+    "perlxs_newSVenum ( pTHX_ const char * name, int value )\n"
+    "{\n"
+    "  return name != NULL ? newSVpv(name, 0) : newSViv(value);\n"
+    "}\n"
+    "\n"
+    "static PERLXS_UNUSED int\n"
+    "perlxs_SvEnum ( pTHX_ SV * sv,\n"
+    "                int (*value_of)(const char *, STRLEN, int *),\n"
+    "                const char * klass )\n"
+    "{\n"
+    "  const char * name;\n"
+    "  STRLEN       len;\n"
+    "  int          value;\n"
+    "\n"
+    "  if ( SvIOK(sv) || SvNOK(sv) || looks_like_number(sv) ) {\n"
+    "    return SvIV(sv);\n"
+    "  }\n"
+    "  name = SvPV(sv, len);\n"
+    "  if ( !value_of(name, len, &value) ) {\n"
+    "    croak(\"%s is not a value of %s\", name, klass);\n"
+    "  }\n"
+    "  return value;\n"
+    "}\n"
+    "\n"
+    "// XXH64, for digest().  The state takes input in pieces of any size\n"
+    "// and gives the same hash as XXH64 over all of it at once.\n"
+    "\n"
+    "#define PERLXS_XXH_P1 11400714785074694791ULL\n"
+    "#define PERLXS_XXH_P2 14029467366897019727ULL\n"
+    "#define PERLXS_XXH_P3 1609587929392839161ULL\n"
+    "#define PERLXS_XXH_P4 9650029242287828579ULL\n"
+    "#define PERLXS_XXH_P5 2870177450012600261ULL\n"
+    "\n"
+    "typedef struct {\n"
+    "  unsigned long long total;\n"
+    "  unsigned long long v[4];\n"
+    "  unsigned char      mem[32];\n"
+    "  unsigned           memsize;\n"
+    "  unsigned long long seed;\n"
+    "} perlxs_xxh64;\n"
+    "\n"
+    "static inline unsigned long long\n"
+    "perlxs_xxh_rotl ( unsigned long long x, int r )\n"
+    "{\n"
+    "  return ( x << r ) | ( x >> ( 64 - r ) );\n"
+    "}\n"
+    "\n"
+    "static inline unsigned long long\n"
+    "perlxs_xxh_read ( const unsigned char * p, int n )\n"
+    "{\n"
+    "  unsigned long long v = 0;\n"
+    "\n"
+    "  while ( n-- > 0 ) {\n"
+    "    v = ( v << 8 ) | p[n];\n"
+    "  }\n"
+    "  return v;\n"
+    "}\n"
+    "\n"
+    "static inline unsigned long long\n"
+    "perlxs_xxh_round ( unsigned long long acc, unsigned long long input )\n"
+    "{\n"
+    "  acc += input * PERLXS_XXH_P2;\n"
+    "  return perlxs_xxh_rotl(acc, 31) * PERLXS_XXH_P1;\n"
+    "}\n"
+    "\n"
+    "static PERLXS_UNUSED void\n"
+    "perlxs_xxh64_init ( perlxs_xxh64 * s, unsigned long long seed )\n"
+    "{\n"
+    "  memset(s, 0, sizeof(*s));\n"
+    "  s->seed = seed;\n"
+    "  s->v[0] = seed + PERLXS_XXH_P1 + PERLXS_XXH_P2;\n"
+    "  s->v[1] = seed + PERLXS_XXH_P2;\n"
+    "  s->v[2] = seed;\n"
+    "  s->v[3] = seed - PERLXS_XXH_P1;\n"
+    "}\n"
+    "\n"
+    "static PERLXS_UNUSED void\n"
+    "perlxs_xxh64_update ( perlxs_xxh64 * s, const void * data, size_t len )\n"
+    "{\n"
+    "  const unsigned char * p = (const unsigned char *)data;\n"
+    "  const unsigned char * end = p + len;\n"
+    "\n"
+    "  s->total += len;\n"
+    "  if ( s->memsize + len < 32 ) {\n"
+    "    memcpy(s->mem + s->memsize, p, len);\n"
+    "    s->memsize += (unsigned)len;\n"
+    "    return;\n"
+    "  }\n"
+    "  if ( s->memsize > 0 ) {\n"
+    "    memcpy(s->mem + s->memsize, p, 32 - s->memsize);\n"
+    "    p += 32 - s->memsize;\n"
+    "    for ( int i = 0; i < 4; i++ ) {\n"
+    "      s->v[i] = perlxs_xxh_round(s->v[i], perlxs_xxh_read(s->mem + i * 8, 8));\n"
+    "    }\n"
+    "    s->memsize = 0;\n"
+    "  }\n"
+    "  for ( ; p + 32 <= end; p += 32 ) {\n"
+    "    for ( int i = 0; i < 4; i++ ) {\n"
+    "      s->v[i] = perlxs_xxh_round(s->v[i], perlxs_xxh_read(p + i * 8, 8));\n"
+    "    }\n"
+    "  }\n"
+    "  if ( p < end ) {\n"
+    "    memcpy(s->mem, p, end - p);\n"
+    "    s->memsize = (unsigned)( end - p );\n"
+    "  }\n"
+    "}\n"
+    "\n"
+    "static PERLXS_UNUSED unsigned long long\n"
+    "perlxs_xxh64_digest ( const perlxs_xxh64 * s )\n"
+    "{\n"
+    "  const unsigned char * p = s->mem;\n"
+    "  const unsigned char * end = p + s->memsize;\n"
+    "  unsigned long long    h;\n"
+    "\n"
+    "  if ( s->total >= 32 ) {\n"
+    "    h = perlxs_xxh_rotl(s->v[0], 1) + perlxs_xxh_rotl(s->v[1], 7) +\n"
+    "      perlxs_xxh_rotl(s->v[2], 12) + perlxs_xxh_rotl(s->v[3], 18);\n"
+    "    for ( int i = 0; i < 4; i++ ) {\n"
+    "      h ^= perlxs_xxh_round(0, s->v[i]);\n"
+    "      h = h * PERLXS_XXH_P1 + PERLXS_XXH_P4;\n"
+    "    }\n"
+    "  } else {\n"
+    "    h = s->seed + PERLXS_XXH_P5;\n"
+    "  }\n"
+    "  h += s->total;\n"
+    "\n"
+    "  for ( ; p + 8 <= end; p += 8 ) {\n"
+    "    h ^= perlxs_xxh_round(0, perlxs_xxh_read(p, 8));\n"
+    "    h = perlxs_xxh_rotl(h, 27) * PERLXS_XXH_P1 + PERLXS_XXH_P4;\n"
+    "  }\n"
+    "  if ( p + 4 <= end ) {\n"
+    "    h ^= perlxs_xxh_read(p, 4) * PERLXS_XXH_P1;\n"
+    "    h = perlxs_xxh_rotl(h, 23) * PERLXS_XXH_P2 + PERLXS_XXH_P3;\n"
+    "    p += 4;\n"
+    "  }\n"
+    "  for ( ; p < end; p++ ) {\n"
+    "    h ^= *p * PERLXS_XXH_P5;\n"
+    "    h = perlxs_xxh_rotl(h, 11) * PERLXS_XXH_P1;\n"
+    "  }\n"
+    "\n"
+    "  h ^= h >> 33;\n"
+    "  h *= PERLXS_XXH_P2;\n"
+    "  h ^= h >> 29;\n"
+    "  h *= PERLXS_XXH_P3;\n"
+    "  h ^= h >> 32;\n"
+    "\n"
+    "  return h;\n"
+    "}\n"
+    "\n"
+    "// With --perlxs-custom-ops, calls of accessors as functions, as in\n"
+    "// Foo::Bar::name(msg), are replaced at compile time by a custom op\n"
+    "// that runs the accessor without entersub.  Method calls cannot be\n"
+    "// resolved at compile time, so they are left as they are.  Only calls\n"
+    "// whose arguments are all scalar expressions are replaced.\n"
+    "\n"
+    "#if PERL_REVISION == 5 && PERL_VERSION >= 22\n"
+    "#define PERLXS_CUSTOM_OPS 1\n"
+    "\n"
+    "static XOP perlxs_get_xop;\n"
+    "static XOP perlxs_set_xop;\n"
+    "\n"
+    "static OP *\n"
+    "perlxs_ck_accessor ( pTHX_ OP * entersubop, SV * ckobj, int nargs )\n"
+    "{\n"
+    "  OP * parent = entersubop;\n"
+    "  OP * pushop = cUNOPx(entersubop)->op_first;\n"
+    "  OP * args[2];\n"
+    "  OP * o;\n"
+    "  int  n = 0;\n"
+    "\n"
+    "  if ( !OpHAS_SIBLING(pushop) ) {\n"
+    "    parent = pushop;\n"
+    "    pushop = cUNOPx(pushop)->op_first;\n"
+    "  }\n"
+    "\n"
+    "  // The last sibling is the op that yields the CV.\n"
+    "\n"
+    "  for ( o = OpSIBLING(pushop); o != NULL && OpHAS_SIBLING(o);\n"
+    "        o = OpSIBLING(o) ) {\n"
+    "    if ( n == nargs || !(PL_opargs[o->op_type] & OA_RETSCALAR) ) {\n"
+    "      return entersubop;\n"
+    "    }\n"
+    "    n++;\n"
+    "  }\n"
+    "  if ( n != nargs ) {\n"
+    "    return entersubop;\n"
+    "  }\n"
+    "\n"
+    "  for ( n = 0; n < nargs; n++ ) {\n"
+    "    args[n] = op_contextualize(op_sibling_splice(parent, pushop, 1, NULL),\n"
+    "                               G_SCALAR);\n"
+    "  }\n"
+    "  op_free(entersubop);\n"
+    "\n"
+    "  o = ( nargs == 1 ) ? newUNOP(OP_CUSTOM, 0, args[0]) :\n"
+    "    newBINOP(OP_CUSTOM, 0, args[0], args[1]);\n"
+    "  o->op_ppaddr = INT2PTR(Perl_ppaddr_t, SvIVX(ckobj));\n"
+    "  return o;\n"
+    "}\n"
+    "\n"
+    "static OP *\n"
+    "perlxs_ck_get ( pTHX_ OP * entersubop, GV * namegv, SV * ckobj )\n"
+    "{\n"
+    "  PERL_UNUSED_ARG(namegv);\n"
+    "  return perlxs_ck_accessor(aTHX_ entersubop, ckobj, 1);\n"
+    "}\n"
+    "\n"
+    "static OP *\n"
+    "perlxs_ck_set ( pTHX_ OP * entersubop, GV * namegv, SV * ckobj )\n"
+    "{\n"
+    "  PERL_UNUSED_ARG(namegv);\n"
+    "  return perlxs_ck_accessor(aTHX_ entersubop, ckobj, 2);\n"
+    "}\n"
+    "#endif\n"
+    "\n"
+    "// Installs the call checker for the accessor \"name\", whose custom\n"
+    "// op runs \"pp\".  \"set\" is true for a setter, which takes two\n"
+    "// arguments rather than one.\n"
+    "\n"
+    "static PERLXS_UNUSED void\n"
+    "perlxs_custom_op ( pTHX_ const char * name, OP * (*pp)(pTHX), int set )\n"
+    "{\n"
+    "#ifdef PERLXS_CUSTOM_OPS\n"
+    "  CV *  cv = get_cv(name, 0);\n"
+    "  XOP * xop = set ? &perlxs_set_xop : &perlxs_get_xop;\n"
+    "\n"
+    "  if ( cv == NULL ) {\n"
+    "    return;\n"
+    "  }\n"
+    "  if ( XopENTRY(xop, xop_name) == NULL ) {\n"
+    "    XopENTRY_set(xop, xop_name, set ? \"perlxs_set\" : \"perlxs_get\");\n"
+    "    XopENTRY_set(xop, xop_desc, set ? \"Perl/XS field setter\" :\n"
+    "                 \"Perl/XS field getter\");\n"
+    "    XopENTRY_set(xop, xop_class, set ? OA_BINOP : OA_UNOP);\n"
+    "  }\n"
+    "  Perl_custom_op_register(aTHX_ pp, xop);\n"
+    "  cv_set_call_checker(cv, set ? perlxs_ck_set : perlxs_ck_get,\n"
+    "                      newSViv(PTR2IV(pp)));\n"
+    "#else\n"
+    "  PERL_UNUSED_ARG(name);\n"
+    "  PERL_UNUSED_ARG(pp);\n"
+    "  PERL_UNUSED_ARG(set);\n"
+    "#endif\n"
+    "}\n"
+    "\n"
+    "#endif  // PERLXS_RUNTIME_H\n");
+}
+
+
+// --perlxs-shards: every shard is an XS source of its own, with its own
+// MODULE and boot function, so the shards compile in parallel.  The
+// main XS source only boots the shards, passing its own arguments on.
+
+void
+PerlXSGenerator::GenerateShardedXS(const vector<const FileDescriptor*>& files,
+				   OutputDirectory* outdir) const
+{
+  vector<vector<const Descriptor*> > shards;
+
+  ShardMessages(files, shards);
+
+  for ( size_t k = 0; k < shards.size(); k++ ) {
+    GenerateXSShard(files, shards[k], k, outdir);
+  }
+  GenerateXSShardBoot(files, shards.size(), outdir);
+}
+
+// The MODULE of shard k.
+
+string
+PerlXSGenerator::XSShardModuleName(const vector<const FileDescriptor*>& files,
+				   size_t k) const
+{
+  ostringstream ost;
+
+  ost << XSModuleName(files[0]) << "::_shard" << k;
+
+  return ost.str();
+}
+
+// The XS source of shard k, holding the given messages.
+
+void
+PerlXSGenerator::GenerateXSShard(const vector<const FileDescriptor*>& files,
+				 const vector<const Descriptor*>& messages,
+				 size_t k,
+				 OutputDirectory* outdir) const
+{
+  ostringstream ost;
+
+  ost << PerlPackageName(perlxs_package_) << "_" << k << ".xs";
+
+  scoped_ptr<io::ZeroCopyOutputStream> output(outdir->Open(ost.str()));
+  io::Printer printer(output.get(), '$');
+  vector<const FileDescriptor*> shard_files;
+  vector<const EnumDescriptor*> enums;
+
+  // Only the files of this shard's messages are included.  The
+  // top-level enums all go into the first shard.
+
+  for ( size_t i = 0; i < messages.size(); i++ ) {
+    const FileDescriptor* file = messages[i]->file();
+
+    if ( find(shard_files.begin(), shard_files.end(), file) ==
+	 shard_files.end() ) {
+      shard_files.push_back(file);
+    }
+  }
+  for ( size_t f = 0; k == 0 && f < files.size(); f++ ) {
+    for ( int i = 0; i < files[f]->enum_type_count(); i++ ) {
+      enums.push_back(files[f]->enum_type(i));
+    }
+    if ( files[f]->enum_type_count() > 0 &&
+	 find(shard_files.begin(), shard_files.end(), files[f]) ==
+	 shard_files.end() ) {
+      shard_files.push_back(files[f]);
+    }
+  }
+
+  GenerateXSPreamble(shard_files, printer);
+  GenerateXSMessages(messages, enums, XSShardModuleName(files, k), printer);
+}
+
+// The main XS source of a sharded build, which only boots the shards.
+
+void
+PerlXSGenerator::GenerateXSShardBoot(const vector<const FileDescriptor*>& files,
+				     size_t count,
+				     OutputDirectory* outdir) const
+{
+  vector<string> modules;
+
+  for ( size_t k = 0; k < count; k++ ) {
+    modules.push_back(XSShardModuleName(files, k));
+  }
+
+  string filename = PerlPackageName(perlxs_package_)+".xs";
+  scoped_ptr<io::ZeroCopyOutputStream> output(outdir->Open(filename));
+  io::Printer printer(output.get(), '$');
+
+  printer.Print("#ifdef __cplusplus\n"
 		"extern \"C\" {\n"
 		"#endif\n"
 		"#include \"EXTERN.h\"\n"
 		"#include \"perl.h\"\n"
 		"#include \"XSUB.h\"\n"
-		"#ifdef __cplusplus\n"
-		"}\n"
-		"#endif\n"
-		"#ifdef do_open\n"
-		"#undef do_open\n"
-		"#endif\n"
-		"#ifdef do_close\n"
-		"#undef do_close\n"
-		"#endif\n"
-		"#ifdef New\n"
-		"#undef New\n"
+		"#ifndef XS_EXTERNAL\n"
+		"#define XS_EXTERNAL(name) XS(name)\n"
 		"#endif\n"
-		"#include <stdint.h>\n"
-		"#include <sstream>\n"
-		"#include <google/protobuf/stubs/common.h>\n"
-		"#include <google/protobuf/io/zero_copy_stream.h>\n"
-		"#include \"$proto$.pb.h\"\n"
-		"\n"
-		"using namespace std;\n"
-		"\n"
-	);
+		"\n");
 
-  // ZeroCopyOutputStream implementation (for improved pack() performance)
+  for ( size_t k = 0; k < modules.size(); k++ ) {
+    printer.Print("XS_EXTERNAL(boot_$module$);\n",
+		  "module", StringReplace(modules[k], "::", "__", true));
+  }
 
-  printer.Print(vars,
-		"class $proto$_OutputStream :\n"
-		"  public google::protobuf::io::ZeroCopyOutputStream {\n"
-		"public:\n"
-		"  explicit $proto$_OutputStream(SV * sv) :\n"
-		"  sv_(sv), len_(0) {}\n"
-		"  ~$proto$_OutputStream() {}\n"
+  printer.Print("#ifdef __cplusplus\n"
+		"}\n"
+		"#endif\n"
 		"\n"
-		"  bool Next(void** data, int* size)\n"
-		"  {\n"
-		"    STRLEN nlen = len_ << 1;\n"
+		"// Calls the boot function of a shard with our own arguments,\n"
+		"// pushed above them, so that what it returns in ST(0) does\n"
+		"// not overwrite them for the next shard.  The stack is left\n"
+		"// as it was found.\n"
 		"\n"
-		"    if ( nlen < 16 ) nlen = 16;\n"
-		"    SvGROW(sv_, nlen);\n"
-		"    *data = SvEND(sv_) + len_;\n"
-		"    *size = SvLEN(sv_) - len_;\n"
-		"    len_ = nlen;\n"
+		"static void\n"
+		"perlxs_call_boot(pTHX_ void (*boot)(pTHX_ CV *), CV * cv, "
+		"I32 ax, I32 items)\n"
+		"{\n"
+		"  dSP;\n"
+		"  SSize_t top = SP - PL_stack_base;\n"
+		"  I32     i;\n"
 		"\n"
-		"    return true;\n"
+		"  PUSHMARK(SP);\n"
+		"  EXTEND(SP, items);\n"
+		"  for ( i = 0; i < items; i++ ) {\n"
+		"    PUSHs(PL_stack_base[ax + i]);\n"
 		"  }\n"
+		"  PUTBACK;\n"
+		"  (*boot)(aTHX_ cv);\n"
+		"  PL_stack_sp = PL_stack_base + top;\n"
+		"}\n"
 		"\n"
-		"  void BackUp(int count)\n"
-		"  {\n"
-		"    SvCUR_set(sv_, SvLEN(sv_) - count);\n"
-		"  }\n"
 		"\n"
-		"  void Sync() {\n"
-		"    if ( SvCUR(sv_) == 0 ) {\n"
-		"      SvCUR_set(sv_, len_);\n"
-		"    }\n"
-		"  }\n"
-		"\n"
-		"  google::protobuf::int64 ByteCount() const\n"
-		"  {\n"
-		"    return (google::protobuf::int64)SvCUR(sv_);\n"
-		"  }\n"
-		"\n"
-		"private:\n"
-		"  SV * sv_;\n"
-		"  STRLEN len_;\n"
-		"\n"
-		"  GOOGLE_DISALLOW_EVIL_CONSTRUCTORS($proto$_OutputStream);\n"
-		"};\n"
+		"MODULE = $module$   PACKAGE = $module$\n"
+		"PROTOTYPES: DISABLE\n"
 		"\n"
-		"\n"
-		);
+		"BOOT:\n",
+		"module", XSModuleName(files[0]));
 
-  // Typedefs, Statics, and XS packages
+  for ( size_t k = 0; k < modules.size(); k++ ) {
+    printer.Print("  perlxs_call_boot(aTHX_ boot_$module$, cv, ax, items);\n",
+		  "module", StringReplace(modules[k], "::", "__", true));
+  }
 
-  set<const Descriptor*> seen;
+  printer.Print("\n");
+}
 
-	for ( int i = 0; i < file->message_type_count(); i++ ) {
-    const Descriptor* descriptor = file->message_type(i);
-	  GenerateFileXSTypedefs(descriptor->file(), printer, seen);
-	  printer.Print("\n\n");
-	  GenerateMessageStatics(descriptor, printer);
-	  printer.Print("\n\n");
-	}
 
-	printer.Print(vars,
-		"MODULE = $perlxs_package_module$::$package_module$   "
-		"PACKAGE = $perlxs_package_module$::$package_module$\n"
-		"\n"
-	);
+// Splits the top-level messages of the files into at most shards_
+// shards of similar size.  Size is estimated from the number of fields
+// (nested types included), since the accessors dominate the code.  The
+// messages keep their file order within a shard, so output is stable.
 
-	for ( int i = 0; i < file->message_type_count(); i++ ) {
-    const Descriptor* descriptor = file->message_type(i);
-  	GenerateMessageXSPackage(file, descriptor, printer);
-	}
+void
+PerlXSGenerator::ShardMessages(const vector<const FileDescriptor*>& files,
+			       vector<vector<const Descriptor*> >& shards) const
+{
+  vector<const Descriptor*> messages;
+  vector<int>               weights;
 
-}
+  for ( size_t f = 0; f < files.size(); f++ ) {
+    for ( int i = 0; i < files[f]->message_type_count(); i++ ) {
+      vector<const Descriptor*> nested;
+      int                       weight = 0;
 
-// Generate services
-void PerlXSGenerator::GenerateServiceModule(const FileDescriptor* file,
-																						OutputDirectory* outdir) const
-{
-  for (int i = 0; i < file->service_count(); ++i)
-	{
-		const ServiceDescriptor *service = file->service(i);
-    string filename = "lib/" + PerlPackageFile(perlxs_package_) +
-											"/" + PerlPackageFile(file->package()) + "/" +
-											"/Service/" + PerlPackageFile(service->name()) + ".pm";
-    scoped_ptr<io::ZeroCopyOutputStream> output(outdir->Open(filename));
-    io::Printer printer(output.get(), '*');
+      CollectMessages(files[f]->message_type(i), nested);
+      for ( size_t j = 0; j < nested.size(); j++ ) {
+	weight += 1 + nested[j]->field_count();
+      }
+      messages.push_back(files[f]->message_type(i));
+      weights.push_back(weight);
+    }
+  }
 
-		map<string, string> vars;
-		vars["perlxs_package"] = perlxs_package_;
-		vars["perlxs_file"]    = PerlPackageFile(perlxs_package_);
-		vars["proto"]          = cpp::StripProto(file->name());
-		vars["proto_package_module"]  = PerlPackageModule(file->name());
-		vars["perlxs_package_name"]   = PerlPackageName(perlxs_package_);
-		vars["perlxs_package_module"] = PerlPackageModule(perlxs_package_);
-		vars["service_module"] = PerlPackageModule(service->name());
-		vars["package_module"] = PerlPackageModule(file->package());
-		vars["package_file"]   = PerlPackageFile(file->package());
+  size_t count = min((size_t)shards_, messages.size());
 
-		vars["grpc_base"]   = grpc_base_;
+  shards.assign(count, vector<const Descriptor*>());
+  if ( count == 0 ) {
+    return;
+  }
 
-		printer.Print(vars,
-			"package *perlxs_package_module*::*package_module*::Service::*service_module*;\n"
-			"use base qw(*grpc_base*);\n"
-			"use *perlxs_package_module*::*package_module*;\n"
-			"\n"
-		);
+  // Largest first, each into the lightest shard so far.
 
-		for (int k = 0; k < service->method_count(); ++k)
-		{
-			const MethodDescriptor *method = service->method(k);
+  vector<pair<int, size_t> > order;
+  vector<int>                load(count, 0);
+  vector<size_t>             assigned(messages.size());
 
-			map<string, string> mvars;
-			mvars["full_name"]   = method->full_name();
-			mvars["input_type"]  = method->input_type()->name();
-			mvars["name"]        = method->name();
-			mvars["service"]     = StripLast(method->full_name(),'.');
+  for ( size_t i = 0; i < messages.size(); i++ ) {
+    order.push_back(make_pair(-weights[i], i));
+  }
+  sort(order.begin(), order.end());
 
-			mvars["unmarshall"] =
-						"    my $unmarshall = sub {\n"
-						"        my $data = shift;\n"
-						"        my $d = new " + PerlPackageModule(perlxs_package_) + "::" +
-														PerlPackageModule(file->package()) + "::" +
-														PerlPackageModule(method->output_type()->name())+"();\n"
-						"        if ($d->unpack($data)) { return $d; }\n"
-						"        warn \"failed unpacking protobuf data\";\n"
-						"        return undef;\n"
-						"    };\n";
+  for ( size_t i = 0; i < order.size(); i++ ) {
+    size_t lightest = min_element(load.begin(), load.end()) - load.begin();
 
-			if (method->client_streaming()) {
-				if(method->server_streaming()) {
-					printer.Print(mvars,
-						"sub *name*\n"
-						"{\n"
-						"    my $self     = shift;\n"
-						"    my \%param    = @_;\n"
-						"    my $metadata = $param{metadata};\n"
-						"    my $options  = $param{options};\n"
-						"\n"
-						"*unmarshall*"
-						"\n"
-						"    return $self->_bidiRequest(\n"
-						"                       method      => \"/*service*/*name*\",\n"
-						"                       deserialize => $unmarshall,\n"
-						"                       metadata    => $metadata,\n"
-					  "                       options     => $options);\n"
-						"}\n"
-						"\n"
-					);
-				} else {
-					printer.Print(mvars,
-						"sub *name*\n"
-						"{\n"
-						"    my $self     = shift;\n"
-						"    my \%param    = @_;\n"
-						"    my $metadata = $param{metadata};\n"
-						"    my $options  = $param{options};\n"
-						"\n"
-						"*unmarshall*"
-						"\n"
-						"    return $self->_clientStreamRequest(\n"
-						"                       method      => \"/*service*/*name*\",\n"
-						"                       deserialize => $unmarshall,\n"
-						"                       metadata    => $metadata,\n"
-					  "                       options     => $options);\n"
-						"}\n"
-						"\n"
-					);
-				}
-			} else {
-				if(method->server_streaming()) {
-					printer.Print(mvars,
-						"sub *name*\n"
-						"{\n"
-						"    my $self     = shift;\n"
-						"    my \%param    = @_;\n"
-						"    my $argument = $param{argument}; ## *input_type*\n"
-						"    my $metadata = $param{metadata};\n"
-						"    my $options  = $param{options};\n"
-						"\n"
-						"*unmarshall*"
-						"\n"
-						"    return $self->_serverStreamRequest(\n"
-						"                       method      => \"/*service*/*name*\",\n"
-						"                       deserialize => $unmarshall,\n"
-						"                       argument    => $argument,\n"
-						"                       metadata    => $metadata,\n"
-					  "                       options     => $options);\n"
-						"}\n"
-						"\n"
-					);
-				} else {
-					printer.Print(mvars,
-						"sub *name*\n"
-						"{\n"
-						"    my $self     = shift;\n"
-						"    my \%param    = @_;\n"
-						"    my $argument = $param{argument}; ## *input_type*\n"
-						"    my $metadata = $param{metadata};\n"
-						"    my $options  = $param{options};\n"
-						"\n"
-						"*unmarshall*"
-						"\n"
-						"    return $self->_simpleRequest(\n"
-						"                       method      => \"/*service*/*name*\",\n"
-						"                       deserialize => $unmarshall,\n"
-						"                       argument    => $argument,\n"
-						"                       metadata    => $metadata,\n"
-					  "                       options     => $options);\n"
-						"}\n"
-						"\n"
-					);
-				}
-			}
-		}
+    assigned[order[i].second] = lightest;
+    load[lightest] -= order[i].first;
+  }
 
-    printer.Print("1;\n\n");
+  for ( size_t i = 0; i < messages.size(); i++ ) {
+    shards[assigned[i]].push_back(messages[i]);
   }
 }
 
 
+// Includes, stream classes and (with --perlxs-stats) the counter
+// registry, for an XS source that covers the given files.
+
 void
-PerlXSGenerator::GenerateModule(const FileDescriptor* file,
-																OutputDirectory* outdir) const
+PerlXSGenerator::GenerateXSPreamble(const vector<const FileDescriptor*>& files,
+				    io::Printer& printer) const
 {
-	string filename = "lib/" + PerlPackageFile(perlxs_package_) + "/" +
-										PerlPackageFile(file->package())+ ".pm";
-	scoped_ptr<io::ZeroCopyOutputStream> output(outdir->Open(filename));
-	io::Printer printer(output.get(), '*');
+	const FileDescriptor* file = files[0];
 
 	map<string, string> vars;
 	vars["perlxs_package"] = perlxs_package_;
@@ -449,507 +1580,3057 @@ PerlXSGenerator::GenerateModule(const FileDescriptor* file,
 	vars["package_module"] = PerlPackageModule(file->package());
 	vars["package_file"]   = PerlPackageFile(file->package());
 
+  // Boilerplate at the top of the file.
+
   printer.Print(vars,
-		"package *perlxs_package_module*::*package_module*;\n"
-		"\n"
-		"use strict;\n"
-		"use warnings;\n"
-		"use XSLoader;\n"
-		"\n"
-		"our $VERSION = '1.0';\n"
-		"\n"
-		"XSLoader::load(__PACKAGE__, $VERSION );\n"
-		"\n"
-		"1;\n"
-		"\n");
+		"#ifdef __cplusplus\n"
+		"extern \"C\" {\n"
+		"#endif\n"
+		"#include \"EXTERN.h\"\n"
+		"#include \"perl.h\"\n"
+		"#include \"XSUB.h\"\n"
+		"#ifdef __cplusplus\n"
+		"}\n"
+		"#endif\n"
+		"#ifdef do_open\n"
+		"#undef do_open\n"
+		"#endif\n"
+		"#ifdef do_close\n"
+		"#undef do_close\n"
+		"#endif\n"
+		"#ifdef New\n"
+		"#undef New\n"
+		"#endif\n"
+		"#include <stdint.h>\n"
+		"#include <sstream>\n"
+		"#include <google/protobuf/stubs/common.h>\n"
+		"#include <google/protobuf/io/zero_copy_stream.h>\n"
+		"#include <google/protobuf/io/coded_stream.h>\n"
+		"#include \"perlxs_runtime.h\"\n"
+	);
 
-/*
-		for ( int i = 0; i < file->message_type_count(); i++ ) {
-			const Descriptor* message_type = file->message_type(i);
-			GenerateMessagePOD(message_type, outdir);
-		}
-*/
-}
+  if ( gzip_ ) {
+    printer.Print("#include <google/protobuf/io/gzip_stream.h>\n"
+		  "#include <google/protobuf/io/zero_copy_stream_impl_lite.h>\n");
+  }
 
+  for ( size_t i = 0; i < files.size(); i++ ) {
+    printer.Print("#include \"$proto$.pb.h\"\n",
+		  "proto", cpp::StripProto(files[i]->name()));
+  }
 
-void
-PerlXSGenerator::GenerateMessagePOD(const Descriptor* descriptor,
-				    OutputDirectory* outdir) const
-{
-  string filename = descriptor->name() + ".pod";
-  scoped_ptr<io::ZeroCopyOutputStream> output(outdir->Open(filename));
-  io::Printer printer(output.get(), '*'); // '*' works well in the .pod file
+  printer.Print("\n"
+		"using namespace std;\n"
+		"\n");
 
-  map<string, string> vars;
+  // equals() and diff() use MessageDifferencer where there is
+  // reflection.  This reporter turns its differences into field paths
+  // such as "phones[1].number".
 
-  vars["package"] = MessageModuleName(descriptor);
-  vars["message"] = descriptor->full_name();
-  vars["name"]    = descriptor->name();
+  bool full = false;
+  bool lite = false;
 
-  // Generate POD documentation for the module.
+  for ( size_t i = 0; i < files.size(); i++ ) {
+    if ( files[i]->options().optimize_for() != FileOptions::LITE_RUNTIME ) {
+      full = true;
+    } else {
+      lite = true;
+    }
+  }
 
-  printer.Print(vars,
-		"=pod\n"
+  if ( full ) {
+    printer.Print(
+		"#include <google/protobuf/util/message_differencer.h>\n"
 		"\n"
-		"=head1 NAME\n"
+		"class perlxs_DiffPaths :\n"
+		"  public google::protobuf::util::MessageDifferencer::Reporter {\n"
+		"public:\n"
+		"  typedef google::protobuf::util::MessageDifferencer::SpecificField\n"
+		"    SpecificField;\n"
 		"\n"
-		"*package* - Perl/XS interface to *message*\n"
+		"  explicit perlxs_DiffPaths(vector<string> * paths) :\n"
+		"  paths_(paths) {}\n"
 		"\n"
-		"=head1 SYNOPSIS\n"
+		"  void ReportAdded(const google::protobuf::Message& message1,\n"
+		"                   const google::protobuf::Message& message2,\n"
+		"                   const vector<SpecificField>& path)\n"
+		"  {\n"
+		"    Add(path);\n"
+		"  }\n"
 		"\n"
-		"=head2 Serializing messages\n"
+		"  void ReportDeleted(const google::protobuf::Message& message1,\n"
+		"                     const google::protobuf::Message& message2,\n"
+		"                     const vector<SpecificField>& path)\n"
+		"  {\n"
+		"    Add(path);\n"
+		"  }\n"
 		"\n"
-		" #!/usr/bin/perl\n"
+		"  // A submessage set on both sides is reported as modified as well\n"
+		"  // as the fields inside it.  Only the fields are wanted.\n"
 		"\n"
-		" use strict;\n"
-		" use warnings;\n"
-		" use *package*;\n"
+		"  void ReportModified(const google::protobuf::Message& message1,\n"
+		"                      const google::protobuf::Message& message2,\n"
+		"                      const vector<SpecificField>& path)\n"
+		"  {\n"
+		"    const google::protobuf::FieldDescriptor * field = path.back().field;\n"
+		"\n"
+		"    if ( field == NULL || field->cpp_type() !=\n"
+		"         google::protobuf::FieldDescriptor::CPPTYPE_MESSAGE ) {\n"
+		"      Add(path);\n"
+		"    }\n"
+		"  }\n"
+		"\n"
+		"private:\n"
+		"  void Add(const vector<SpecificField>& path)\n"
+		"  {\n"
+		"    ostringstream ost;\n"
+		"\n"
+		"    for ( size_t i = 0; i < path.size(); i++ ) {\n"
+		"      const SpecificField& f = path[i];\n"
+		"      int index = ( f.index >= 0 ) ? f.index : f.new_index;\n"
+		"\n"
+		"      if ( i > 0 ) {\n"
+		"        ost << '.';\n"
+		"      }\n"
+		"      if ( f.field != NULL ) {\n"
+		"        ost << f.field->name();\n"
+		"      } else {\n"
+		"        ost << f.unknown_field_number;\n"
+		"      }\n"
+		"      if ( index >= 0 &&\n"
+		"           ( f.field == NULL || f.field->is_repeated() ) ) {\n"
+		"        ost << '[' << index << ']';\n"
+		"      }\n"
+		"    }\n"
+		"    paths_->push_back(ost.str());\n"
+		"  }\n"
+		"\n"
+		"  vector<string> * paths_;\n"
+		"};\n"
+		"\n"
+		"\n");
+  }
+
+  // Without reflection, the unknown fields of a LITE_RUNTIME message
+  // are only its wire bytes.  These helpers group them by field number
+  // so that their differences get paths such as "5[0]", as those that
+  // MessageDifferencer reports.  Before protobuf 3.0, lite messages
+  // dropped unknown fields.
+
+  if ( lite ) {
+    printer.Print(
+		"#if GOOGLE_PROTOBUF_VERSION >= 3000000\n"
+		"#include <google/protobuf/io/zero_copy_stream_impl_lite.h>\n"
+		"#include <google/protobuf/wire_format_lite.h>\n"
+		"\n"
+		"static PERLXS_UNUSED void\n"
+		"perlxs_unknown_split ( const string & bytes,\n"
+		"                       map<int, vector<string> > & fields )\n"
+		"{\n"
+		"  google::protobuf::io::CodedInputStream in(\n"
+		"    (const google::protobuf::uint8 *)bytes.data(), "
+		"(int)bytes.size());\n"
+		"  google::protobuf::uint32 tag;\n"
+		"\n"
+		"  while ( ( tag = in.ReadTag() ) != 0 ) {\n"
+		"    string field;\n"
+		"    bool   ok;\n"
+		"\n"
+		"    {\n"
+		"      google::protobuf::io::StringOutputStream sos(&field);\n"
+		"      google::protobuf::io::CodedOutputStream  cos(&sos);\n"
+		"\n"
+		"      ok = google::protobuf::internal::WireFormatLite::"
+		"SkipField(\n"
+		"        &in, tag, &cos);\n"
+		"    }\n"
+		"    if ( !ok ) {\n"
+		"      return;\n"
+		"    }\n"
+		"    fields[google::protobuf::internal::WireFormatLite::\n"
+		"           GetTagFieldNumber(tag)].push_back(field);\n"
+		"  }\n"
+		"}\n"
+		"\n"
+		"static PERLXS_UNUSED void\n"
+		"perlxs_unknown_diff ( const string & a, const string & b,\n"
+		"                      const string & prefix, "
+		"vector<string> * paths )\n"
+		"{\n"
+		"  map<int, vector<string> > fa;\n"
+		"  map<int, vector<string> > fb;\n"
+		"  set<int>                  numbers;\n"
+		"\n"
+		"  perlxs_unknown_split(a, fa);\n"
+		"  perlxs_unknown_split(b, fb);\n"
+		"  for ( map<int, vector<string> >::iterator i = fa.begin();\n"
+		"        i != fa.end(); ++i ) {\n"
+		"    numbers.insert(i->first);\n"
+		"  }\n"
+		"  for ( map<int, vector<string> >::iterator i = fb.begin();\n"
+		"        i != fb.end(); ++i ) {\n"
+		"    numbers.insert(i->first);\n"
+		"  }\n"
+		"  for ( set<int>::iterator n = numbers.begin(); "
+		"n != numbers.end(); ++n ) {\n"
+		"    const vector<string> & va = fa[*n];\n"
+		"    const vector<string> & vb = fb[*n];\n"
+		"\n"
+		"    for ( size_t i = 0; i < va.size() || i < vb.size(); i++ ) {\n"
+		"      if ( i >= va.size() || i >= vb.size() || va[i] != vb[i] ) {\n"
+		"        ostringstream ost;\n"
+		"\n"
+		"        ost << prefix << *n << '[' << i << ']';\n"
+		"        paths->push_back(ost.str());\n"
+		"      }\n"
+		"    }\n"
+		"  }\n"
+		"}\n"
+		"#endif\n"
+		"\n"
+		"\n");
+  }
+
+  // Static tracepoints (USDT) around the hot XSUBs.  Without
+  // <sys/sdt.h>, or with -DPERLXS_NO_PROBES, they compile to nothing.
+
+  printer.Print(
+		"#ifndef PERLXS_NO_PROBES\n"
+		"#ifdef __has_include\n"
+		"#if __has_include(<sys/sdt.h>)\n"
+		"#include <sys/sdt.h>\n"
+		"#define PERLXS_PROBE(probe, message, length) \\\n"
+		"  DTRACE_PROBE2(perlxs, probe, message, (long)(length))\n"
+		"#endif\n"
+		"#endif\n"
+		"#endif\n"
+		"#ifndef PERLXS_PROBE\n"
+		"#define PERLXS_PROBE(probe, message, length) \\\n"
+		"  do { (void)sizeof(length); } while (0)\n"
+		"#endif\n"
+		"\n"
+	);
+
+  // ZeroCopyOutputStream implementation (for improved pack() performance)
+
+  for ( size_t i = 0; i < files.size(); i++ ) {
+    vars["proto"] = cpp::StripProto(files[i]->name());
+    printer.Print(vars,
+		"class $proto$_OutputStream :\n"
+		"  public google::protobuf::io::ZeroCopyOutputStream {\n"
+		"public:\n"
+		"  explicit $proto$_OutputStream(SV * sv) :\n"
+		"  sv_(sv), len_(SvCUR(sv)) {}\n"
+		"  ~$proto$_OutputStream() {}\n"
+		"\n"
+		"  // Hands out all the room the SV has, less a byte for the\n"
+		"  // trailing NUL, doubling it when it runs out.  SvCUR always\n"
+		"  // counts what has been handed out.\n"
+		"\n"
+		"  bool Next(void** data, int* size)\n"
+		"  {\n"
+		"    dTHX;\n"
+		"    STRLEN room = ( SvLEN(sv_) > len_ + 1 ) ? SvLEN(sv_) - len_ - 1 : 0;\n"
+		"\n"
+		"    if ( room == 0 ) {\n"
+		"      SvGROW(sv_, ( len_ < 32 ? 64 : len_ << 1 ) + 1);\n"
+		"      room = SvLEN(sv_) - len_ - 1;\n"
+		"    }\n"
+		"    if ( room > INT_MAX ) {\n"
+		"      room = INT_MAX;\n"
+		"    }\n"
+		"    *data = SvPVX(sv_) + len_;\n"
+		"    *size = (int)room;\n"
+		"    len_ += room;\n"
+		"    SvCUR_set(sv_, len_);\n"
+		"\n"
+		"    return true;\n"
+		"  }\n"
+		"\n"
+		"  void BackUp(int count)\n"
+		"  {\n"
+		"    len_ -= count;\n"
+		"    SvCUR_set(sv_, len_);\n"
+		"  }\n"
+		"\n"
+		"  void Sync() {\n"
+		"    *SvEND(sv_) = '\\0';\n"
+		"  }\n"
+		"\n"
+		"  google::protobuf::int64 ByteCount() const\n"
+		"  {\n"
+		"    return (google::protobuf::int64)len_;\n"
+		"  }\n"
+		"\n"
+		"private:\n"
+		"  SV * sv_;\n"
+		"  STRLEN len_;\n"
+		"\n"
+		"  GOOGLE_DISALLOW_EVIL_CONSTRUCTORS($proto$_OutputStream);\n"
+		"};\n"
+		"\n"
+		"\n"
+		);
+
+    // ZeroCopyOutputStream over a PerlIO handle (for pack_to_fh()).
+    // PerlIO has no way to write into a layer's buffer, so output goes
+    // through a buffer of fixed size, written out each time it fills.
+    // It is 8 KB, as on the input side: pack_to_fh() makes the stream
+    // on the C stack, and PerlIO buffers again behind it anyway.
+
+    printer.Print(vars,
+		"class $proto$_PerlIOOutputStream :\n"
+		"  public google::protobuf::io::ZeroCopyOutputStream {\n"
+		"public:\n"
+		"  explicit $proto$_PerlIOOutputStream(PerlIO * f) :\n"
+		"  f_(f), count_(0), used_(0), error_(false) {}\n"
+		"  ~$proto$_PerlIOOutputStream() {}\n"
+		"\n"
+		"  bool Next(void** data, int* size)\n"
+		"  {\n"
+		"    if ( used_ == sizeof(buf_) && !Flush() ) {\n"
+		"      return false;\n"
+		"    }\n"
+		"    *data = buf_ + used_;\n"
+		"    *size = (int)(sizeof(buf_) - used_);\n"
+		"    count_ += sizeof(buf_) - used_;\n"
+		"    used_ = sizeof(buf_);\n"
+		"\n"
+		"    return true;\n"
+		"  }\n"
+		"\n"
+		"  void BackUp(int count)\n"
+		"  {\n"
+		"    used_ -= count;\n"
+		"    count_ -= count;\n"
+		"  }\n"
+		"\n"
+		"  // Writes out what is buffered.  Returns false if that, or any\n"
+		"  // earlier write, failed.\n"
+		"  bool Flush()\n"
+		"  {\n"
+		"    dTHX;\n"
+		"    STRLEN done = 0;\n"
+		"\n"
+		"    while ( !error_ && done < used_ ) {\n"
+		"      SSize_t n = PerlIO_write(f_, buf_ + done, used_ - done);\n"
+		"\n"
+		"      if ( n <= 0 ) {\n"
+		"        error_ = true;\n"
+		"      } else {\n"
+		"        done += n;\n"
+		"      }\n"
+		"    }\n"
+		"    used_ = 0;\n"
+		"\n"
+		"    return !error_;\n"
+		"  }\n"
+		"\n"
+		"  google::protobuf::int64 ByteCount() const\n"
+		"  {\n"
+		"    return (google::protobuf::int64)count_;\n"
+		"  }\n"
+		"\n"
+		"private:\n"
+		"  PerlIO * f_;\n"
+		"  STRLEN   count_;\n"
+		"  STRLEN   used_;\n"
+		"  bool     error_;\n"
+		"  char     buf_[8192];\n"
+		"\n"
+		"  GOOGLE_DISALLOW_EVIL_CONSTRUCTORS($proto$_PerlIOOutputStream);\n"
+		"};\n"
+		"\n"
+		"\n"
+		);
+
+    // ZeroCopyOutputStream that hashes what is written to it (for
+    // digest()), a buffer at a time.
+
+    printer.Print(vars,
+		"class $proto$_DigestStream :\n"
+		"  public google::protobuf::io::ZeroCopyOutputStream {\n"
+		"public:\n"
+		"  $proto$_DigestStream() : used_(0) {\n"
+		"    perlxs_xxh64_init(&state_, 0);\n"
+		"  }\n"
+		"  ~$proto$_DigestStream() {}\n"
+		"\n"
+		"  bool Next(void** data, int* size)\n"
+		"  {\n"
+		"    if ( used_ == sizeof(buf_) ) {\n"
+		"      perlxs_xxh64_update(&state_, buf_, used_);\n"
+		"      used_ = 0;\n"
+		"    }\n"
+		"    *data = buf_ + used_;\n"
+		"    *size = (int)(sizeof(buf_) - used_);\n"
+		"    used_ = sizeof(buf_);\n"
+		"\n"
+		"    return true;\n"
+		"  }\n"
+		"\n"
+		"  void BackUp(int count)\n"
+		"  {\n"
+		"    used_ -= count;\n"
+		"  }\n"
+		"\n"
+		"  google::protobuf::int64 ByteCount() const\n"
+		"  {\n"
+		"    return (google::protobuf::int64)(state_.total + used_);\n"
+		"  }\n"
+		"\n"
+		"  unsigned long long Digest()\n"
+		"  {\n"
+		"    perlxs_xxh64_update(&state_, buf_, used_);\n"
+		"    used_ = 0;\n"
+		"    return perlxs_xxh64_digest(&state_);\n"
+		"  }\n"
+		"\n"
+		"private:\n"
+		"  perlxs_xxh64 state_;\n"
+		"  size_t       used_;\n"
+		"  char         buf_[4096];\n"
+		"\n"
+		"  GOOGLE_DISALLOW_EVIL_CONSTRUCTORS($proto$_DigestStream);\n"
+		"};\n"
+		"\n"
+		"\n"
+		);
+
+    // ZeroCopyInputStream over a PerlIO handle (for unpack_from_fh()).
+    // It hands out the handle's own buffer where the layer allows
+    // that, and reads no more than "limit" bytes from the handle.
+
+    printer.Print(vars,
+		"class $proto$_InputStream :\n"
+		"  public google::protobuf::io::ZeroCopyInputStream {\n"
+		"public:\n"
+		"  $proto$_InputStream(PerlIO * f, STRLEN limit) :\n"
+		"  f_(f), left_(limit), count_(0), pos_(0), end_(0) {}\n"
+		"  ~$proto$_InputStream() {}\n"
+		"\n"
+		"  bool Next(const void** data, int* size)\n"
+		"  {\n"
+		"    dTHX;\n"
+		"    SSize_t n;\n"
+		"\n"
+		"    if ( pos_ < end_ ) {\n"
+		"      *data = buf_ + pos_;\n"
+		"      *size = (int)(end_ - pos_);\n"
+		"      count_ += end_ - pos_;\n"
+		"      pos_ = end_;\n"
+		"      return true;\n"
+		"    }\n"
+		"    if ( left_ == 0 ) {\n"
+		"      return false;\n"
+		"    }\n"
+		"    if ( PerlIO_fast_gets(f_) ) {\n"
+		"      if ( PerlIO_get_cnt(f_) <= 0 && PerlIO_fill(f_) != 0 ) {\n"
+		"        return false;\n"
+		"      }\n"
+		"      STDCHAR * ptr = PerlIO_get_ptr(f_);\n"
+		"      SSize_t   cnt = PerlIO_get_cnt(f_);\n"
+		"\n"
+		"      n = ( (STRLEN)cnt < left_ ) ? cnt : (SSize_t)left_;\n"
+		"      if ( n <= 0 ) {\n"
+		"        return false;\n"
+		"      }\n"
+		"      PerlIO_set_ptrcnt(f_, ptr + n, cnt - n);\n"
+		"      *data = ptr;\n"
+		"    } else {\n"
+		"      n = ( sizeof(buf_) < left_ ) ? sizeof(buf_) : left_;\n"
+		"      n = PerlIO_read(f_, buf_, n);\n"
+		"      if ( n <= 0 ) {\n"
+		"        return false;\n"
+		"      }\n"
+		"      *data = buf_;\n"
+		"      pos_ = end_ = n;\n"
+		"    }\n"
+		"    *size = (int)n;\n"
+		"    left_ -= n;\n"
+		"    count_ += n;\n"
+		"\n"
+		"    return true;\n"
+		"  }\n"
+		"\n"
+		"  void BackUp(int count)\n"
+		"  {\n"
+		"    dTHX;\n"
+		"\n"
+		"    // Bytes read through PerlIO_read() can't go back to the\n"
+		"    // handle, so the next Next() hands them out again.\n"
+		"\n"
+		"    if ( end_ > 0 ) {\n"
+		"      pos_ -= count;\n"
+		"    } else {\n"
+		"      PerlIO_set_ptrcnt(f_, PerlIO_get_ptr(f_) - count,\n"
+		"                        PerlIO_get_cnt(f_) + count);\n"
+		"      left_ += count;\n"
+		"    }\n"
+		"    count_ -= count;\n"
+		"  }\n"
+		"\n"
+		"  bool Skip(int count)\n"
+		"  {\n"
+		"    const void * data;\n"
+		"    int          size;\n"
+		"\n"
+		"    while ( count > 0 && Next(&data, &size) ) {\n"
+		"      if ( size > count ) {\n"
+		"        BackUp(size - count);\n"
+		"        size = count;\n"
+		"      }\n"
+		"      count -= size;\n"
+		"    }\n"
+		"\n"
+		"    return count == 0;\n"
+		"  }\n"
+		"\n"
+		"  google::protobuf::int64 ByteCount() const\n"
+		"  {\n"
+		"    return (google::protobuf::int64)count_;\n"
+		"  }\n"
+		"\n"
+		"  // Reads what is left of the limit, so that a bad message doesn't\n"
+		"  // leave the handle in the middle of it.\n"
+		"  void Finish()\n"
+		"  {\n"
+		"    while ( left_ > 0 && Skip(left_ < 65536 ? left_ : 65536) ) {\n"
+		"    }\n"
+		"  }\n"
+		"\n"
+		"private:\n"
+		"  PerlIO * f_;\n"
+		"  STRLEN   left_;\n"
+		"  STRLEN   count_;\n"
+		"  SSize_t  pos_;\n"
+		"  SSize_t  end_;\n"
+		"  STDCHAR  buf_[8192];\n"
+		"\n"
+		"  GOOGLE_DISALLOW_EVIL_CONSTRUCTORS($proto$_InputStream);\n"
+		"};\n"
+		"\n"
+		"\n"
+		);
+  }
+  vars["proto"] = cpp::StripProto(file->name());
+
+  // Per message type counters (--perlxs-stats).  Nothing is emitted
+  // without the option, so the generated code pays nothing for it.
+
+  if ( stats_ ) {
+    vars["stats_key"] = PerlPackageModule(perlxs_package_) + "::Stats";
+
+    printer.Print(vars,
+		  "#include <time.h>\n"
+		  "\n"
+		  "typedef struct {\n"
+		  "  const char *       name;\n"
+		  "  size_t             (*space_used)(const void *);\n"
+		  "  unsigned long long pack_calls;\n"
+		  "  unsigned long long unpack_calls;\n"
+		  "  unsigned long long bytes_out;\n"
+		  "  unsigned long long bytes_in;\n"
+		  "  unsigned long long parse_failures;\n"
+		  "  unsigned long long live_objects;\n"
+		  "  unsigned long long live_bytes;\n"
+		  "  unsigned long long to_hashref_calls;\n"
+		  "  unsigned long long from_hashref_calls;\n"
+		  "  unsigned long long nanoseconds;\n"
+		  "} perlxs_stats;\n"
+		  "\n"
+		  "// Without the GCC atomic builtins, perl's op refcount mutex\n"
+		  "// guards the counters, as it does perlxs_shared_refcnt().\n"
+		  "\n"
+		  "#ifdef __GNUC__\n"
+		  "#define PERLXS_STATS_ADD(s, counter, n) \\\n"
+		  "  __sync_fetch_and_add(&(s).counter, (unsigned long long)(n))\n"
+		  "#define PERLXS_STATS_SUB(s, counter, n) \\\n"
+		  "  __sync_fetch_and_sub(&(s).counter, (unsigned long long)(n))\n"
+		  "#else\n"
+		  "#define PERLXS_STATS_ADD(s, counter, n) STMT_START { \\\n"
+		  "  OP_REFCNT_LOCK; \\\n"
+		  "  (s).counter += (unsigned long long)(n); \\\n"
+		  "  OP_REFCNT_UNLOCK; \\\n"
+		  "} STMT_END\n"
+		  "#define PERLXS_STATS_SUB(s, counter, n) STMT_START { \\\n"
+		  "  OP_REFCNT_LOCK; \\\n"
+		  "  (s).counter -= (unsigned long long)(n); \\\n"
+		  "  OP_REFCNT_UNLOCK; \\\n"
+		  "} STMT_END\n"
+		  "#endif\n"
+		  "\n"
+		  "// Every object handed to Perl carries magic with the counters it\n"
+		  "// was counted in and the bytes it was counted with.  When the\n"
+		  "// object is freed, whichever module's DESTROY deleted it, the\n"
+		  "// magic takes exactly that back out.  The counters are only\n"
+		  "// ever changed atomically; nothing is locked.\n"
+		  "\n"
+		  "#define PERLXS_STATS_MAGIC 0x5073\n"
+		  "\n"
+		  "struct perlxs_stats_entry {\n"
+		  "  perlxs_stats * stats;\n"
+		  "  size_t         bytes;\n"
+		  "};\n"
+		  "\n"
+		  "static int\n"
+		  "perlxs_stats_free ( pTHX_ SV * sv, MAGIC * mg )\n"
+		  "{\n"
+		  "  perlxs_stats_entry * e = (perlxs_stats_entry *)mg->mg_ptr;\n"
+		  "\n"
+		  "  PERL_UNUSED_ARG(sv);\n"
+		  "  PERLXS_STATS_SUB(*e->stats, live_objects, 1);\n"
+		  "  PERLXS_STATS_SUB(*e->stats, live_bytes, e->bytes);\n"
+		  "  delete e;\n"
+		  "  return 0;\n"
+		  "}\n"
+		  "\n"
+		  "#ifdef USE_ITHREADS\n"
+		  "static int\n"
+		  "perlxs_stats_dup ( pTHX_ MAGIC * mg, CLONE_PARAMS * param )\n"
+		  "{\n"
+		  "  perlxs_stats_entry * e =\n"
+		  "    new perlxs_stats_entry(*(perlxs_stats_entry *)mg->mg_ptr);\n"
+		  "\n"
+		  "  PERL_UNUSED_ARG(param);\n"
+		  "  mg->mg_ptr = (char *)e;\n"
+		  "  PERLXS_STATS_ADD(*e->stats, live_objects, 1);\n"
+		  "  PERLXS_STATS_ADD(*e->stats, live_bytes, e->bytes);\n"
+		  "  return 0;\n"
+		  "}\n"
+		  "#else\n"
+		  "#define perlxs_stats_dup NULL\n"
+		  "#endif\n"
+		  "\n"
+		  "static MGVTBL perlxs_stats_vtbl = {\n"
+		  "  NULL, NULL, NULL, NULL, perlxs_stats_free, NULL, perlxs_stats_dup, NULL\n"
+		  "};\n"
+		  "\n"
+		  "static void\n"
+		  "perlxs_stats_track ( pTHX_ perlxs_stats * s, SV * sv, const void * msg )\n"
+		  "{\n"
+		  "  perlxs_stats_entry * e = new perlxs_stats_entry;\n"
+		  "  MAGIC *              mg;\n"
+		  "\n"
+		  "  e->stats = s;\n"
+		  "  e->bytes = s->space_used(msg);\n"
+		  "  mg = sv_magicext(SvRV(sv), NULL, PERL_MAGIC_ext, &perlxs_stats_vtbl,\n"
+		  "                   (const char *)e, 0);\n"
+		  "  mg->mg_private = PERLXS_STATS_MAGIC;\n"
+		  "  mg->mg_flags |= MGf_DUP;\n"
+		  "  PERLXS_STATS_ADD(*s, live_objects, 1);\n"
+		  "  PERLXS_STATS_ADD(*s, live_bytes, e->bytes);\n"
+		  "}\n"
+		  "\n"
+		  "// Counts an object again after an unpack has changed its size.\n"
+		  "\n"
+		  "static void\n"
+		  "perlxs_stats_resize ( pTHX_ SV * sv, const void * msg )\n"
+		  "{\n"
+		  "  for ( MAGIC * mg = SvMAGIC(SvRV(sv)); mg; mg = mg->mg_moremagic ) {\n"
+		  "    if ( mg->mg_type == PERL_MAGIC_ext &&\n"
+		  "         mg->mg_private == PERLXS_STATS_MAGIC ) {\n"
+		  "      perlxs_stats_entry * e = (perlxs_stats_entry *)mg->mg_ptr;\n"
+		  "      size_t               bytes = e->stats->space_used(msg);\n"
+		  "\n"
+		  "      PERLXS_STATS_ADD(*e->stats, live_bytes, bytes);\n"
+		  "      PERLXS_STATS_SUB(*e->stats, live_bytes, e->bytes);\n"
+		  "      e->bytes = bytes;\n"
+		  "      return;\n"
+		  "    }\n"
+		  "  }\n"
+		  "}\n"
+		  "\n"
+		  "static unsigned long long\n"
+		  "perlxs_stats_now()\n"
+		  "{\n"
+		  "  struct timespec ts;\n"
+		  "\n"
+		  "  clock_gettime(CLOCK_MONOTONIC, &ts);\n"
+		  "  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;\n"
+		  "}\n"
+		  "\n"
+		  "#ifndef XS_INTERNAL\n"
+		  "#define XS_INTERNAL(name) static XSPROTO(name)\n"
+		  "#endif\n"
+		  "\n"
+		  "// Every loaded module registers its counter table under the\n"
+		  "// same PL_modglobal key, so one snapshot covers all of them.\n"
+		  "\n"
+		  "static void\n"
+		  "perlxs_stats_register(pTHX_ perlxs_stats ** table)\n"
+		  "{\n"
+		  "  SV ** svp = hv_fetch(PL_modglobal, \"$stats_key$\",\n"
+		  "                       sizeof(\"$stats_key$\") - 1, 1);\n"
+		  "\n"
+		  "  if ( !SvROK(*svp) ) {\n"
+		  "    sv_setsv(*svp, sv_2mortal(newRV_noinc((SV *)newAV())));\n"
+		  "  }\n"
+		  "  av_push((AV *)SvRV(*svp), newSViv(PTR2IV(table)));\n"
+		  "}\n"
+		  "\n"
+		  "// Time spent in the BOOT sections of all loaded modules.\n"
+		  "\n"
+		  "static unsigned long long perlxs_stats_boot_start;\n"
+		  "\n"
+		  "static void\n"
+		  "perlxs_stats_boot_done(pTHX)\n"
+		  "{\n"
+		  "  SV ** svp = hv_fetch(PL_modglobal, \"$stats_key$::boot\",\n"
+		  "                       sizeof(\"$stats_key$::boot\") - 1, 1);\n"
+		  "\n"
+		  "  sv_setuv(*svp, SvUV(*svp) +\n"
+		  "           (UV)(perlxs_stats_now() - perlxs_stats_boot_start));\n"
+		  "}\n"
+		  "\n"
+		  "XS_INTERNAL(perlxs_stats_boot_nanoseconds)\n"
+		  "{\n"
+		  "  dXSARGS;\n"
+		  "  SV ** svp = hv_fetch(PL_modglobal, \"$stats_key$::boot\",\n"
+		  "                       sizeof(\"$stats_key$::boot\") - 1, 0);\n"
+		  "\n"
+		  "  PERL_UNUSED_VAR(items);\n"
+		  "  ST(0) = sv_2mortal(newSVuv(svp != NULL ? SvUV(*svp) : 0));\n"
+		  "  XSRETURN(1);\n"
+		  "}\n"
+		  "\n"
+		  "// A type imported by several modules has counters in each of\n"
+		  "// them; the snapshot adds them up.\n"
+		  "\n"
+		  "static void\n"
+		  "perlxs_stats_sum ( pTHX_ HV * shv, const char * key,\n"
+		  "                   unsigned long long n )\n"
+		  "{\n"
+		  "  SV ** svp = hv_fetch(shv, key, strlen(key), 1);\n"
+		  "\n"
+		  "  sv_setuv(*svp, (SvOK(*svp) ? SvUV(*svp) : 0) + (UV)n);\n"
+		  "}\n"
+		  "\n"
+		  "XS_INTERNAL(perlxs_stats_snapshot)\n"
+		  "{\n"
+		  "  dXSARGS;\n"
+		  "  HV *  hv = newHV();\n"
+		  "  SV ** svp = hv_fetch(PL_modglobal, \"$stats_key$\",\n"
+		  "                       sizeof(\"$stats_key$\") - 1, 0);\n"
+		  "\n"
+		  "  PERL_UNUSED_VAR(items);\n"
+		  "  if ( svp != NULL && SvROK(*svp) ) {\n"
+		  "    AV * av = (AV *)SvRV(*svp);\n"
+		  "\n"
+		  "    for ( int i = 0; i <= av_len(av); i++ ) {\n"
+		  "      perlxs_stats ** table =\n"
+		  "        INT2PTR(perlxs_stats **, SvIV(*av_fetch(av, i, 0)));\n"
+		  "\n"
+		  "      for ( ; *table != NULL; table++ ) {\n"
+		  "        perlxs_stats * s = *table;\n"
+		  "        SV **          shvp = hv_fetch(hv, s->name, strlen(s->name), 1);\n"
+		  "        HV *           shv;\n"
+		  "\n"
+		  "        if ( !SvROK(*shvp) ) {\n"
+		  "          sv_setsv(*shvp, sv_2mortal(newRV_noinc((SV *)newHV())));\n"
+		  "        }\n"
+		  "        shv = (HV *)SvRV(*shvp);\n"
+		  "        perlxs_stats_sum(aTHX_ shv, \"pack_calls\", s->pack_calls);\n"
+		  "        perlxs_stats_sum(aTHX_ shv, \"unpack_calls\", s->unpack_calls);\n"
+		  "        perlxs_stats_sum(aTHX_ shv, \"bytes_out\", s->bytes_out);\n"
+		  "        perlxs_stats_sum(aTHX_ shv, \"bytes_in\", s->bytes_in);\n"
+		  "        perlxs_stats_sum(aTHX_ shv, \"parse_failures\", s->parse_failures);\n"
+		  "        perlxs_stats_sum(aTHX_ shv, \"live_objects\", s->live_objects);\n"
+		  "        perlxs_stats_sum(aTHX_ shv, \"live_bytes\", s->live_bytes);\n"
+		  "        perlxs_stats_sum(aTHX_ shv, \"to_hashref_calls\",\n"
+		  "                         s->to_hashref_calls);\n"
+		  "        perlxs_stats_sum(aTHX_ shv, \"from_hashref_calls\",\n"
+		  "                         s->from_hashref_calls);\n"
+		  "        perlxs_stats_sum(aTHX_ shv, \"nanoseconds\", s->nanoseconds);\n"
+		  "      }\n"
+		  "    }\n"
+		  "  }\n"
+		  "  ST(0) = sv_2mortal(newRV_noinc((SV *)hv));\n"
+		  "  XSRETURN(1);\n"
+		  "}\n"
+		  "\n"
+		  "\n");
+  }
+}
+
+
+// Helpers, typedefs, statics and the XS packages of the given top-level
+// messages and enums, under one MODULE.
+
+void
+PerlXSGenerator::GenerateXSMessages(const vector<const Descriptor*>& messages,
+				    const vector<const EnumDescriptor*>& enums,
+				    const string& module,
+				    io::Printer& printer) const
+{
+  map<string, string> vars;
+
+  vars["xs_module"] = module;
+  vars["stats_key"] = PerlPackageModule(perlxs_package_) + "::Stats";
+
+  // Helpers for every message type reachable from these messages.
+
+  vector<const Descriptor*> reachable;
+  set<const Descriptor*>    reached;
+
+  for ( size_t i = 0; i < messages.size(); i++ ) {
+    CollectReachableMessages(messages[i], reached, reachable);
+  }
+
+  // Name lookups for the given enums, the enums nested in those message
+  // types and the enum types of their fields.
+
+  vector<const EnumDescriptor*> reachable_enums(enums);
+  set<const EnumDescriptor*>    enums_seen(enums.begin(), enums.end());
+
+  for ( size_t i = 0; i < reachable.size(); i++ ) {
+    for ( int j = 0; j < reachable[i]->enum_type_count(); j++ ) {
+      if ( enums_seen.insert(reachable[i]->enum_type(j)).second ) {
+	reachable_enums.push_back(reachable[i]->enum_type(j));
+      }
+    }
+    for ( int j = 0; j < reachable[i]->field_count(); j++ ) {
+      const EnumDescriptor* enum_type = reachable[i]->field(j)->enum_type();
+
+      if ( enum_type != NULL && enums_seen.insert(enum_type).second ) {
+	reachable_enums.push_back(enum_type);
+      }
+    }
+  }
+  for ( size_t i = 0; i < reachable_enums.size(); i++ ) {
+    GenerateEnumHelpers(reachable_enums[i], printer);
+  }
+
+  GenerateMessageHelpers(reachable, printer);
+
+  // Typedefs, Statics, and XS packages
+
+  set<const FileDescriptor*> walked;
+  set<const Descriptor*>     seen;
+
+	for ( size_t i = 0; i < messages.size(); i++ ) {
+    const Descriptor* descriptor = messages[i];
+	  GenerateFileXSTypedefs(descriptor->file(), printer, walked, seen);
+	  printer.Print("\n\n");
+	  GenerateMessageStatics(descriptor, printer);
+	  printer.Print("\n\n");
+	}
+
+  if ( custom_ops_ ) {
+    for ( size_t i = 0; i < messages.size(); i++ ) {
+      vector<const Descriptor*> nested;
+
+      CollectMessages(messages[i], nested);
+      for ( size_t j = 0; j < nested.size(); j++ ) {
+	GenerateCustomOps(nested[j], printer);
+      }
+    }
+  }
+
+	if ( stats_ ) {
+	  GenerateStatsTable(reachable, printer);
+	}
+
+	printer.Print(vars,
+		"MODULE = $xs_module$   "
+		"PACKAGE = $xs_module$\n"
+		"\n"
+	);
+
+	if ( stats_ ) {
+	  printer.Print(vars,
+		  "BOOT:\n"
+		  "  perlxs_stats_boot_start = perlxs_stats_now();\n"
+		  "  perlxs_stats_register(aTHX_ perlxs_stats_table);\n"
+		  "  if ( get_cv(\"$stats_key$::snapshot\", 0) == NULL ) {\n"
+		  "    newXS(\"$stats_key$::snapshot\", perlxs_stats_snapshot, "
+		  "__FILE__);\n"
+		  "    newXS(\"$stats_key$::boot_nanoseconds\",\n"
+		  "          perlxs_stats_boot_nanoseconds, __FILE__);\n"
+		  "  }\n"
+		  "\n"
+	  );
+	}
+
+	for ( size_t i = 0; i < messages.size(); i++ ) {
+    const Descriptor* descriptor = messages[i];
+  	GenerateMessageXSPackage(descriptor->file(), descriptor, module, printer);
+	}
+
+  for ( size_t i = 0; i < enums.size(); i++ ) {
+    GenerateEnumXSPackage(enums[i], module, printer);
+  }
+
+  // xsubpp runs the BOOT sections in order, after installing the XSUBs,
+  // so this one ends the boot time started by the first.
+
+  if ( stats_ ) {
+    printer.Print(vars,
+		  "MODULE = $xs_module$   "
+		  "PACKAGE = $xs_module$\n"
+		  "\n"
+		  "BOOT:\n"
+		  "  perlxs_stats_boot_done(aTHX);\n"
+		  "\n");
+  }
+}
+
+
+
+// Generate services
+void PerlXSGenerator::GenerateServiceModule(const FileDescriptor* file,
+																						OutputDirectory* outdir) const
+{
+  for (int i = 0; i < file->service_count(); ++i)
+	{
+		const ServiceDescriptor *service = file->service(i);
+    string filename = "lib/" + PerlPackageFile(perlxs_package_) +
+											"/" + PerlPackageFile(file->package()) + "/" +
+											"/Service/" + PerlPackageFile(service->name()) + ".pm";
+    scoped_ptr<io::ZeroCopyOutputStream> output(outdir->Open(filename));
+    io::Printer printer(output.get(), '*');
+
+		map<string, string> vars;
+		vars["perlxs_package"] = perlxs_package_;
+		vars["perlxs_file"]    = PerlPackageFile(perlxs_package_);
+		vars["proto"]          = cpp::StripProto(file->name());
+		vars["proto_package_module"]  = PerlPackageModule(file->name());
+		vars["perlxs_package_name"]   = PerlPackageName(perlxs_package_);
+		vars["perlxs_package_module"] = PerlPackageModule(perlxs_package_);
+		vars["service_module"] = PerlPackageModule(service->name());
+		vars["package_module"] = PerlPackageModule(file->package());
+		vars["package_file"]   = PerlPackageFile(file->package());
+
+		vars["grpc_base"]   = grpc_base_;
+
+		printer.Print(vars,
+			"package *perlxs_package_module*::*package_module*::Service::*service_module*;\n"
+			"use base qw(*grpc_base*);\n"
+			"use *perlxs_package_module*::*package_module*;\n"
+			"\n"
+		);
+
+		for (int k = 0; k < service->method_count(); ++k)
+		{
+			const MethodDescriptor *method = service->method(k);
+
+			map<string, string> mvars;
+			mvars["full_name"]   = method->full_name();
+			mvars["input_type"]  = method->input_type()->name();
+			mvars["name"]        = method->name();
+			mvars["service"]     = StripLast(method->full_name(),'.');
+
+			mvars["unmarshall"] =
+						"    my $unmarshall = sub {\n"
+						"        my $data = shift;\n"
+						"        my $d = new " + PerlPackageModule(perlxs_package_) + "::" +
+														PerlPackageModule(file->package()) + "::" +
+														PerlPackageModule(method->output_type()->name())+"();\n"
+						"        if ($d->unpack($data)) { return $d; }\n"
+						"        warn \"failed unpacking protobuf data\";\n"
+						"        return undef;\n"
+						"    };\n";
+
+			if (method->client_streaming()) {
+				if(method->server_streaming()) {
+					printer.Print(mvars,
+						"sub *name*\n"
+						"{\n"
+						"    my $self     = shift;\n"
+						"    my \%param    = @_;\n"
+						"    my $metadata = $param{metadata};\n"
+						"    my $options  = $param{options};\n"
+						"\n"
+						"*unmarshall*"
+						"\n"
+						"    return $self->_bidiRequest(\n"
+						"                       method      => \"/*service*/*name*\",\n"
+						"                       deserialize => $unmarshall,\n"
+						"                       metadata    => $metadata,\n"
+					  "                       options     => $options);\n"
+						"}\n"
+						"\n"
+					);
+				} else {
+					printer.Print(mvars,
+						"sub *name*\n"
+						"{\n"
+						"    my $self     = shift;\n"
+						"    my \%param    = @_;\n"
+						"    my $metadata = $param{metadata};\n"
+						"    my $options  = $param{options};\n"
+						"\n"
+						"*unmarshall*"
+						"\n"
+						"    return $self->_clientStreamRequest(\n"
+						"                       method      => \"/*service*/*name*\",\n"
+						"                       deserialize => $unmarshall,\n"
+						"                       metadata    => $metadata,\n"
+					  "                       options     => $options);\n"
+						"}\n"
+						"\n"
+					);
+				}
+			} else {
+				if(method->server_streaming()) {
+					printer.Print(mvars,
+						"sub *name*\n"
+						"{\n"
+						"    my $self     = shift;\n"
+						"    my \%param    = @_;\n"
+						"    my $argument = $param{argument}; ## *input_type*\n"
+						"    my $metadata = $param{metadata};\n"
+						"    my $options  = $param{options};\n"
+						"\n"
+						"*unmarshall*"
+						"\n"
+						"    return $self->_serverStreamRequest(\n"
+						"                       method      => \"/*service*/*name*\",\n"
+						"                       deserialize => $unmarshall,\n"
+						"                       argument    => $argument,\n"
+						"                       metadata    => $metadata,\n"
+					  "                       options     => $options);\n"
+						"}\n"
+						"\n"
+					);
+				} else {
+					printer.Print(mvars,
+						"sub *name*\n"
+						"{\n"
+						"    my $self     = shift;\n"
+						"    my \%param    = @_;\n"
+						"    my $argument = $param{argument}; ## *input_type*\n"
+						"    my $metadata = $param{metadata};\n"
+						"    my $options  = $param{options};\n"
+						"\n"
+						"*unmarshall*"
+						"\n"
+						"    return $self->_simpleRequest(\n"
+						"                       method      => \"/*service*/*name*\",\n"
+						"                       deserialize => $unmarshall,\n"
+						"                       argument    => $argument,\n"
+						"                       metadata    => $metadata,\n"
+					  "                       options     => $options);\n"
+						"}\n"
+						"\n"
+					);
+				}
+			}
+		}
+
+    printer.Print("1;\n\n");
+  }
+}
+
+
+void
+PerlXSGenerator::GenerateModule(const FileDescriptor* file,
+																OutputDirectory* outdir) const
+{
+	string filename = "lib/" + PerlPackageFile(perlxs_package_) + "/" +
+										PerlPackageFile(file->package())+ ".pm";
+	scoped_ptr<io::ZeroCopyOutputStream> output(outdir->Open(filename));
+	io::Printer printer(output.get(), '*');
+
+	map<string, string> vars;
+	vars["perlxs_package"] = perlxs_package_;
+	vars["perlxs_file"]    = PerlPackageFile(perlxs_package_);
+	vars["proto"]          = cpp::StripProto(file->name());
+	vars["proto_package_module"]  = PerlPackageModule(file->name());
+	vars["perlxs_package_name"]   = PerlPackageName(perlxs_package_);
+	vars["perlxs_package_module"] = PerlPackageModule(perlxs_package_);
+	vars["package_module"] = PerlPackageModule(file->package());
+	vars["package_file"]   = PerlPackageFile(file->package());
+
+  // In an aggregate build the loader module boots the shared object.
+
+  if ( aggregate_ ) {
+    printer.Print(vars,
+		  "package *perlxs_package_module*::*package_module*;\n"
+		  "\n"
+		  "use strict;\n"
+		  "use warnings;\n"
+		  "use *perlxs_package_module*;\n"
+		  "\n"
+		  "our $VERSION = '1.0';\n"
+		  "\n"
+		  "1;\n"
+		  "\n");
+    return;
+  }
+
+  printer.Print(vars,
+		"package *perlxs_package_module*::*package_module*;\n"
+		"\n"
+		"use strict;\n"
+		"use warnings;\n"
+		"use XSLoader;\n"
+		"\n"
+		"our $VERSION = '1.0';\n"
+		"\n"
+		"XSLoader::load(__PACKAGE__, $VERSION );\n"
+		"\n"
+		"1;\n"
+		"\n");
+
+/*
+		for ( int i = 0; i < file->message_type_count(); i++ ) {
+			const Descriptor* message_type = file->message_type(i);
+			GenerateMessagePOD(message_type, outdir);
+		}
+*/
+}
+
+
+// lib/<perlxs_package>.pm for --perlxs-aggregate, which loads the one
+// shared object holding every message class.
+
+void
+PerlXSGenerator::GenerateLoaderModule(OutputDirectory* outdir) const
+{
+  string filename = "lib/" + PerlPackageFile(perlxs_package_) + ".pm";
+  scoped_ptr<io::ZeroCopyOutputStream> output(outdir->Open(filename));
+  io::Printer printer(output.get(), '*');
+
+  printer.Print("package *perlxs_package_module*;\n"
+		"\n"
+		"use strict;\n"
+		"use warnings;\n"
+		"use XSLoader;\n"
+		"\n"
+		"our $VERSION = '1.0';\n"
+		"\n"
+		"XSLoader::load(__PACKAGE__, $VERSION );\n"
+		"\n"
+		"1;\n"
+		"\n",
+		"perlxs_package_module", PerlPackageModule(perlxs_package_));
+}
+
+
+void
+PerlXSGenerator::GenerateMessagePOD(const Descriptor* descriptor,
+				    OutputDirectory* outdir) const
+{
+  string filename = descriptor->name() + ".pod";
+  scoped_ptr<io::ZeroCopyOutputStream> output(outdir->Open(filename));
+  io::Printer printer(output.get(), '*'); // '*' works well in the .pod file
+
+  map<string, string> vars;
+
+  vars["package"] = MessageModuleName(descriptor);
+  vars["message"] = descriptor->full_name();
+  vars["name"]    = descriptor->name();
+
+  // Generate POD documentation for the module.
+
+  printer.Print(vars,
+		"=pod\n"
+		"\n"
+		"=head1 NAME\n"
+		"\n"
+		"*package* - Perl/XS interface to *message*\n"
+		"\n"
+		"=head1 SYNOPSIS\n"
+		"\n"
+		"=head2 Serializing messages\n"
+		"\n"
+		" #!/usr/bin/perl\n"
+		"\n"
+		" use strict;\n"
+		" use warnings;\n"
+		" use *package*;\n"
+		"\n"
+		" my $*name* = *package*->new;\n"
+		" # Set fields in $*name*...\n"
+		" my $pack*name* = $*name*->pack();\n"
+		"\n"
+		"=head2 Unserializing messages\n"
+		"\n"
+		" #!/usr/bin/perl\n"
+		"\n"
+		" use strict;\n"
+		" use warnings;\n"
+		" use *package*;\n"
+		"\n"
+		" my $pack*name*; # Read this from somewhere...\n"
+		" my $*name* = *package*->new;\n"
+		" if ( $*name*->unpack($pack*name*) ) {\n"
+		"   print \"OK\"\n"
+		" } else {\n"
+		"   print \"NOT OK\"\n"
+		" }\n"
+		"\n"
+		"=head1 DESCRIPTION\n"
+		"\n"
+		"*package* defines the following classes:\n"
+		"\n"
+		"=over 5\n"
+		"\n");
+
+  // List of classes
+
+  GenerateDescriptorClassNamePOD(descriptor, printer);
+
+  printer.Print("\n"
+		"=back\n"
+		"\n");
+
+  GenerateDescriptorMethodPOD(descriptor, printer);
+
+  if ( stats_ ) {
+    printer.Print("=head1 STATISTICS\n"
+		  "\n"
+		  "This module was generated with --perlxs-stats.  "
+		  "C<*stats*-E<gt>snapshot>\n"
+		  "returns the counters of every message type as a hash.\n"
+		  "\n"
+		  "The counters are updated atomically, without locks.  Every\n"
+		  "new(), clone() and copying getter also measures the space used\n"
+		  "by the object it returns, and every unpack measures it again,\n"
+		  "for C<live_bytes>.  Changes made through setters are only seen\n"
+		  "at the next unpack.\n"
+		  "\n",
+		  "stats", PerlPackageModule(perlxs_package_) + "::Stats");
+  }
+
+  printer.Print(vars,
+		"=head1 AUTHOR\n"
+		"\n"
+		"Generated from *message* by the protoc compiler.\n"
+		"\n"
+		"=head1 SEE ALSO\n"
+		"\n");
+
+  // Top-level messages in dependency files (recursively expanded)
+
+  printer.Print("http://code.google.com/p/protobuf\n"
+		"\n"
+		"=cut\n"
+		"\n");
+}
+
+
+void
+PerlXSGenerator::GenerateDescriptorClassNamePOD(const Descriptor* descriptor,
+						io::Printer& printer) const
+{
+  for ( int i = 0; i < descriptor->enum_type_count(); i++ ) {
+    printer.Print("=item C<*name*>\n"
+		  "\n"
+		  "A wrapper around the *enum* enum\n"
+		  "\n",
+		  "name", EnumClassName(descriptor->enum_type(i)),
+		  "enum", descriptor->enum_type(i)->full_name());
+  }
+
+  for ( int i = 0; i < descriptor->nested_type_count(); i++ ) {
+    GenerateDescriptorClassNamePOD(descriptor->nested_type(i), printer);
+  }
+
+  printer.Print("=item C<*name*>\n"
+		"\n"
+		"A wrapper around the *message* message\n"
+		"\n",
+		"name", MessageClassName(descriptor),
+		"message", descriptor->full_name());
+}
+
+
+void
+PerlXSGenerator::GenerateDescriptorMethodPOD(const Descriptor* descriptor,
+					     io::Printer& printer) const
+{
+  for ( int i = 0; i < descriptor->enum_type_count(); i++ ) {
+    const EnumDescriptor * enum_descriptor = descriptor->enum_type(i);
+    printer.Print("=head1 C<*name*> values\n"
+		  "\n"
+		  "=over 4\n"
+		  "\n",
+		  "name", EnumClassName(enum_descriptor));
+
+    for ( int j = 0; j < enum_descriptor->value_count(); j++ ) {
+      PODPrintEnumValue(enum_descriptor->value(j), printer);
+    }
+    PODPrintEnumLookups(enum_descriptor, printer);
+
+    printer.Print("\n"
+		  "=back\n"
+		  "\n");
+  }
+
+  for ( int i = 0; i < descriptor->nested_type_count(); i++ ) {
+    GenerateDescriptorMethodPOD(descriptor->nested_type(i), printer);
+  }
+
+  // Constructor
+
+  map<string, string> vars;
+
+  vars["name"]  = MessageClassName(descriptor);
+  vars["value"] = descriptor->name();
+
+  printer.Print(vars,
+		"=head1 *name* Constructor\n"
+		"\n"
+		"=over 4\n"
+		"\n"
+		"=item B<$*value* = *name*-E<gt>new( [$arg] )>\n"
+		"\n"
+		"Constructs an instance of C<*name*>.  If a hashref argument\n"
+		"is supplied, it is copied into the message instance as if\n"
+		"the copy_from() method were called immediately after\n"
+		"construction.  Otherwise, if a scalar argument is supplied,\n"
+		"it is interpreted as a serialized instance of the message\n"
+		"type, and the scalar is parsed to populate the message\n"
+		"fields.  Otherwise, if no argument is supplied, an empty\n"
+		"message instance is constructed.\n"
+		"\n"
+		"=item B<$*value* = *name*-E<gt>default_instance()>\n"
+		"\n"
+		"Returns the read-only instance of C<*name*> with no fields\n"
+		"set.  It is shared, and methods that would change it croak.\n"
+		"\n"
+		"=back\n"
+		"\n"
+		"=head1 *name* Methods\n"
+		"\n"
+		"=over 4\n"
+		"\n");
+
+  // Common message methods
+
+  printer.Print(vars,
+		"=item B<$*value*2-E<gt>copy_from($*value*1)>\n"
+		"\n"
+		"Copies the contents of C<*value*1> into C<*value*2>.\n"
+		"C<*value*2> is another instance of the same message type.\n"
+		"\n"
+		"=item B<$*value*2-E<gt>copy_from($hashref)>\n"
+		"\n"
+		"Copies the contents of C<hashref> into C<*value*2>.\n"
+		"C<hashref> is a Data::Dumper-style representation of an\n"
+		"instance of the message type.\n"
+		"\n"
+		"=item B<$*value*2-E<gt>merge_from($*value*1)>\n"
+		"\n"
+		"Merges the contents of C<*value*1> into C<*value*2>.\n"
+		"C<*value*2> is another instance of the same message type.\n"
+		"\n"
+		"=item B<$*value*2-E<gt>merge_from($hashref)>\n"
+		"\n"
+		"Merges the contents of C<hashref> into C<*value*2>.\n"
+		"C<hashref> is a Data::Dumper-style representation of an\n"
+		"instance of the message type.\n"
+		"\n"
+		"=item B<$*value*2 = $*value*1-E<gt>clone()>\n"
+		"\n"
+		"Returns a copy of C<*value*1>, of the same class.  The copy is\n"
+		"never read-only, even if C<*value*1> is.\n"
+		"\n"
+		"=item B<$*value*2-E<gt>swap($*value*1)>\n"
+		"\n"
+		"Exchanges the contents of C<*value*1> and C<*value*2> without\n"
+		"copying them.\n"
+		"\n"
+		"=item B<$same = $*value*2-E<gt>equals($*value*1)>\n"
+		"\n"
+		"Returns 1 if C<*value*1> and C<*value*2> have the same fields\n"
+		"set to the same values, and the same unknown fields, and 0 if\n"
+		"not.\n"
+		"\n"
+		"=item B<@paths = $*value*2-E<gt>diff($*value*1)>\n"
+		"\n"
+		"Returns the paths of the fields that differ between C<*value*1>\n"
+		"and C<*value*2>, such as C<name>, C<phones[1].number> or\n"
+		"C<main_phone>.  A submessage set in only one of them is one\n"
+		"path; one set in both gives the paths of the fields inside it.\n"
+		"An unknown field is named by its number, as in C<5[0]>.  The\n"
+		"list is empty if the two are equal.\n"
+		"\n"
+		"=item B<$delta = $*value*2-E<gt>pack_delta($*value*1)>\n"
+		"\n"
+		"Serializes only what C<*value*2> changes relative to\n"
+		"C<*value*1>: the fields it sets to other values, and markers\n"
+		"for the fields it leaves unset that C<*value*1> has set.\n"
+		"Submessages set in both are compared field by field.  A\n"
+		"repeated field that changes at all is sent whole.\n"
+		"Extensions and unknown fields are left out, so C<apply_delta>\n"
+		"neither sets nor clears them.\n"
+		"\n"
+		"The delta is a series of length-delimited records, tagged as\n"
+		"fields 1 and 2 would be in a message.  A record of field 1 is\n"
+		"the path, as packed varints, of the field numbers of a field to\n"
+		"clear, from the outermost message in.  A record of field 2 is a\n"
+		"serialized C<*value*>, to merge as C<merge_from> would.  All\n"
+		"of the clears come first, then at most one message.\n"
+		"\n"
+		"=item B<$ok = $*value*-E<gt>apply_delta($delta)>\n"
+		"\n"
+		"Applies a delta from C<pack_delta> to C<*value*>, which then\n"
+		"equals the message the delta was packed from if it equaled\n"
+		"the base.  Returns 1 on success and 0 on a malformed delta, in\n"
+		"which case C<*value*> may have been partly changed.\n"
+		"\n"
+		"=item B<$*value*-E<gt>clear()>\n"
+		"\n"
+		"Clears the contents of C<*value*>.\n"
+		"\n"
+		"=item B<$frozen = $*value*-E<gt>freeze()>\n"
+		"\n"
+		"Returns a read-only copy of C<*value*>.\n"
+		"\n");
+
+  // Without --perlxs-ithreads, CLONE_SKIP leaves every object (frozen
+  // or not) undef in a new thread, so there is nothing to share.
+
+  if ( ithreads_ ) {
+    printer.Print(vars,
+		  "The copy is not copied again when cloned into another\n"
+		  "thread, but shared.\n"
+		  "\n");
+  } else {
+    printer.Print(vars,
+		  "This module was generated without --perlxs-ithreads, so\n"
+		  "like any other object the copy is undef in a new thread.\n"
+		  "With --perlxs-ithreads, it is shared with the new thread\n"
+		  "rather than copied.\n"
+		  "\n");
+  }
+
+  printer.Print(vars,
+		"=item B<$frozen = $*value*-E<gt>is_frozen()>\n"
+		"\n"
+		"Returns 1 if C<*value*> is read-only.\n"
+		"\n"
+		"=item B<$init = $*value*-E<gt>is_initialized()>\n"
+		"\n"
+		"Returns 1 if C<*value*> has been initialized with data.\n"
+		"\n"
+		"=item B<$errstr = $*value*-E<gt>error_string()>\n"
+		"\n"
+		"Returns a comma-delimited string of initialization errors.\n"
+		"\n"
+		"=item B<$*value*-E<gt>discard_unknown_fields()>\n"
+		"\n"
+		"Discards unknown fields from C<*value*>.\n"
+		"\n"
+		"=item B<$dstr = $*value*-E<gt>debug_string()>\n"
+		"\n"
+		"Returns a string representation of C<*value*>.\n"
+		"\n"
+		"=item B<$dstr = $*value*-E<gt>short_debug_string()>\n"
+		"\n"
+		"Returns a short string representation of C<*value*>.\n"
+		"\n"
+		"=item B<$ok = $*value*-E<gt>unpack($string)>\n"
+		"\n"
+		"Attempts to parse C<string> into C<*value*>, returning 1 "
+		"on success and 0 on failure.\n"
+		"\n"
+		"=item B<$ok = $*value*-E<gt>unpack_partial($string)>\n"
+		"\n"
+		"Like C<unpack>, but succeeds even if required fields are\n"
+		"missing.\n"
+		"\n"
+		"=item B<$ok = $*value*-E<gt>merge_packed($string)>\n"
+		"\n"
+		"Parses C<string> into C<*value*> without clearing it first,\n"
+		"as C<merge_from> would merge a message unpacked from it, but\n"
+		"without the intermediate message.  Returns 1 on success and 0\n"
+		"on failure, in which case C<*value*> may have been partly\n"
+		"changed.  The required fields are checked after the merge.\n"
+		"\n"
+		"=item B<$ok = $*value*-E<gt>unpack_from_fh($fh, $length)>\n"
+		"\n"
+		"Like C<unpack>, but parses the next C<length> bytes of the\n"
+		"file handle C<fh>, such as a socket or a pipe, straight out of\n"
+		"its buffer.  All C<length> bytes are read, even if they don't\n"
+		"parse, so the handle is left at the start of whatever follows.\n"
+		"\n"
+		"=item B<$string = $*value*-E<gt>pack([deterministic =E<gt> 1])>\n"
+		"\n"
+		"Serializes C<*value*> into C<string>.  With C<deterministic>,\n"
+		"libprotobuf's deterministic serialization is used, so equal\n"
+		"messages give equal strings from the same build.  It needs\n"
+		"protobuf 3.1 or later; with an older one, C<pack> croaks.\n"
+		"\n"
+		"=item B<$hex = $*value*-E<gt>digest()>\n"
+		"\n"
+		"Returns a 64-bit XXH64 hash of the deterministic serialization\n"
+		"of C<*value*>, as 16 hex digits.  The bytes are hashed as they\n"
+		"are written and are never held in memory all at once.  This is\n"
+		"meant for cache keys and deduplication, not for security.\n"
+		"Like C<pack(deterministic =E<gt> 1)>, it needs protobuf 3.1\n"
+		"or later.\n"
+		"\n"
+		"=item B<$ok = $*value*-E<gt>pack_to_fh($fh)>\n"
+		"\n"
+		"Serializes C<*value*> to the file handle C<fh>, a fixed-size\n"
+		"buffer at a time, without building the whole string in memory.\n"
+		"Returns 1 on success and 0 if a write failed.\n"
+		"\n");
+
+  if ( gzip_ && descriptor->file()->options().optimize_for() !=
+       FileOptions::LITE_RUNTIME ) {
+    printer.Print(vars,
+		  "=item B<$string = $*value*-E<gt>pack_gzip([$level])>\n"
+		  "\n"
+		  "=item B<$ok = $*value*-E<gt>pack_gzip_to_fh($fh, [$level])>\n"
+		  "\n"
+		  "Like C<pack> and C<pack_to_fh>, but gzip-compressed in the same\n"
+		  "pass.  C<level> is a zlib compression level from 0 to 9, or -1\n"
+		  "(the default) for zlib's default.\n"
+		  "\n"
+		  "=item B<$ok = $*value*-E<gt>unpack_gzip($string)>\n"
+		  "\n"
+		  "=item B<$ok = $*value*-E<gt>unpack_gzip_from_fh($fh, $length)>\n"
+		  "\n"
+		  "Like C<unpack> and C<unpack_from_fh>, for gzip or zlib\n"
+		  "compressed data.  C<length> is the compressed length.\n"
+		  "\n");
+  }
+
+  printer.Print(vars,
+		"=item B<$length = $*value*-E<gt>length()>\n"
+		"\n"
+		"Returns the serialized length of C<*value*>.\n"
+		"\n"
+		"=item B<$bytes = $*value*-E<gt>space_used()>\n"
+		"\n"
+		"Returns the in-memory size of C<*value*> in bytes, including\n"
+		"its submessages (an estimate under LITE_RUNTIME).\n"
+		"\n"
+		"=item B<@fields = $*value*-E<gt>fields()>\n"
+		"\n"
+		"Returns the defined fields of C<*value*>.\n"
+		"\n"
+		"=item B<$hashref = $*value*-E<gt>to_hashref()>\n"
+		"\n"
+		"Exports the message to a hashref suitable for use in the\n"
+		"C<copy_from> or C<merge_from> methods.\n"
+		"\n");
+
+  // Message field accessors
+
+  for ( int i = 0; i < descriptor->field_count(); i++ ) {
+    const FieldDescriptor* field = descriptor->field(i);
+
+    vars["field"] = field->name();
+    vars["type"]  = PODFieldTypeString(field);
+
+    // has_blah or blah_size methods
+
+    if ( field->is_repeated() ) {
+      printer.Print(vars,
+		    "=item B<$*field*_size = $*value*-E<gt>*field*_size()>\n"
+		    "\n"
+		    "Returns the number of C<*field*> elements present "
+		    "in C<*value*>.\n"
+		    "\n");
+    } else {
+      printer.Print(vars,
+		    "=item B<$has_*field* = $*value*-E<gt>has_*field*()>\n"
+		    "\n"
+		    "Returns 1 if the C<*field*> element of C<*value*> "
+		    "is set, 0 otherwise.\n"
+		    "\n");
+    }
+
+    // clear_blah method
+
+    printer.Print(vars,
+		  "=item B<$*value*-E<gt>clear_*field*()>\n"
+		  "\n"
+		  "Clears the C<*field*> element(s) of C<*value*>.\n"
+		  "\n");
+
+    // getters
+
+    if ( field->is_repeated() ) {
+      printer.Print(vars,
+		    "=item B<@*field*_list = $*value*-E<gt>*field*()>\n"
+		    "\n"
+		    "Returns all values of C<*field*> in an array.  Each "
+		    "element of C<*field*_list> will be *type*.\n"
+		    "\n"
+		    "=item B<$*field*_elem = $*value*-E<gt>*field*($index)>\n"
+		    "\n"
+		    "Returns C<*field*> element C<index> from C<*value*>.  "
+		    "C<*field*> will be *type*, unless C<index> is out of "
+		    "range, in which case it will be undef.\n"
+		    "\n");
+    } else {
+      printer.Print(vars,
+		    "=item B<$*field* = $*value*-E<gt>*field*()>\n"
+		    "\n"
+		    "Returns C<*field*> from C<*value*>.  C<*field*> will "
+		    "be *type*.\n"
+		    "\n");
+    }
+
+    // setters
+
+    if ( field->is_repeated() ) {
+      printer.Print(vars,
+		    "=item B<$*value*-E<gt>add_*field*($value)>\n"
+		    "\n"
+		    "Adds C<value> to the list of C<*field*> in C<*value*>.  "
+		    "C<value> must be *type*.\n"
+		    "\n");
+    } else {
+      printer.Print(vars,
+		    "=item B<$*value*-E<gt>set_*field*($value)>\n"
+		    "\n"
+		    "Sets the value of C<*field*> in C<*value*> to "
+		    "C<value>.  C<value> must be *type*.\n"
+		    "\n");
+    }
+  }
+
+  printer.Print("\n"
+		"=back\n"
+		"\n");
+}
+
+
+void
+PerlXSGenerator::GenerateEnumModule(const EnumDescriptor* enum_descriptor,
+				    OutputDirectory* outdir) const
+{
+  string filename = enum_descriptor->name() + ".pm";
+  scoped_ptr<io::ZeroCopyOutputStream> output(outdir->Open(filename));
+  io::Printer printer(output.get(), '*'); // '*' works well in the .pm file
+
+  map<string, string> vars;
+
+  vars["package"] = EnumClassName(enum_descriptor);
+  vars["enum"]    = enum_descriptor->full_name();
+
+  printer.Print(vars,
+		"package *package*;\n"
 		"\n"
-		" my $*name* = *package*->new;\n"
-		" # Set fields in $*name*...\n"
-		" my $pack*name* = $*name*->pack();\n"
+		"use strict;\n"
+		"use warnings;\n"
+		"\n");
+
+  // Each enum value is exported as a constant.
+
+  for ( int i = 0; i < enum_descriptor->value_count(); i++ ) {
+    ostringstream ost;
+    ost << enum_descriptor->value(i)->number();
+    printer.Print("use constant *value* => *number*;\n",
+		  "value", enum_descriptor->value(i)->name(),
+		  "number", ost.str());
+  }
+
+  printer.Print("\n"
+		"1;\n"
 		"\n"
-		"=head2 Unserializing messages\n"
+		"__END__\n"
+		"\n");
+
+  // Now generate POD for the enum.
+
+  printer.Print(vars,
+		"=pod\n"
 		"\n"
-		" #!/usr/bin/perl\n"
+		"=head1 NAME\n"
 		"\n"
-		" use strict;\n"
-		" use warnings;\n"
-		" use *package*;\n"
+		"*package* - Perl interface to *enum*\n"
 		"\n"
-		" my $pack*name*; # Read this from somewhere...\n"
-		" my $*name* = *package*->new;\n"
-		" if ( $*name*->unpack($pack*name*) ) {\n"
-		"   print \"OK\"\n"
-		" } else {\n"
-		"   print \"NOT OK\"\n"
-		" }\n"
+		"=head1 SYNOPSIS\n"
+		"\n"
+		" use *package*;\n"
+		"\n");
+
+  for ( int i = 0; i < enum_descriptor->value_count(); i++ ) {
+    printer.Print(" my $*value* = *package*::*value*;\n",
+		  "package", vars["package"],
+		  "value", enum_descriptor->value(i)->name());
+  }
+
+  printer.Print(vars,
 		"\n"
 		"=head1 DESCRIPTION\n"
 		"\n"
-		"*package* defines the following classes:\n"
+		"*package* defines the following constants:\n"
 		"\n"
-		"=over 5\n"
+		"=over 4\n"
 		"\n");
 
-  // List of classes
+  for ( int i = 0; i < enum_descriptor->value_count(); i++ ) {
+    PODPrintEnumValue(enum_descriptor->value(i), printer);
+  }
+  PODPrintEnumLookups(enum_descriptor, printer);
 
-  GenerateDescriptorClassNamePOD(descriptor, printer);
+  printer.Print(vars,
+		"\n"
+		"=back\n"
+		"\n"
+		"=head1 AUTHOR\n"
+		"\n"
+		"Generated from *enum* by the protoc compiler.\n"
+		"\n"
+		"=head1 SEE ALSO\n"
+		"\n"
+		"http://code.google.com/p/protobuf\n"
+		"\n"
+		"=cut\n"
+		"\n");
+}
+
+
+// Generates bench/<Message>.pl (--perlxs-bench), which times the common
+// operations on a random instance of a top-level message and reports
+// one JSON object per operation.
+
+void
+PerlXSGenerator::GenerateBench(const FileDescriptor* file,
+			       const Descriptor* descriptor,
+			       OutputDirectory* outdir) const
+{
+  string filename = "bench/" + descriptor->name() + ".pl";
+  scoped_ptr<io::ZeroCopyOutputStream> output(outdir->Open(filename));
+  io::Printer printer(output.get(), '*'); // '*' works well in the .pl file
+
+  map<string, string> vars;
+
+  vars["module"]  = PerlPackageModule(perlxs_package_) + "::" +
+    PerlPackageModule(file->package());
+  vars["package"] = MessageClassName(descriptor);
+  vars["message"] = descriptor->full_name();
+  vars["random"]  = "random_" +
+    StringReplace(descriptor->full_name(), ".", "_", true);
+
+  printer.Print(vars,
+		"#!/usr/bin/perl\n"
+		"\n"
+		"# Benchmark for *package*, generated by protoxs.\n"
+		"# Set PERLXS_BENCH_SECONDS to change the time spent per "
+		"operation.\n"
+		"\n"
+		"use strict;\n"
+		"use warnings;\n"
+		"use Time::HiRes qw(time);\n"
+		"use *module*;\n"
+		"\n"
+		"my $seconds = $ENV{PERLXS_BENCH_SECONDS} || 1;\n"
+		"\n"
+		"sub rand_string {\n"
+		"    return join '', map { chr(97 + int rand 26) } 1 .. shift;\n"
+		"}\n"
+		"\n"
+		"sub rand_bytes {\n"
+		"    return join '', map { chr(int rand 256) } 1 .. shift;\n"
+		"}\n"
+		"\n");
+
+  // One random instance builder per reachable message type.  Recursive
+  // types are cut off after a few levels.
+
+  vector<const Descriptor*> reachable;
+  set<const Descriptor*>    reached;
+
+  CollectReachableMessages(descriptor, reached, reachable);
+  for ( size_t i = 0; i < reachable.size(); i++ ) {
+    GenerateBenchRandom(reachable[i], printer);
+  }
+
+  printer.Print(vars,
+		"sub bench {\n"
+		"    my ($op, $bytes, $code) = @_;\n"
+		"    my $n     = 0;\n"
+		"    my $start = time;\n"
+		"    my $elapsed;\n"
+		"\n"
+		"    while ( ($elapsed = time - $start) < $seconds ) {\n"
+		"        $code->() for 1 .. 100;\n"
+		"        $n += 100;\n"
+		"    }\n"
+		"    printf(\"{\\\"message\\\":\\\"%s\\\",\\\"op\\\":\\\"%s\\\",\"\n"
+		"           . \"\\\"ops_per_sec\\\":%.1f,\\\"mb_per_sec\\\":%.3f}\\n\",\n"
+		"           '*message*', $op, $n / $elapsed,\n"
+		"           $n / $elapsed / 1048576 ** $bytes);\n"
+		"}\n"
+		"\n"
+		"srand(42);\n"
+		"\n"
+		"my $class  = '*package*';\n"
+		"my $hash   = *random*(0);\n"
+		"my $msg    = $class->new($hash);\n"
+		"my $tmp    = $class->new;\n"
+		"my $packed = $msg->pack;\n"
+		"my $bytes  = length $packed;\n"
+		"\n"
+		"bench('new', 0, sub { my $m = $class->new });\n"
+		"bench('set', 0, sub {\n");
+
+  for ( int i = 0; i < descriptor->field_count(); i++ ) {
+    const FieldDescriptor* field = descriptor->field(i);
+
+    if ( !field->is_repeated() &&
+	 field->cpp_type() != FieldDescriptor::CPPTYPE_MESSAGE ) {
+      printer.Print("    $msg->set_*field*($hash->{*field*});\n",
+		    "field", field->name());
+    }
+  }
+
+  printer.Print("});\n"
+		"bench('get', 0, sub {\n");
+
+  for ( int i = 0; i < descriptor->field_count(); i++ ) {
+    printer.Print("    my @*field* = $msg->*field*;\n",
+		  "field", descriptor->field(i)->name());
+  }
+
+  printer.Print("});\n"
+		"bench('pack', $bytes, sub { my $s = $msg->pack });\n"
+		"bench('unpack', $bytes, sub { $tmp->unpack($packed) });\n"
+		"bench('to_hashref', $bytes, sub { my $h = $msg->to_hashref });\n"
+		"bench('from_hashref', $bytes, sub { my $m = $class->new($hash) });\n"
+		"bench('copy_from', $bytes, sub { $tmp->copy_from($msg) });\n"
+		"\n");
+}
+
+
+void
+PerlXSGenerator::GenerateBenchRandom(const Descriptor* descriptor,
+				     io::Printer& printer) const
+{
+  printer.Print("sub *random* {\n"
+		"    my ($depth) = @_;\n"
+		"    my %m;\n"
+		"\n",
+		"random", "random_" +
+		StringReplace(descriptor->full_name(), ".", "_", true));
+
+  for ( int i = 0; i < descriptor->field_count(); i++ ) {
+    const FieldDescriptor* field = descriptor->field(i);
+    map<string, string> vars;
+
+    vars["field"] = field->name();
+    vars["value"] = BenchRandomValue(field);
+
+    if ( field->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE ) {
+      vars["guard"] = " if $depth < 3";
+    } else {
+      vars["guard"] = "";
+    }
+
+    if ( field->is_repeated() ) {
+      printer.Print(vars,
+		    "    $m{*field*} = [ map { *value* } 1 .. 3 ]*guard*;\n");
+    } else {
+      printer.Print(vars,
+		    "    $m{*field*} = *value**guard*;\n");
+    }
+  }
 
   printer.Print("\n"
-		"=back\n"
+		"    return \\%m;\n"
+		"}\n"
 		"\n");
+}
+
+
+// Returns a Perl expression producing a random value for the field.
+
+string
+PerlXSGenerator::BenchRandomValue(const FieldDescriptor* field) const
+{
+  string value;
+
+  switch ( field->cpp_type() ) {
+  case FieldDescriptor::CPPTYPE_INT32:
+    value = "int(rand(2000000)) - 1000000";
+    break;
+  case FieldDescriptor::CPPTYPE_UINT32:
+    value = "int(rand(2000000))";
+    break;
+  case FieldDescriptor::CPPTYPE_INT64:
+    value = "'' . (int(rand(2000000000000)) - 1000000000000)";
+    break;
+  case FieldDescriptor::CPPTYPE_UINT64:
+    value = "'' . int(rand(2000000000000))";
+    break;
+  case FieldDescriptor::CPPTYPE_FLOAT:
+  case FieldDescriptor::CPPTYPE_DOUBLE:
+    value = "rand(1000)";
+    break;
+  case FieldDescriptor::CPPTYPE_BOOL:
+    value = "int(rand(2))";
+    break;
+  case FieldDescriptor::CPPTYPE_ENUM:
+    {
+      const EnumDescriptor* enum_type = field->enum_type();
+      ostringstream ost;
+
+      ost << "(";
+      for ( int i = 0; i < enum_type->value_count(); i++ ) {
+	ost << (i > 0 ? ", " : "") << enum_type->value(i)->number();
+      }
+      ost << ")[int rand " << enum_type->value_count() << "]";
+      value = ost.str();
+    }
+    break;
+  case FieldDescriptor::CPPTYPE_STRING:
+    if ( field->type() == FieldDescriptor::TYPE_BYTES ) {
+      value = "rand_bytes(32)";
+    } else {
+      value = "rand_string(16)";
+    }
+    break;
+  case FieldDescriptor::CPPTYPE_MESSAGE:
+    value = "random_" +
+      StringReplace(field->message_type()->full_name(), ".", "_", true) +
+      "($depth + 1)";
+    break;
+  default:
+    value = "undef";
+    break;
+  }
+
+  return value;
+}
+
+
+void
+PerlXSGenerator::GenerateFileXSTypedefs(const FileDescriptor* file,
+					io::Printer& printer,
+					set<const FileDescriptor*>& walked,
+					set<const Descriptor*>& seen) const
+{
+  // Once a file has been walked, all of its types (and those of its
+  // dependencies) are in "seen" already.
+
+  if ( !walked.insert(file).second ) {
+    return;
+  }
+
+  for ( int i = 0; i < file->dependency_count(); i++ ) {
+    GenerateFileXSTypedefs(file->dependency(i), printer, walked, seen);
+  }
+
+  for ( int i = 0; i < file->message_type_count(); i++ ) {
+    GenerateMessageXSTypedefs(file->message_type(i), printer, seen);
+  }
+}
+
+
+void
+PerlXSGenerator::GenerateMessageXSTypedefs(const Descriptor* descriptor,
+					   io::Printer& printer,
+					   set<const Descriptor*>& seen) const
+{
+  for ( int i = 0; i < descriptor->nested_type_count(); i++ ) {
+    GenerateMessageXSTypedefs(descriptor->nested_type(i), printer, seen);
+  }
+
+  if ( seen.find(descriptor) == seen.end() ) {
+    string cn = cpp::ClassName(descriptor, true);
+    string un = StringReplace(cn, "::", "__", true);
+
+    seen.insert(descriptor);
+    printer.Print("typedef $classname$ $underscores$;\n",
+		  "classname", cn,
+		  "underscores", un);
+  }
+}
+
+
+void
+PerlXSGenerator::GenerateDefaultInstanceBoot(const Descriptor* descriptor,
+					     set<const Descriptor*>& seen,
+					     io::Printer& printer) const
+{
+  if ( seen.insert(descriptor).second ) {
+    printer.Print("  SvREFCNT_dec(perlxs_default_instance(aTHX_ "
+		  "\"$package$\",\n"
+		  "    &$classname$::default_instance()));\n",
+		  "package", MessageClassName(descriptor),
+		  "classname", cpp::ClassName(descriptor, true));
+  }
+}
+
+
+void
+PerlXSGenerator::GenerateMessageStatics(const Descriptor* descriptor,
+					io::Printer& printer) const
+{
+  for ( int i = 0; i < descriptor->nested_type_count(); i++ ) {
+    GenerateMessageStatics(descriptor->nested_type(i), printer);
+  }
+
+  map<string, string> vars;
+
+  string cn = cpp::ClassName(descriptor, true);
+  string un = StringReplace(cn, "::", "__", true);
+
+  vars["classname"]   = cn;
+  vars["underscores"] = un;
+
+  // from_hashref static helper
+
+  printer.Print(vars,
+		"static $classname$ *\n"
+		"$underscores$_from_hashref ( SV * sv0 )\n"
+		"{\n"
+		"  $classname$ * msg0 = new $classname$;\n");
 
-  GenerateDescriptorMethodPOD(descriptor, printer);
+  if ( stats_ ) {
+    printer.Print("  unsigned long long t0 = perlxs_stats_now();\n");
+  }
 
   printer.Print(vars,
-		"=head1 AUTHOR\n"
 		"\n"
-		"Generated from *message* by the protoc compiler.\n"
-		"\n"
-		"=head1 SEE ALSO\n"
-		"\n");
+		"  $underscores$_from_hashref_into(aTHX_ msg0, sv0);\n");
 
-  // Top-level messages in dependency files (recursively expanded)
+  if ( stats_ ) {
+    printer.Print("\n");
+    GenerateStatsUpdate(descriptor, printer, "from_hashref_calls", "1", 1);
+    GenerateStatsUpdate(descriptor, printer, "nanoseconds",
+			"perlxs_stats_now() - t0", 1);
+  }
 
-  printer.Print("http://code.google.com/p/protobuf\n"
-		"\n"
-		"=cut\n"
+  printer.Print("\n"
+		"  return msg0;\n"
+		"}\n"
 		"\n");
 }
 
 
+// Emits static helpers for each message type in "messages".  These are
+// declared up front, since message types may refer to each other.
+
 void
-PerlXSGenerator::GenerateDescriptorClassNamePOD(const Descriptor* descriptor,
-						io::Printer& printer) const
+PerlXSGenerator::GenerateMessageHelpers(
+    const vector<const Descriptor*>& messages,
+    io::Printer& printer) const
 {
-  for ( int i = 0; i < descriptor->enum_type_count(); i++ ) {
-    printer.Print("=item C<*name*>\n"
-		  "\n"
-		  "A wrapper around the *enum* enum\n"
-		  "\n",
-		  "name", EnumClassName(descriptor->enum_type(i)),
-		  "enum", descriptor->enum_type(i)->full_name());
+  for ( size_t i = 0; i < messages.size(); i++ ) {
+    printer.Print("static PERLXS_UNUSED size_t $underscores$_space_used "
+		  "( const $classname$ * msg );\n"
+		  "static SV * $underscores$_to_hashref "
+		  "( pTHX_ const $classname$ * msg );\n"
+		  "static void $underscores$_from_hashref_into "
+		  "( pTHX_ $classname$ * msg, SV * sv );\n",
+		  "classname", cpp::ClassName(messages[i], true),
+		  "underscores",
+		  StringReplace(cpp::ClassName(messages[i], true),
+				"::", "__", true));
+    printer.Print("static PERLXS_UNUSED bool $underscores$_delta "
+		  "( const $classname$ & base, const $classname$ & msg,\n"
+		  "  $classname$ * sets, vector<google::protobuf::uint32> & path,\n"
+		  "  vector<vector<google::protobuf::uint32> > & clears );\n"
+		  "static PERLXS_UNUSED bool $underscores$_clear_path "
+		  "( $classname$ * msg,\n"
+		  "  const google::protobuf::uint32 * path, size_t n );\n",
+		  "classname", cpp::ClassName(messages[i], true),
+		  "underscores",
+		  StringReplace(cpp::ClassName(messages[i], true),
+				"::", "__", true));
+    if ( messages[i]->file()->options().optimize_for() ==
+	 FileOptions::LITE_RUNTIME ) {
+      printer.Print("static bool $underscores$_diff "
+		    "( const $classname$ & a, const $classname$ & b,\n"
+		    "  const string & prefix, vector<string> * paths );\n",
+		    "classname", cpp::ClassName(messages[i], true),
+		    "underscores",
+		    StringReplace(cpp::ClassName(messages[i], true),
+				  "::", "__", true));
+    }
   }
 
-  for ( int i = 0; i < descriptor->nested_type_count(); i++ ) {
-    GenerateDescriptorClassNamePOD(descriptor->nested_type(i), printer);
+  printer.Print("\n");
+
+  for ( size_t i = 0; i < messages.size(); i++ ) {
+    GenerateClassHelpers(messages[i], printer);
   }
 
-  printer.Print("=item C<*name*>\n"
-		"\n"
-		"A wrapper around the *message* message\n"
-		"\n",
-		"name", MessageClassName(descriptor),
-		"message", descriptor->full_name());
+  for ( size_t i = 0; i < messages.size(); i++ ) {
+    GenerateSpaceUsedHelper(messages[i], printer);
+    if ( stats_ ) {
+      GenerateStatsCounters(messages[i], printer);
+    }
+    GenerateToHashrefHelper(messages[i], printer);
+    GenerateFromHashrefHelper(messages[i], printer);
+    GenerateDeltaHelpers(messages[i], printer);
+    if ( messages[i]->file()->options().optimize_for() ==
+	 FileOptions::LITE_RUNTIME ) {
+      GenerateDiffHelper(messages[i], printer);
+    }
+  }
+
+  printer.Print("\n");
 }
 
 
+// name_of and value_of helpers for one enum type.  name_of is a switch
+// on the value; where values have aliases, the first name wins, as in
+// the C++ _Name() function.  value_of looks the name up in an open
+// table of twice the number of names or more, using a seed, found
+// here, for which no two names of the enum hash to the same slot.
+
 void
-PerlXSGenerator::GenerateDescriptorMethodPOD(const Descriptor* descriptor,
-					     io::Printer& printer) const
+PerlXSGenerator::GenerateEnumHelpers(const EnumDescriptor* enum_descriptor,
+				     io::Printer& printer) const
 {
-  for ( int i = 0; i < descriptor->enum_type_count(); i++ ) {
-    const EnumDescriptor * enum_descriptor = descriptor->enum_type(i);
-    printer.Print("=head1 C<*name*> values\n"
-		  "\n"
-		  "=over 4\n"
-		  "\n",
-		  "name", EnumClassName(enum_descriptor));
+  map<string, string> vars;
+  set<int>            numbers;
 
-    for ( int j = 0; j < enum_descriptor->value_count(); j++ ) {
-      PODPrintEnumValue(enum_descriptor->value(j), printer);
+  vars["underscores"] =
+    StringReplace(cpp::ClassName(enum_descriptor, true), "::", "__", true);
+
+  printer.Print(vars,
+		"static PERLXS_UNUSED const char *\n"
+		"$underscores$_name_of ( int value )\n"
+		"{\n"
+		"  switch ( value ) {\n");
+
+  for ( int i = 0; i < enum_descriptor->value_count(); i++ ) {
+    const EnumValueDescriptor* value = enum_descriptor->value(i);
+    ostringstream ost;
+
+    if ( !numbers.insert(value->number()).second ) {
+      continue;
     }
+    ost << value->number();
+    printer.Print("  case $number$: return \"$name$\";\n",
+		  "number", ost.str(),
+		  "name", value->name());
+  }
 
-    printer.Print("\n"
-		  "=back\n"
-		  "\n");
+  printer.Print("  default: return NULL;\n"
+		"  }\n"
+		"}\n"
+		"\n");
+
+  uint32 size = 2;
+  uint32 seed = 0;
+
+  while ( size < 2 * (uint32)enum_descriptor->value_count() ) {
+    size *= 2;
   }
 
-  for ( int i = 0; i < descriptor->nested_type_count(); i++ ) {
-    GenerateDescriptorMethodPOD(descriptor->nested_type(i), printer);
+  for ( ;; ) {
+    vector<bool> used(size, false);
+    int          i;
+
+    for ( i = 0; i < enum_descriptor->value_count(); i++ ) {
+      uint32 slot =
+	EnumNameHash(enum_descriptor->value(i)->name(), seed) & (size - 1);
+
+      if ( used[slot] ) {
+	break;
+      }
+      used[slot] = true;
+    }
+    if ( i == enum_descriptor->value_count() ) {
+      break;
+    }
+    if ( ++seed == 256 ) {
+      seed = 0;
+      size *= 2;
+    }
   }
 
-  // Constructor
+  vector<const EnumValueDescriptor*> table(size, NULL);
+  ostringstream                      ost;
 
-  map<string, string> vars;
+  for ( int i = 0; i < enum_descriptor->value_count(); i++ ) {
+    const EnumValueDescriptor* value = enum_descriptor->value(i);
 
-  vars["name"]  = MessageClassName(descriptor);
-  vars["value"] = descriptor->name();
+    table[EnumNameHash(value->name(), seed) & (size - 1)] = value;
+  }
+
+  ost << size;
+  vars["size"] = ost.str();
+  ost.str("");
+  ost << size - 1;
+  vars["mask"] = ost.str();
+  ost.str("");
+  ost << seed;
+  vars["seed"] = ost.str();
 
   printer.Print(vars,
-		"=head1 *name* Constructor\n"
-		"\n"
-		"=over 4\n"
-		"\n"
-		"=item B<$*value* = *name*-E<gt>new( [$arg] )>\n"
-		"\n"
-		"Constructs an instance of C<*name*>.  If a hashref argument\n"
-		"is supplied, it is copied into the message instance as if\n"
-		"the copy_from() method were called immediately after\n"
-		"construction.  Otherwise, if a scalar argument is supplied,\n"
-		"it is interpreted as a serialized instance of the message\n"
-		"type, and the scalar is parsed to populate the message\n"
-		"fields.  Otherwise, if no argument is supplied, an empty\n"
-		"message instance is constructed.\n"
-		"\n"
-		"=back\n"
+		"static const perlxs_enum_entry "
+		"$underscores$_names[$size$] = {\n");
+
+  for ( uint32 i = 0; i < size; i++ ) {
+    if ( table[i] == NULL ) {
+      printer.Print("  { NULL, 0, 0 },\n");
+    } else {
+      ostringstream len;
+      ostringstream number;
+
+      len << table[i]->name().length();
+      number << table[i]->number();
+      printer.Print("  { \"$name$\", $len$, $number$ },\n",
+		    "name", table[i]->name(),
+		    "len", len.str(),
+		    "number", number.str());
+    }
+  }
+
+  printer.Print(vars,
+		"};\n"
 		"\n"
-		"=head1 *name* Methods\n"
+		"static PERLXS_UNUSED int\n"
+		"$underscores$_value_of ( const char * name, STRLEN len, "
+		"int * value )\n"
+		"{\n"
+		"  const perlxs_enum_entry * e =\n"
+		"    &$underscores$_names[perlxs_enum_hash(name, len, $seed$U) "
+		"& $mask$];\n"
 		"\n"
-		"=over 4\n"
+		"  if ( e->name == NULL || e->len != len ||\n"
+		"       memcmp(e->name, name, len) != 0 ) {\n"
+		"    return 0;\n"
+		"  }\n"
+		"  *value = e->value;\n"
+		"  return 1;\n"
+		"}\n"
 		"\n");
+}
 
-  // Common message methods
+
+// The name_of and value_of functions of an enum's package.  Both may
+// be called as functions or as class methods, and return undef for a
+// value or name the enum does not have.
+
+void
+PerlXSGenerator::GenerateEnumXSPackage(const EnumDescriptor* enum_descriptor,
+				       const string& module,
+				       io::Printer& printer) const
+{
+  map<string, string> vars;
+
+  vars["xs_module"]   = module;
+  vars["package"]     = EnumClassName(enum_descriptor);
+  vars["underscores"] =
+    StringReplace(cpp::ClassName(enum_descriptor, true), "::", "__", true);
 
   printer.Print(vars,
-		"=item B<$*value*2-E<gt>copy_from($*value*1)>\n"
-		"\n"
-		"Copies the contents of C<*value*1> into C<*value*2>.\n"
-		"C<*value*2> is another instance of the same message type.\n"
-		"\n"
-		"=item B<$*value*2-E<gt>copy_from($hashref)>\n"
-		"\n"
-		"Copies the contents of C<hashref> into C<*value*2>.\n"
-		"C<hashref> is a Data::Dumper-style representation of an\n"
-		"instance of the message type.\n"
-		"\n"
-		"=item B<$*value*2-E<gt>merge_from($*value*1)>\n"
-		"\n"
-		"Merges the contents of C<*value*1> into C<*value*2>.\n"
-		"C<*value*2> is another instance of the same message type.\n"
-		"\n"
-		"=item B<$*value*2-E<gt>merge_from($hashref)>\n"
-		"\n"
-		"Merges the contents of C<hashref> into C<*value*2>.\n"
-		"C<hashref> is a Data::Dumper-style representation of an\n"
-		"instance of the message type.\n"
-		"\n"
-		"=item B<$*value*-E<gt>clear()>\n"
-		"\n"
-		"Clears the contents of C<*value*>.\n"
-		"\n"
-		"=item B<$init = $*value*-E<gt>is_initialized()>\n"
-		"\n"
-		"Returns 1 if C<*value*> has been initialized with data.\n"
-		"\n"
-		"=item B<$errstr = $*value*-E<gt>error_string()>\n"
-		"\n"
-		"Returns a comma-delimited string of initialization errors.\n"
-		"\n"
-		"=item B<$*value*-E<gt>discard_unknown_fields()>\n"
-		"\n"
-		"Discards unknown fields from C<*value*>.\n"
-		"\n"
-		"=item B<$dstr = $*value*-E<gt>debug_string()>\n"
-		"\n"
-		"Returns a string representation of C<*value*>.\n"
+		"MODULE = $xs_module$ PACKAGE = $package$\n"
+		"PROTOTYPES: DISABLE\n"
 		"\n"
-		"=item B<$dstr = $*value*-E<gt>short_debug_string()>\n"
 		"\n"
-		"Returns a short string representation of C<*value*>.\n"
+		"SV *\n"
+		"name_of (...)\n"
+		"  PREINIT:\n"
+		"    IV           value;\n"
+		"    const char * name = NULL;\n"
 		"\n"
-		"=item B<$ok = $*value*-E<gt>unpack($string)>\n"
+		"  CODE:\n"
+		"    if ( items < 1 || items > 2 ) {\n"
+		"      croak(\"Usage: $package$::name_of([CLASS,] value)\");\n"
+		"    }\n"
+		"    value = SvIV(ST(items - 1));\n"
+		"    if ( value >= INT_MIN && value <= INT_MAX ) {\n"
+		"      name = $underscores$_name_of((int)value);\n"
+		"    }\n"
+		"    RETVAL = name != NULL ? newSVpv(name, 0) : newSV(0);\n"
 		"\n"
-		"Attempts to parse C<string> into C<*value*>, returning 1 "
-		"on success and 0 on failure.\n"
+		"  OUTPUT:\n"
+		"    RETVAL\n"
 		"\n"
-		"=item B<$string = $*value*-E<gt>pack()>\n"
 		"\n"
-		"Serializes C<*value*> into C<string>.\n"
+		"SV *\n"
+		"value_of (...)\n"
+		"  PREINIT:\n"
+		"    const char * name;\n"
+		"    STRLEN       len;\n"
+		"    int          value;\n"
 		"\n"
-		"=item B<$length = $*value*-E<gt>length()>\n"
+		"  CODE:\n"
+		"    if ( items < 1 || items > 2 ) {\n"
+		"      croak(\"Usage: $package$::value_of([CLASS,] name)\");\n"
+		"    }\n"
+		"    name = SvPV(ST(items - 1), len);\n"
+		"    if ( $underscores$_value_of(name, len, &value) ) {\n"
+		"      RETVAL = newSViv(value);\n"
+		"    } else {\n"
+		"      RETVAL = newSV(0);\n"
+		"    }\n"
 		"\n"
-		"Returns the serialized length of C<*value*>.\n"
+		"  OUTPUT:\n"
+		"    RETVAL\n"
 		"\n"
-		"=item B<@fields = $*value*-E<gt>fields()>\n"
+		"\n");
+
+  // The constants of a nested enum are installed by BOOT, unless
+  // --perlxs-lazy-boot is given.  Then each is made a constant sub the
+  // first time it is called.  Until then, they can only be called with
+  // parentheses or as class methods.
+
+  if ( !lazy_boot_ || enum_descriptor->containing_type() == NULL ) {
+    return;
+  }
+
+  printer.Print(vars,
+		"void\n"
+		"AUTOLOAD (...)\n"
+		"  PREINIT:\n"
+		"    SV *         sv = get_sv(\"$package$::AUTOLOAD\", 0);\n"
+		"    const char * name;\n"
+		"    const char * end;\n"
+		"    STRLEN       len;\n"
+		"    int          value;\n"
 		"\n"
-		"Returns the defined fields of C<*value*>.\n"
+		"  PPCODE:\n"
+		"    if ( sv == NULL ) {\n"
+		"      croak(\"$package$::AUTOLOAD called directly\");\n"
+		"    }\n"
+		"    name = SvPV(sv, len);\n"
+		"    end = name + len;\n"
+		"    for ( name = end; name > SvPVX(sv) && name[-1] != ':'; ) {\n"
+		"      name--;\n"
+		"    }\n"
+		"    if ( !$underscores$_value_of(name, end - name, &value) ) {\n"
+		"      croak(\"Undefined subroutine &%s called\", SvPVX(sv));\n"
+		"    }\n"
+		"    newCONSTSUB(gv_stashpv(\"$package$\", TRUE), name, "
+		"newSViv(value));\n"
+		"    XPUSHs(sv_2mortal(newSViv(value)));\n"
 		"\n"
-		"=item B<$hashref = $*value*-E<gt>to_hashref()>\n"
+		"\n");
+}
+
+
+// The field by field diff behind equals() and diff() under LITE_RUNTIME,
+// which has no MessageDifferencer.  It gives the same paths, those of
+// unknown fields included.  With "paths" NULL it returns at the first
+// difference.  Returns true if the messages are equal.  Types reached
+// only from another module's messages never have theirs called, hence
+// PERLXS_UNUSED.
+
+void
+PerlXSGenerator::GenerateDiffHelper(const Descriptor* descriptor,
+				    io::Printer& printer) const
+{
+  map<string, string> vars;
+  string cn = cpp::ClassName(descriptor, true);
+
+  vars["classname"]   = cn;
+  vars["underscores"] = StringReplace(cn, "::", "__", true);
+
+  printer.Print(vars,
+		"static PERLXS_UNUSED bool\n"
+		"$underscores$_diff ( const $classname$ & a, const $classname$ & b,\n"
+		"  const string & prefix, vector<string> * paths )\n"
+		"{\n"
+		"  bool equal = true;\n"
+		"\n");
+
+  for ( int i = 0; i < descriptor->field_count(); i++ ) {
+    const FieldDescriptor* field = descriptor->field(i);
+
+    vars["cppname"] = cpp::FieldName(field);
+    vars["name"]    = field->name();
+
+    if ( field->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE ) {
+      vars["sunderscores"] =
+	StringReplace(cpp::ClassName(field->message_type(), true),
+		      "::", "__", true);
+    }
+
+    if ( field->is_repeated() ) {
+      printer.Print(vars,
+		    "  for ( int i = 0; i < a.$cppname$_size() ||\n"
+		    "                  i < b.$cppname$_size(); i++ ) {\n"
+		    "    ostringstream ost;\n"
+		    "\n"
+		    "    ost << prefix << \"$name$[\" << i << ']';\n"
+		    "    if ( i >= a.$cppname$_size() || i >= b.$cppname$_size() ) {\n"
+		    "      equal = false;\n"
+		    "      if ( paths == NULL ) return false;\n"
+		    "      paths->push_back(ost.str());\n");
+      if ( field->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE ) {
+	printer.Print(vars,
+		      "    } else if ( !$sunderscores$_diff(a.$cppname$(i), "
+		      "b.$cppname$(i),\n"
+		      "                 ost.str() + '.', paths) ) {\n"
+		      "      equal = false;\n"
+		      "      if ( paths == NULL ) return false;\n"
+		      "    }\n"
+		      "  }\n");
+      } else {
+	printer.Print(vars,
+		      "    } else if ( a.$cppname$(i) != b.$cppname$(i) ) {\n"
+		      "      equal = false;\n"
+		      "      if ( paths == NULL ) return false;\n"
+		      "      paths->push_back(ost.str());\n"
+		      "    }\n"
+		      "  }\n");
+      }
+    } else if ( field->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE ) {
+      printer.Print(vars,
+		    "  if ( a.has_$cppname$() != b.has_$cppname$() ) {\n"
+		    "    equal = false;\n"
+		    "    if ( paths == NULL ) return false;\n"
+		    "    paths->push_back(prefix + \"$name$\");\n"
+		    "  } else if ( a.has_$cppname$() &&\n"
+		    "              !$sunderscores$_diff(a.$cppname$(), b.$cppname$(),\n"
+		    "                 prefix + \"$name$.\", paths) ) {\n"
+		    "    equal = false;\n"
+		    "    if ( paths == NULL ) return false;\n"
+		    "  }\n");
+    } else {
+      printer.Print(vars,
+		    "  if ( a.has_$cppname$() != b.has_$cppname$() ||\n"
+		    "       a.$cppname$() != b.$cppname$() ) {\n"
+		    "    equal = false;\n"
+		    "    if ( paths == NULL ) return false;\n"
+		    "    paths->push_back(prefix + \"$name$\");\n"
+		    "  }\n");
+    }
+  }
+
+  printer.Print("#if GOOGLE_PROTOBUF_VERSION >= 3000000\n"
+		"  if ( a.unknown_fields() != b.unknown_fields() ) {\n"
+		"    equal = false;\n"
+		"    if ( paths == NULL ) return false;\n"
+		"    perlxs_unknown_diff(a.unknown_fields(), b.unknown_fields(),\n"
+		"                        prefix, paths);\n"
+		"  }\n"
+		"#endif\n"
 		"\n"
-		"Exports the message to a hashref suitable for use in the\n"
-		"C<copy_from> or C<merge_from> methods.\n"
+		"  return equal;\n"
+		"}\n"
+		"\n");
+}
+
+
+// The helpers of pack_delta() and apply_delta().  $un$_delta puts the
+// fields of "msg" that differ from "base" into "sets", recursing into
+// submessages set on both sides, and the paths of the fields set only
+// in "base" into "clears".  A changed repeated field is cleared and
+// then sent whole.  It returns true if it put anything into "sets".
+// $un$_clear_path clears the field at the end of a path of field
+// numbers, and returns false if there is no such field.  Types only
+// reached through repeated fields never have theirs called, hence
+// PERLXS_UNUSED.
+
+void
+PerlXSGenerator::GenerateDeltaHelpers(const Descriptor* descriptor,
+				      io::Printer& printer) const
+{
+  map<string, string> vars;
+  string cn = cpp::ClassName(descriptor, true);
+
+  vars["classname"]   = cn;
+  vars["underscores"] = StringReplace(cn, "::", "__", true);
+
+  printer.Print(vars,
+		"static PERLXS_UNUSED bool\n"
+		"$underscores$_delta ( const $classname$ & base, "
+		"const $classname$ & msg,\n"
+		"  $classname$ * sets, vector<google::protobuf::uint32> & path,\n"
+		"  vector<vector<google::protobuf::uint32> > & clears )\n"
+		"{\n"
+		"  bool changed = false;\n"
 		"\n");
 
-  // Message field accessors
-
   for ( int i = 0; i < descriptor->field_count(); i++ ) {
     const FieldDescriptor* field = descriptor->field(i);
+    ostringstream ost;
 
-    vars["field"] = field->name();
-    vars["type"]  = PODFieldTypeString(field);
+    ost << field->number();
+    vars["cppname"] = cpp::FieldName(field);
+    vars["number"]  = ost.str();
 
-    // has_blah or blah_size methods
+    if ( field->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE ) {
+      vars["sunderscores"] =
+	StringReplace(cpp::ClassName(field->message_type(), true),
+		      "::", "__", true);
+    }
 
     if ( field->is_repeated() ) {
+      if ( field->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE ) {
+	vars["same"] = "base.$cppname$(i).SerializePartialAsString() ==\n"
+	  "      msg.$cppname$(i).SerializePartialAsString()";
+      } else {
+	vars["same"] = "base.$cppname$(i) == msg.$cppname$(i)";
+      }
       printer.Print(vars,
-		    "=item B<$*field*_size = $*value*-E<gt>*field*_size()>\n"
+		    "  {\n"
+		    "    bool same = base.$cppname$_size() == msg.$cppname$_size();\n"
 		    "\n"
-		    "Returns the number of C<*field*> elements present "
-		    "in C<*value*>.\n"
-		    "\n");
-    } else {
+		    "    for ( int i = 0; same && i < msg.$cppname$_size(); i++ ) {\n");
+      printer.Print(vars, ("      same = " + vars["same"] + ";\n").c_str());
       printer.Print(vars,
-		    "=item B<$has_*field* = $*value*-E<gt>has_*field*()>\n"
-		    "\n"
-		    "Returns 1 if the C<*field*> element of C<*value*> "
-		    "is set, 0 otherwise.\n"
-		    "\n");
-    }
-
-    // clear_blah method
-
-    printer.Print(vars,
-		  "=item B<$*value*-E<gt>clear_*field*()>\n"
-		  "\n"
-		  "Clears the C<*field*> element(s) of C<*value*>.\n"
-		  "\n");
-
-    // getters
-
-    if ( field->is_repeated() ) {
+		    "    }\n"
+		    "    if ( !same && base.$cppname$_size() > 0 ) {\n"
+		    "      clears.push_back(path);\n"
+		    "      clears.back().push_back($number$);\n"
+		    "    }\n"
+		    "    if ( !same && msg.$cppname$_size() > 0 ) {\n"
+		    "      sets->mutable_$cppname$()->CopyFrom(msg.$cppname$());\n"
+		    "      changed = true;\n"
+		    "    }\n"
+		    "  }\n");
+    } else if ( field->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE ) {
       printer.Print(vars,
-		    "=item B<@*field*_list = $*value*-E<gt>*field*()>\n"
-		    "\n"
-		    "Returns all values of C<*field*> in an array.  Each "
-		    "element of C<*field*_list> will be *type*.\n"
-		    "\n"
-		    "=item B<$*field*_elem = $*value*-E<gt>*field*($index)>\n"
-		    "\n"
-		    "Returns C<*field*> element C<index> from C<*value*>.  "
-		    "C<*field*> will be *type*, unless C<index> is out of "
-		    "range, in which case it will be undef.\n"
-		    "\n");
+		    "  if ( msg.has_$cppname$() && !base.has_$cppname$() ) {\n"
+		    "    sets->mutable_$cppname$()->CopyFrom(msg.$cppname$());\n"
+		    "    changed = true;\n"
+		    "  } else if ( msg.has_$cppname$() ) {\n"
+		    "    path.push_back($number$);\n"
+		    "    if ( $sunderscores$_delta(base.$cppname$(), msg.$cppname$(),\n"
+		    "           sets->mutable_$cppname$(), path, clears) ) {\n"
+		    "      changed = true;\n"
+		    "    } else {\n"
+		    "      sets->clear_$cppname$();\n"
+		    "    }\n"
+		    "    path.pop_back();\n"
+		    "  } else if ( base.has_$cppname$() ) {\n"
+		    "    clears.push_back(path);\n"
+		    "    clears.back().push_back($number$);\n"
+		    "  }\n");
     } else {
       printer.Print(vars,
-		    "=item B<$*field* = $*value*-E<gt>*field*()>\n"
-		    "\n"
-		    "Returns C<*field*> from C<*value*>.  C<*field*> will "
-		    "be *type*.\n"
-		    "\n");
+		    "  if ( msg.has_$cppname$() ) {\n"
+		    "    if ( !base.has_$cppname$() || "
+		    "base.$cppname$() != msg.$cppname$() ) {\n"
+		    "      sets->set_$cppname$(msg.$cppname$());\n"
+		    "      changed = true;\n"
+		    "    }\n"
+		    "  } else if ( base.has_$cppname$() ) {\n"
+		    "    clears.push_back(path);\n"
+		    "    clears.back().push_back($number$);\n"
+		    "  }\n");
     }
+  }
 
-    // setters
+  printer.Print(vars,
+		"\n"
+		"  return changed;\n"
+		"}\n"
+		"\n"
+		"static PERLXS_UNUSED bool\n"
+		"$underscores$_clear_path ( $classname$ * msg,\n"
+		"  const google::protobuf::uint32 * path, size_t n )\n"
+		"{\n"
+		"  switch ( path[0] ) {\n");
 
-    if ( field->is_repeated() ) {
+  for ( int i = 0; i < descriptor->field_count(); i++ ) {
+    const FieldDescriptor* field = descriptor->field(i);
+    ostringstream ost;
+
+    ost << field->number();
+    vars["cppname"] = cpp::FieldName(field);
+    vars["number"]  = ost.str();
+
+    printer.Print(vars,
+		  "  case $number$:\n"
+		  "    if ( n == 1 ) {\n"
+		  "      msg->clear_$cppname$();\n"
+		  "      return true;\n"
+		  "    }\n");
+    if ( !field->is_repeated() &&
+	 field->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE ) {
+      vars["sunderscores"] =
+	StringReplace(cpp::ClassName(field->message_type(), true),
+		      "::", "__", true);
       printer.Print(vars,
-		    "=item B<$*value*-E<gt>add_*field*($value)>\n"
-		    "\n"
-		    "Adds C<value> to the list of C<*field*> in C<*value*>.  "
-		    "C<value> must be *type*.\n"
-		    "\n");
+		    "    return $sunderscores$_clear_path("
+		    "msg->mutable_$cppname$(), path + 1, n - 1);\n");
     } else {
-      printer.Print(vars,
-		    "=item B<$*value*-E<gt>set_*field*($value)>\n"
-		    "\n"
-		    "Sets the value of C<*field*> in C<*value*> to "
-		    "C<value>.  C<value> must be *type*.\n"
-		    "\n");
+      printer.Print("    return false;\n");
     }
   }
 
-  printer.Print("\n"
-		"=back\n"
+  printer.Print("  default:\n"
+		"    return false;\n"
+		"  }\n"
+		"}\n"
 		"\n");
 }
 
 
+// The methods of --perlxs-gzip.  They chain protobuf's gzip streams
+// with the SV and PerlIO streams of the preamble, so the uncompressed
+// bytes are never held in memory all at once.  The gzip streams are
+// not part of the lite library, so LITE_RUNTIME files don't get them.
+
 void
-PerlXSGenerator::GenerateEnumModule(const EnumDescriptor* enum_descriptor,
-				    OutputDirectory* outdir) const
+PerlXSGenerator::GenerateGzipMethods(const Descriptor* descriptor,
+				     io::Printer& printer) const
 {
-  string filename = enum_descriptor->name() + ".pm";
-  scoped_ptr<io::ZeroCopyOutputStream> output(outdir->Open(filename));
-  io::Printer printer(output.get(), '*'); // '*' works well in the .pm file
-
   map<string, string> vars;
 
-  vars["package"] = EnumClassName(enum_descriptor);
-  vars["enum"]    = enum_descriptor->full_name();
-
+  vars["classname"] = cpp::ClassName(descriptor, true);
+  vars["perlclass"] = MessageClassName(descriptor);
+  vars["base"]      = cpp::StripProto(descriptor->file()->name());
+
+  // The level is optional, so these take (...) and check it themselves.
+
+  const char * level =
+    "    if ( items > $maxitems$ ) {\n"
+    "      croak(\"Usage: $perlclass$::$method$(THIS$fh$, [level])\");\n"
+    "    }\n"
+    "    level = ( items > $items$ ) ? SvIV(ST($items$)) : "
+    "Z_DEFAULT_COMPRESSION;\n"
+    "    if ( level < Z_DEFAULT_COMPRESSION || level > Z_BEST_COMPRESSION ) {\n"
+    "      croak(\"$method$(): bad compression level %d\", level);\n"
+    "    }\n"
+    "    gopts.compression_level = level;\n";
+
+  const char * serialize =
+    "      if ( !THIS->IsInitialized() ) {\n"
+    "        croak(\"Can't serialize message of type "
+    "'$perlclass$' because it is missing required fields: %s\",\n"
+    "              THIS->InitializationErrorString().c_str());\n"
+    "      }\n"
+    "      {\n"
+    "        google::protobuf::io::GzipOutputStream gz(&os, gopts);\n"
+    "\n"
+    "        {\n"
+    "          google::protobuf::io::CodedOutputStream cos(&gz);\n"
+    "\n"
+    "          THIS->SerializeWithCachedSizes(&cos);\n"
+    "          ok = !cos.HadError();\n"
+    "        }\n"
+    "        ok = gz.Close() && ok;\n"
+    "      }\n";
+
+  // pack_gzip
+
+  vars["method"] = "pack_gzip";
+  vars["fh"]     = "";
+  vars["items"]  = "1";
+  vars["maxitems"] = "2";
   printer.Print(vars,
-		"package *package*;\n"
+		"SV *\n"
+		"pack_gzip(svTHIS, ...)\n"
+		"  SV * svTHIS\n"
+		"  PREINIT:\n"
+		"    google::protobuf::io::GzipOutputStream::Options gopts;\n"
+		"    int level;\n"
+		"    bool ok;\n"
+		"\n"
+		"  CODE:\n");
+  GenerateTypemapInput(descriptor, printer, "THIS");
+  printer.Print(vars, level);
+  printer.Print(vars,
+		"    if ( THIS != NULL ) {\n");
+  if ( stats_ ) {
+    printer.Print("      unsigned long long t0 = perlxs_stats_now();\n"
+		  "\n");
+  }
+  printer.Print("      int size = THIS->ByteSize();\n"
+		"\n");
+  GenerateProbe(descriptor, printer, "pack_entry", "size", 3);
+  printer.Print(vars,
+		"      RETVAL = newSVpvn(\"\", 0);\n"
+		"      $base$_OutputStream os(RETVAL);\n"
+		"\n");
+  printer.Print(vars, serialize);
+  printer.Print("      if ( ok ) {\n"
+		"        os.Sync();\n"
+		"      } else {\n"
+		"        SvREFCNT_dec(RETVAL);\n"
+		"        RETVAL = Nullsv;\n"
+		"      }\n");
+  GenerateProbe(descriptor, printer, "pack_return",
+		"( RETVAL != Nullsv ) ? SvCUR(RETVAL) : 0", 3);
+  if ( stats_ ) {
+    printer.Print("\n");
+    GenerateStatsUpdate(descriptor, printer, "pack_calls", "1", 3);
+    GenerateStatsUpdate(descriptor, printer, "bytes_out",
+			"( RETVAL != Nullsv ) ? SvCUR(RETVAL) : 0", 3);
+    GenerateStatsUpdate(descriptor, printer, "nanoseconds",
+			"perlxs_stats_now() - t0", 3);
+  }
+  printer.Print("    } else {\n"
+		"      RETVAL = Nullsv;\n"
+		"    }\n"
+		"\n"
+		"  OUTPUT:\n"
+		"    RETVAL\n"
 		"\n"
-		"use strict;\n"
-		"use warnings;\n"
 		"\n");
 
-  // Each enum value is exported as a constant.
+  // pack_gzip_to_fh
 
-  for ( int i = 0; i < enum_descriptor->value_count(); i++ ) {
-    ostringstream ost;
-    ost << enum_descriptor->value(i)->number();
-    printer.Print("use constant *value* => *number*;\n",
-		  "value", enum_descriptor->value(i)->name(),
-		  "number", ost.str());
+  vars["method"] = "pack_gzip_to_fh";
+  vars["fh"]     = ", fh";
+  vars["items"]  = "2";
+  vars["maxitems"] = "3";
+  printer.Print(vars,
+		"int\n"
+		"pack_gzip_to_fh(svTHIS, fh, ...)\n"
+		"  SV * svTHIS\n"
+		"  SV * fh\n"
+		"  PREINIT:\n"
+		"    google::protobuf::io::GzipOutputStream::Options gopts;\n"
+		"    IO * io;\n"
+		"    int level;\n"
+		"    bool ok;\n"
+		"\n"
+		"  CODE:\n");
+  GenerateTypemapInput(descriptor, printer, "THIS");
+  printer.Print(vars, level);
+  printer.Print(vars,
+		"    io = sv_2io(fh);\n"
+		"    if ( IoOFP(io) == NULL ) {\n"
+		"      croak(\"pack_gzip_to_fh() on unopened filehandle\");\n"
+		"    }\n"
+		"    if ( THIS != NULL ) {\n");
+  if ( stats_ ) {
+    printer.Print("      unsigned long long t0 = perlxs_stats_now();\n"
+		  "\n");
   }
-
-  printer.Print("\n"
-		"1;\n"
+  printer.Print("      int size = THIS->ByteSize();\n"
+		"\n");
+  GenerateProbe(descriptor, printer, "pack_entry", "size", 3);
+  printer.Print(vars,
+		"      $base$_PerlIOOutputStream os(IoOFP(io));\n"
+		"\n");
+  printer.Print(vars, serialize);
+  printer.Print("      RETVAL = os.Flush() && ok;\n");
+  GenerateProbe(descriptor, printer, "pack_return", "os.ByteCount()", 3);
+  if ( stats_ ) {
+    printer.Print("\n");
+    GenerateStatsUpdate(descriptor, printer, "pack_calls", "1", 3);
+    GenerateStatsUpdate(descriptor, printer, "bytes_out", "os.ByteCount()", 3);
+    GenerateStatsUpdate(descriptor, printer, "nanoseconds",
+			"perlxs_stats_now() - t0", 3);
+  }
+  printer.Print("    } else {\n"
+		"      RETVAL = 0;\n"
+		"    }\n"
+		"\n"
+		"  OUTPUT:\n"
+		"    RETVAL\n"
 		"\n"
-		"__END__\n"
 		"\n");
 
-  // Now generate POD for the enum.
+  // unpack_gzip (gzip or zlib data, whichever it finds)
 
   printer.Print(vars,
-		"=pod\n"
+		"int\n"
+		"unpack_gzip(svTHIS, arg)\n"
+		"  SV * svTHIS\n"
+		"  SV * arg\n"
+		"  PREINIT:\n"
+		"    STRLEN len;\n"
+		"    char * str;\n"
 		"\n"
-		"=head1 NAME\n"
+		"  CODE:\n");
+  GenerateMutableTypemapInput(descriptor, printer, "THIS");
+  printer.Print("    if ( THIS != NULL ) {\n");
+  if ( stats_ ) {
+    printer.Print("      unsigned long long t0 = perlxs_stats_now();\n"
+		  "\n");
+  }
+  printer.Print("      str = SvPV(arg, len);\n");
+  GenerateProbe(descriptor, printer, "unpack_entry", "len", 3);
+  printer.Print("      google::protobuf::io::ArrayInputStream as(str, len);\n"
+		"      google::protobuf::io::GzipInputStream gz(&as);\n"
 		"\n"
-		"*package* - Perl interface to *enum*\n"
+		"      RETVAL = THIS->ParseFromZeroCopyStream(&gz);\n");
+  GenerateProbe(descriptor, printer, "unpack_return", "len", 3);
+  if ( stats_ ) {
+    printer.Print("\n");
+    GenerateStatsUpdate(descriptor, printer, "unpack_calls", "1", 3);
+    GenerateStatsUpdate(descriptor, printer, "bytes_in", "len", 3);
+    GenerateStatsUpdate(descriptor, printer, "parse_failures", "!RETVAL", 3);
+    GenerateStatsUpdate(descriptor, printer, "nanoseconds",
+			"perlxs_stats_now() - t0", 3);
+    printer.Print("      perlxs_stats_resize(aTHX_ svTHIS, THIS);\n");
+  }
+  printer.Print("    } else {\n"
+		"      RETVAL = 0;\n"
+		"    }\n"
 		"\n"
-		"=head1 SYNOPSIS\n"
+		"  OUTPUT:\n"
+		"    RETVAL\n"
 		"\n"
-		" use *package*;\n"
 		"\n");
 
-  for ( int i = 0; i < enum_descriptor->value_count(); i++ ) {
-    printer.Print(" my $*value* = *package*::*value*;\n",
-		  "package", vars["package"],
-		  "value", enum_descriptor->value(i)->name());
-  }
+  // unpack_gzip_from_fh ("len" is the compressed length)
 
   printer.Print(vars,
+		"int\n"
+		"unpack_gzip_from_fh(svTHIS, fh, len)\n"
+		"  SV * svTHIS\n"
+		"  SV * fh\n"
+		"  UV len\n"
+		"  PREINIT:\n"
+		"    IO * io;\n"
 		"\n"
-		"=head1 DESCRIPTION\n"
+		"  CODE:\n");
+  GenerateMutableTypemapInput(descriptor, printer, "THIS");
+  printer.Print("    io = sv_2io(fh);\n"
+		"    if ( IoIFP(io) == NULL ) {\n"
+		"      croak(\"unpack_gzip_from_fh() on unopened filehandle\");\n"
+		"    }\n"
+		"    if ( THIS != NULL ) {\n");
+  if ( stats_ ) {
+    printer.Print("      unsigned long long t0 = perlxs_stats_now();\n"
+		  "\n");
+  }
+  GenerateProbe(descriptor, printer, "unpack_entry", "len", 3);
+  printer.Print(vars,
+		"      $base$_InputStream is(IoIFP(io), len);\n"
+		"      {\n"
+		"        google::protobuf::io::GzipInputStream gz(&is);\n"
 		"\n"
-		"*package* defines the following constants:\n"
+		"        RETVAL = THIS->ParseFromZeroCopyStream(&gz);\n"
+		"      }\n"
+		"      is.Finish();\n");
+  GenerateProbe(descriptor, printer, "unpack_return", "len", 3);
+  if ( stats_ ) {
+    printer.Print("\n");
+    GenerateStatsUpdate(descriptor, printer, "unpack_calls", "1", 3);
+    GenerateStatsUpdate(descriptor, printer, "bytes_in", "len", 3);
+    GenerateStatsUpdate(descriptor, printer, "parse_failures", "!RETVAL", 3);
+    GenerateStatsUpdate(descriptor, printer, "nanoseconds",
+			"perlxs_stats_now() - t0", 3);
+    printer.Print("      perlxs_stats_resize(aTHX_ svTHIS, THIS);\n");
+  }
+  printer.Print("    } else {\n"
+		"      RETVAL = 0;\n"
+		"    }\n"
+		"\n"
+		"  OUTPUT:\n"
+		"    RETVAL\n"
 		"\n"
-		"=over 4\n"
 		"\n");
+}
 
-  for ( int i = 0; i < enum_descriptor->value_count(); i++ ) {
-    PODPrintEnumValue(enum_descriptor->value(i), printer);
+
+// The custom ops of --perlxs-custom-ops, for the getters and setters of
+// singular fields that are not messages.  They do what the XSUBs do,
+// less the argument handling.
+
+bool
+PerlXSGenerator::CustomOpField(const FieldDescriptor* field) const
+{
+  return !field->is_repeated() &&
+    field->cpp_type() != FieldDescriptor::CPPTYPE_MESSAGE;
+}
+
+void
+PerlXSGenerator::GenerateCustomOps(const Descriptor* descriptor,
+				   io::Printer& printer) const
+{
+  map<string, string> vars;
+  string cn = cpp::ClassName(descriptor, true);
+
+  vars["classname"]   = cn;
+  vars["perlclass"]   = MessageClassName(descriptor);
+  vars["underscores"] = StringReplace(cn, "::", "__", true);
+
+  for ( int i = 0; i < descriptor->field_count(); i++ ) {
+    const FieldDescriptor* field = descriptor->field(i);
+
+    if ( !CustomOpField(field) ) {
+      continue;
+    }
+
+    vars["field"]   = field->name();
+    vars["cppname"] = cpp::FieldName(field);
+    vars["value"]   = PerlSVValue(field, "msg->" + vars["cppname"] + "()");
+
+    printer.Print(vars,
+		  "static OP *\n"
+		  "$underscores$_pp_get_$field$ ( pTHX )\n"
+		  "{\n"
+		  "  dSP;\n"
+		  "  $classname$ * msg = static_cast<$classname$ *>(\n"
+		  "    perlxs_object(aTHX_ TOPs, \"$perlclass$\", \"THIS\"));\n"
+		  "\n"
+		  "  SETs(sv_2mortal($value$));\n"
+		  "  RETURN;\n"
+		  "}\n"
+		  "\n"
+		  "static OP *\n"
+		  "$underscores$_pp_set_$field$ ( pTHX )\n"
+		  "{\n"
+		  "  dSP;\n"
+		  "  SV * sv = POPs;\n"
+		  "  $classname$ * msg = static_cast<$classname$ *>(\n"
+		  "    perlxs_mutable_object(aTHX_ POPs, \"$perlclass$\", "
+		  "\"THIS\"));\n"
+		  "\n");
+    printer.Indent();
+    if ( field->cpp_type() == FieldDescriptor::CPPTYPE_ENUM ) {
+      // As the XSUB does, ignore values the enum does not have.
+
+      vars["etype"] = cpp::ClassName(field->enum_type(), true);
+      printer.Print(vars,
+		    "IV val = SvIV(sv);\n"
+		    "\n"
+		    "if ( $etype$_IsValid(val) ) {\n"
+		    "  msg->set_$cppname$(($etype$)val);\n"
+		    "}\n");
+    } else {
+      GenerateFieldFromSV(field, printer, "sv");
+    }
+    printer.Outdent();
+    printer.Print("  if ( GIMME_V != G_ARRAY ) {\n"
+		  "    PUSHs(&PL_sv_undef);\n"
+		  "  }\n"
+		  "  RETURN;\n"
+		  "}\n"
+		  "\n");
   }
+}
+
+
+// The copy and delete functions of a message type, for the freeze()
+// and --perlxs-ithreads magic.
+
+void
+PerlXSGenerator::GenerateClassHelpers(const Descriptor* descriptor,
+				      io::Printer& printer) const
+{
+  map<string, string> vars;
+  string cn = cpp::ClassName(descriptor, true);
+
+  vars["classname"]   = cn;
+  vars["underscores"] = StringReplace(cn, "::", "__", true);
 
   printer.Print(vars,
+		"static PERLXS_UNUSED void *\n"
+		"$underscores$_copy ( const void * msg )\n"
+		"{\n"
+		"  $classname$ * copy = new $classname$;\n"
 		"\n"
-		"=back\n"
-		"\n"
-		"=head1 AUTHOR\n"
-		"\n"
-		"Generated from *enum* by the protoc compiler.\n"
-		"\n"
-		"=head1 SEE ALSO\n"
+		"  copy->CopyFrom(*static_cast<const $classname$ *>(msg));\n"
+		"  return copy;\n"
+		"}\n"
 		"\n"
-		"http://code.google.com/p/protobuf\n"
+		"static PERLXS_UNUSED void\n"
+		"$underscores$_delete ( void * msg )\n"
+		"{\n"
+		"  delete static_cast<$classname$ *>(msg);\n"
+		"}\n"
 		"\n"
-		"=cut\n"
+		"static const perlxs_class $underscores$_class = {\n"
+		"  $underscores$_copy, $underscores$_delete\n"
+		"};\n"
 		"\n");
 }
 
 
-void
-PerlXSGenerator::GenerateFileXSTypedefs(const FileDescriptor* file,
-					io::Printer& printer,
-					set<const Descriptor*>& seen) const
-{
-  for ( int i = 0; i < file->dependency_count(); i++ ) {
-    GenerateFileXSTypedefs(file->dependency(i), printer, seen);
-  }
-
-  for ( int i = 0; i < file->message_type_count(); i++ ) {
-    GenerateMessageXSTypedefs(file->message_type(i), printer, seen);
-  }
-}
-
+// The --perlxs-stats counters of a message type.  Every module has
+// its own for each type it can hand out, imported ones included.
 
 void
-PerlXSGenerator::GenerateMessageXSTypedefs(const Descriptor* descriptor,
-					   io::Printer& printer,
-					   set<const Descriptor*>& seen) const
+PerlXSGenerator::GenerateStatsCounters(const Descriptor* descriptor,
+				       io::Printer& printer) const
 {
-  for ( int i = 0; i < descriptor->nested_type_count(); i++ ) {
-    GenerateMessageXSTypedefs(descriptor->nested_type(i), printer, seen);
-  }
+  map<string, string> vars;
+  string cn = cpp::ClassName(descriptor, true);
 
-  if ( seen.find(descriptor) == seen.end() ) {
-    string cn = cpp::ClassName(descriptor, true);
-    string un = StringReplace(cn, "::", "__", true);
+  vars["classname"]   = cn;
+  vars["underscores"] = StringReplace(cn, "::", "__", true);
+  vars["full_name"]   = descriptor->full_name();
 
-    seen.insert(descriptor);
-    printer.Print("typedef $classname$ $underscores$;\n",
-		  "classname", cn,
-		  "underscores", un);
-  }
+  printer.Print(vars,
+		"static size_t\n"
+		"$underscores$_stats_space_used ( const void * msg )\n"
+		"{\n"
+		"  return $underscores$_space_used("
+		"static_cast<const $classname$ *>(msg));\n"
+		"}\n"
+		"\n"
+		"static perlxs_stats $underscores$_stats =\n"
+		"  { \"$full_name$\", $underscores$_stats_space_used };\n"
+		"\n");
 }
 
 
+// The space_used helper is SpaceUsedLong() on the full runtime.  The
+// LITE_RUNTIME has no reflection, so there the footprint is estimated
+// from the object size plus the capacity of its strings and repeated
+// fields, recursing into submessages.
+
 void
-PerlXSGenerator::GenerateMessageStatics(const Descriptor* descriptor,
-					io::Printer& printer) const
+PerlXSGenerator::GenerateSpaceUsedHelper(const Descriptor* descriptor,
+					 io::Printer& printer) const
 {
-  for ( int i = 0; i < descriptor->nested_type_count(); i++ ) {
-    GenerateMessageStatics(descriptor->nested_type(i), printer);
-  }
-
   map<string, string> vars;
-
   string cn = cpp::ClassName(descriptor, true);
-  string un = StringReplace(cn, "::", "__", true);
 
-  vars["depth"]       = "0";
-  vars["fieldtype"]   = cn;
   vars["classname"]   = cn;
-  vars["underscores"] = un;
-
-  // from_hashref static helper
+  vars["underscores"] = StringReplace(cn, "::", "__", true);
 
   printer.Print(vars,
-		"static $classname$ *\n"
-		"$underscores$_from_hashref ( SV * sv0 )\n"
-		"{\n"
-		"  $fieldtype$ * msg$depth$ = new $fieldtype$;\n"
+		"static PERLXS_UNUSED size_t\n"
+		"$underscores$_space_used ( const $classname$ * msg )\n"
+		"{\n");
+
+#if (GOOGLE_PROTOBUF_VERSION >= 2002000)
+  if (descriptor->file()->options().optimize_for() !=
+      FileOptions::LITE_RUNTIME) {
+#endif // GOOGLE_PROTOBUF_VERSION
+    printer.Print("#if GOOGLE_PROTOBUF_VERSION >= 3001000\n"
+		  "  return msg->SpaceUsedLong();\n"
+		  "#else\n"
+		  "  return msg->SpaceUsed();\n"
+		  "#endif\n"
+		  "}\n"
+		  "\n");
+    return;
+#if (GOOGLE_PROTOBUF_VERSION >= 2002000)
+  }
+#endif // GOOGLE_PROTOBUF_VERSION
+
+  printer.Print("  size_t n = sizeof(*msg);\n"
 		"\n");
 
-  printer.Indent();
-  MessageFromHashref(descriptor, printer, vars, 0);
-  printer.Outdent();
+  for ( int i = 0; i < descriptor->field_count(); i++ ) {
+    const FieldDescriptor* field = descriptor->field(i);
+
+    vars["cppname"] = cpp::FieldName(field);
+
+    switch ( field->cpp_type() ) {
+    case FieldDescriptor::CPPTYPE_STRING:
+      if ( field->is_repeated() ) {
+	printer.Print(vars,
+		      "  for ( int i = 0; i < msg->$cppname$_size(); i++ ) {\n"
+		      "    n += sizeof(string) + msg->$cppname$(i).capacity();\n"
+		      "  }\n");
+      } else {
+	printer.Print(vars,
+		      "  if ( msg->has_$cppname$() ) {\n"
+		      "    n += msg->$cppname$().capacity();\n"
+		      "  }\n");
+      }
+      break;
+    case FieldDescriptor::CPPTYPE_MESSAGE:
+      vars["fieldtype"] = StringReplace(cpp::ClassName(field->message_type(),
+						       true),
+					"::", "__", true);
+      if ( field->is_repeated() ) {
+	printer.Print(vars,
+		      "  for ( int i = 0; i < msg->$cppname$_size(); i++ ) {\n"
+		      "    n += $fieldtype$_space_used(&msg->$cppname$(i));\n"
+		      "  }\n");
+      } else {
+	printer.Print(vars,
+		      "  if ( msg->has_$cppname$() ) {\n"
+		      "    n += $fieldtype$_space_used(&msg->$cppname$());\n"
+		      "  }\n");
+      }
+      break;
+    default:
+      if ( field->is_repeated() ) {
+	printer.Print(vars,
+		      "  n += msg->$cppname$().Capacity() * "
+		      "sizeof(*msg->$cppname$().data());\n");
+      }
+      break;
+    }
+  }
 
   printer.Print("\n"
-		"  return msg0;\n"
+		"  return n;\n"
 		"}\n"
 		"\n");
 }
@@ -978,6 +4659,14 @@ PerlXSGenerator::GenerateMessageXSFieldAccessors(const FieldDescriptor* field,
   if ( fieldtype == FieldDescriptor::CPPTYPE_MESSAGE ) {
     vars["fieldtype"]  = cpp::ClassName(field->message_type(), true);
     vars["fieldclass"] = MessageClassName(field->message_type());
+    vars["fieldunderscores"] =
+      StringReplace(vars["fieldtype"], "::", "__", true);
+
+    // The copy handed out by the getter is counted in this module's
+    // counters for its type, whichever module's DESTROY frees it.
+    if ( stats_ ) {
+      vars["stats_type"] = StringReplace(vars["fieldtype"], "::", "__", true);
+    }
   }
 
   // For repeated fields, we need an index argument.
@@ -1029,7 +4718,7 @@ PerlXSGenerator::GenerateMessageXSFieldAccessors(const FieldDescriptor* field,
 		"clear_$perlname$(svTHIS)\n"
 		"  SV * svTHIS;\n"
 		"  CODE:\n");
-  GenerateTypemapInput(descriptor, printer, "THIS");
+  GenerateMutableTypemapInput(descriptor, printer, "THIS");
   printer.Print(vars,
 		"    THIS->clear_$cppname$();\n"
 		"\n"
@@ -1059,13 +4748,6 @@ PerlXSGenerator::GenerateMessageXSFieldAccessors(const FieldDescriptor* field,
     printer.Print("    int index = 0;\n");
   }
 
-  // We need to store 64-bit integers as strings in Perl.
-
-  if ( fieldtype == FieldDescriptor::CPPTYPE_INT64 ||
-       fieldtype == FieldDescriptor::CPPTYPE_UINT64 ) {
-    printer.Print("    ostringstream ost;\n");
-  }
-
   if ( fieldtype == FieldDescriptor::CPPTYPE_MESSAGE ) {
     printer.Print(vars,
 		  "    $fieldtype$ * val = NULL;\n");
@@ -1104,14 +4786,14 @@ PerlXSGenerator::GenerateMessageXSFieldAccessors(const FieldDescriptor* field,
 		  "\n"
 		  "        EXTEND(SP, count);\n"
 		  "        for ( int index = 0; index < count; index++ ) {\n");
-    PerlSVGetHelper(printer,vars,fieldtype,5);
+    PerlSVGetHelper(printer,vars,field,5);
     printer.Print(vars,
 		  "          PUSHs(sv);\n"
 		  "        }\n"
 		  "      } else if ( index >= 0 &&\n"
 		  "                  index < THIS->$cppname$_size() ) {\n"
 		  "        EXTEND(SP,1);\n");
-    PerlSVGetHelper(printer,vars,fieldtype,4);
+    PerlSVGetHelper(printer,vars,field,4);
     printer.Print("        PUSHs(sv);\n"
 		  "      } else {\n"
 		  "        EXTEND(SP,1);\n"
@@ -1121,7 +4803,7 @@ PerlXSGenerator::GenerateMessageXSFieldAccessors(const FieldDescriptor* field,
   } else {
     printer.Print("    if ( THIS != NULL ) {\n"
 		  "      EXTEND(SP,1);\n");
-    PerlSVGetHelper(printer,vars,fieldtype,3);
+    PerlSVGetHelper(printer,vars,field,3);
     printer.Print("      PUSHs(sv);\n"
 		  "    }\n");
   }
@@ -1172,23 +4854,23 @@ PerlXSGenerator::GenerateMessageXSFieldAccessors(const FieldDescriptor* field,
     break;
   case FieldDescriptor::CPPTYPE_INT64:
     vars["value"] = "lval";
-    printer.Print("  char *svVAL\n"
+    printer.Print("  SV * svVAL\n"
 		  "\n"
 		  "  PREINIT:\n"
 		  "    long long lval;\n"
 		  "\n"
 		  "  CODE:\n"
-		  "    lval = strtoll((svVAL) ? svVAL : \"\", NULL, 0);\n");
+		  "    lval = perlxs_SvI64(aTHX_ svVAL);\n");
     break;
   case FieldDescriptor::CPPTYPE_UINT64:
     vars["value"] = "lval";
-    printer.Print("  char *svVAL\n"
+    printer.Print("  SV * svVAL\n"
 		  "\n"
 		  "  PREINIT:\n"
 		  "    unsigned long long lval;\n"
 		  "\n"
 		  "  CODE:\n"
-		  "    lval = strtoull((svVAL) ? svVAL : \"\", NULL, 0);\n");
+		  "    lval = perlxs_SvU64(aTHX_ svVAL);\n");
     break;
   case FieldDescriptor::CPPTYPE_STRING:
     vars["value"] = "sval";
@@ -1214,7 +4896,7 @@ PerlXSGenerator::GenerateMessageXSFieldAccessors(const FieldDescriptor* field,
     break;
   }
 
-  GenerateTypemapInput(descriptor, printer, "THIS");
+  GenerateMutableTypemapInput(descriptor, printer, "THIS");
 
   if ( fieldtype == FieldDescriptor::CPPTYPE_MESSAGE ) {
     GenerateTypemapInput(field->message_type(), printer, "VAL");
@@ -1286,9 +4968,8 @@ PerlXSGenerator::GenerateMessageXSCommonMethods(const Descriptor* descriptor,
 						const string& classname) const
 {
   map<string, string> vars;
-#if (GOOGLE_PROTOBUF_VERSION >= 2002000)
-  FileOptions::OptimizeMode mode;
-#endif // GOOGLE_PROTOBUF_VERSION
+  // Before LITE_RUNTIME existed, every file was optimized for speed.
+  FileOptions::OptimizeMode mode = FileOptions::SPEED;
   string cn = cpp::ClassName(descriptor, true);
   string un = StringReplace(cn, "::", "__", true);
 
@@ -1299,6 +4980,7 @@ PerlXSGenerator::GenerateMessageXSCommonMethods(const Descriptor* descriptor,
   vars["classname"]   = classname;
   vars["perlclass"]   = MessageClassName(descriptor);
   vars["underscores"] = un;
+  vars["base"]        = cpp::StripProto(descriptor->file()->name());
 
   // copy_from
 
@@ -1308,7 +4990,9 @@ PerlXSGenerator::GenerateMessageXSCommonMethods(const Descriptor* descriptor,
 		"  SV * svTHIS\n"
 		"  SV * sv\n"
 		"  CODE:\n");
-  GenerateTypemapInput(descriptor, printer, "THIS");
+  GenerateMutableTypemapInput(descriptor, printer, "THIS");
+  GenerateProbe(descriptor, printer, "copy_from_entry",
+		"THIS->GetCachedSize()", 2);
   printer.Print(vars,
 		"    if ( THIS != NULL && sv != NULL ) {\n"
 		"      if ( sv_derived_from(sv, \"$perlclass$\") ) {\n"
@@ -1324,8 +5008,10 @@ PerlXSGenerator::GenerateMessageXSCommonMethods(const Descriptor* descriptor,
 		"        THIS->CopyFrom(*other);\n"
 		"        delete other;\n"
 		"      }\n"
-		"    }\n"
-		"\n"
+		"    }\n");
+  GenerateProbe(descriptor, printer, "copy_from_return",
+		"THIS->GetCachedSize()", 2);
+  printer.Print("\n"
 		"\n");
 
   // merge_from
@@ -1336,7 +5022,7 @@ PerlXSGenerator::GenerateMessageXSCommonMethods(const Descriptor* descriptor,
 		"  SV * svTHIS\n"
 		"  SV * sv\n"
 		"  CODE:\n");
-  GenerateTypemapInput(descriptor, printer, "THIS");
+  GenerateMutableTypemapInput(descriptor, printer, "THIS");
   printer.Print(vars,
 		"    if ( THIS != NULL && sv != NULL ) {\n"
 		"      if ( sv_derived_from(sv, \"$perlclass$\") ) {\n"
@@ -1356,6 +5042,221 @@ PerlXSGenerator::GenerateMessageXSCommonMethods(const Descriptor* descriptor,
 		"\n"
 		"\n");
 
+  // clone (blessed into the class of THIS, and never frozen or
+  // borrowed, whatever THIS is)
+
+  printer.Print(vars,
+		"SV *\n"
+		"clone(svTHIS)\n"
+		"  SV * svTHIS\n"
+		"  PREINIT:\n"
+		"    $classname$ * rv;\n"
+		"\n"
+		"  CODE:\n");
+  GenerateTypemapInput(descriptor, printer, "THIS");
+  printer.Print(vars,
+		"    rv = new $classname$;\n"
+		"    rv->CopyFrom(*THIS);\n"
+		"    RETVAL = newSV(0);\n"
+		"    sv_setref_pv(RETVAL, Nullch, (void *)rv);\n"
+		"    sv_bless(RETVAL, SvSTASH(SvRV(svTHIS)));\n");
+  if ( ithreads_ ) {
+    printer.Print(vars,
+		  "    perlxs_cloneable(aTHX_ RETVAL, &$underscores$_class);\n");
+  }
+  if ( stats_ ) {
+    printer.Print(vars,
+		  "    perlxs_stats_track(aTHX_ &$underscores$_stats, RETVAL, rv);\n");
+  }
+  printer.Print("\n"
+		"  OUTPUT:\n"
+		"    RETVAL\n"
+		"\n"
+		"\n");
+
+  // swap
+
+  printer.Print(vars,
+		"void\n"
+		"swap(svTHIS, svOTHER)\n"
+		"  SV * svTHIS\n"
+		"  SV * svOTHER\n"
+		"  CODE:\n");
+  GenerateMutableTypemapInput(descriptor, printer, "THIS");
+  GenerateMutableTypemapInput(descriptor, printer, "OTHER");
+  printer.Print("    THIS->Swap(OTHER);\n"
+		"\n"
+		"\n");
+
+  // pack_delta and apply_delta.  A delta is a series of
+  // length-delimited records, with the tags of fields 1 and 2:
+  //
+  //   1: a path of field numbers, as packed varints, of a field to
+  //      clear (from the outermost message in)
+  //   2: a serialized message of the same type, to merge
+  //
+  // pack_delta() writes all of the clears, then one message if
+  // anything was set.  apply_delta() applies the records in order.
+
+  printer.Print(vars,
+		"SV *\n"
+		"pack_delta(svTHIS, svBASE)\n"
+		"  SV * svTHIS\n"
+		"  SV * svBASE\n"
+		"  CODE:\n");
+  GenerateTypemapInput(descriptor, printer, "THIS");
+  GenerateTypemapInput(descriptor, printer, "BASE");
+  printer.Print(vars,
+		"    {\n"
+		"      vector<google::protobuf::uint32>          path;\n"
+		"      vector<vector<google::protobuf::uint32> > clears;\n"
+		"      $classname$ sets;\n"
+		"\n"
+		"      bool changed = $underscores$_delta(*BASE, *THIS, &sets, "
+		"path, clears);\n"
+		"\n"
+		"      RETVAL = newSVpvn(\"\", 0);\n"
+		"      $base$_OutputStream os(RETVAL);\n"
+		"      {\n"
+		"        google::protobuf::io::CodedOutputStream cos(&os);\n"
+		"\n"
+		"        for ( size_t i = 0; i < clears.size(); i++ ) {\n"
+		"          google::protobuf::uint32 size = 0;\n"
+		"\n"
+		"          for ( size_t j = 0; j < clears[i].size(); j++ ) {\n"
+		"            size += google::protobuf::io::CodedOutputStream::"
+		"VarintSize32(\n"
+		"              clears[i][j]);\n"
+		"          }\n"
+		"          cos.WriteTag(0x0a);\n"
+		"          cos.WriteVarint32(size);\n"
+		"          for ( size_t j = 0; j < clears[i].size(); j++ ) {\n"
+		"            cos.WriteVarint32(clears[i][j]);\n"
+		"          }\n"
+		"        }\n"
+		"        if ( changed ) {\n"
+		"          cos.WriteTag(0x12);\n"
+		"          cos.WriteVarint32(sets.ByteSize());\n"
+		"          sets.SerializeWithCachedSizes(&cos);\n"
+		"        }\n"
+		"      }\n"
+		"      os.Sync();\n"
+		"    }\n"
+		"\n"
+		"  OUTPUT:\n"
+		"    RETVAL\n"
+		"\n"
+		"\n");
+
+  printer.Print(vars,
+		"int\n"
+		"apply_delta(svTHIS, arg)\n"
+		"  SV * svTHIS\n"
+		"  SV * arg\n"
+		"  PREINIT:\n"
+		"    STRLEN len;\n"
+		"    char * str;\n"
+		"\n"
+		"  CODE:\n");
+  GenerateMutableTypemapInput(descriptor, printer, "THIS");
+  printer.Print(vars,
+		"    str = SvPV(arg, len);\n"
+		"    RETVAL = 1;\n"
+		"    {\n"
+		"      google::protobuf::io::CodedInputStream cis(\n"
+		"        (const google::protobuf::uint8 *)str, len);\n"
+		"      google::protobuf::uint32 tag;\n"
+		"      google::protobuf::uint32 size;\n"
+		"\n"
+		"      while ( RETVAL && ( tag = cis.ReadTag() ) != 0 ) {\n"
+		"        if ( !cis.ReadVarint32(&size) ) {\n"
+		"          RETVAL = 0;\n"
+		"          break;\n"
+		"        }\n"
+		"\n"
+		"        google::protobuf::io::CodedInputStream::Limit limit =\n"
+		"          cis.PushLimit(size);\n"
+		"\n"
+		"        if ( tag == 0x0a ) {\n"
+		"          vector<google::protobuf::uint32> path;\n"
+		"          google::protobuf::uint32         n;\n"
+		"\n"
+		"          while ( cis.BytesUntilLimit() > 0 && cis.ReadVarint32(&n) ) {\n"
+		"            path.push_back(n);\n"
+		"          }\n"
+		"          RETVAL = cis.BytesUntilLimit() == 0 && !path.empty() &&\n"
+		"            $underscores$_clear_path(THIS, &path[0], path.size());\n"
+		"        } else if ( tag == 0x12 ) {\n"
+		"          RETVAL = THIS->MergePartialFromCodedStream(&cis) &&\n"
+		"            cis.BytesUntilLimit() == 0;\n"
+		"        } else {\n"
+		"          RETVAL = 0;\n"
+		"        }\n"
+		"        cis.PopLimit(limit);\n"
+		"      }\n"
+		"    }\n"
+		"\n"
+		"  OUTPUT:\n"
+		"    RETVAL\n"
+		"\n"
+		"\n");
+
+  // equals and diff
+
+  printer.Print(vars,
+		"int\n"
+		"equals(svTHIS, svOTHER)\n"
+		"  SV * svTHIS\n"
+		"  SV * svOTHER\n"
+		"  CODE:\n");
+  GenerateTypemapInput(descriptor, printer, "THIS");
+  GenerateTypemapInput(descriptor, printer, "OTHER");
+  if ( mode != FileOptions::LITE_RUNTIME ) {
+    printer.Print(
+      "    RETVAL = google::protobuf::util::MessageDifferencer::Equals(\n"
+      "      *THIS, *OTHER);\n");
+  } else {
+    printer.Print(vars,
+		  "    RETVAL = $underscores$_diff(*THIS, *OTHER, \"\", NULL);\n");
+  }
+  printer.Print("\n"
+		"  OUTPUT:\n"
+		"    RETVAL\n"
+		"\n"
+		"\n");
+
+  printer.Print(vars,
+		"void\n"
+		"diff(svTHIS, svOTHER)\n"
+		"  SV * svTHIS\n"
+		"  SV * svOTHER\n"
+		"  PREINIT:\n"
+		"    vector<string> paths;\n"
+		"\n"
+		"  PPCODE:\n");
+  GenerateTypemapInput(descriptor, printer, "THIS");
+  GenerateTypemapInput(descriptor, printer, "OTHER");
+  if ( mode != FileOptions::LITE_RUNTIME ) {
+    printer.Print(
+      "    {\n"
+      "      perlxs_DiffPaths reporter(&paths);\n"
+      "      google::protobuf::util::MessageDifferencer differencer;\n"
+      "\n"
+      "      differencer.ReportDifferencesTo(&reporter);\n"
+      "      differencer.Compare(*THIS, *OTHER);\n"
+      "    }\n");
+  } else {
+    printer.Print(vars,
+		  "    $underscores$_diff(*THIS, *OTHER, \"\", &paths);\n");
+  }
+  printer.Print("    EXTEND(SP, (SSize_t)paths.size());\n"
+		"    for ( size_t i = 0; i < paths.size(); i++ ) {\n"
+		"      PUSHs(sv_2mortal(newSVpvn(paths[i].data(), "
+		"paths[i].length())));\n"
+		"    }\n"
+		"\n"
+		"\n");
+
   // clear
 
   printer.Print(vars,
@@ -1363,7 +5264,7 @@ PerlXSGenerator::GenerateMessageXSCommonMethods(const Descriptor* descriptor,
 		"clear(svTHIS)\n"
 		"  SV * svTHIS\n"
 		"  CODE:\n");
-  GenerateTypemapInput(descriptor, printer, "THIS");
+  GenerateMutableTypemapInput(descriptor, printer, "THIS");
   printer.Print(vars,
 		"    if ( THIS != NULL ) {\n"
 		"      THIS->Clear();\n"
@@ -1371,6 +5272,40 @@ PerlXSGenerator::GenerateMessageXSCommonMethods(const Descriptor* descriptor,
 		"\n"
 		"\n");
 
+  // freeze and is_frozen
+
+  printer.Print(vars,
+		"SV *\n"
+		"freeze(svTHIS)\n"
+		"  SV * svTHIS\n"
+		"  CODE:\n");
+  GenerateTypemapInput(descriptor, printer, "THIS");
+  printer.Print(vars,
+		"    if ( perlxs_frozen(aTHX_ svTHIS) ) {\n"
+		"      RETVAL = newSVsv(svTHIS);\n"
+		"    } else {\n"
+		"      RETVAL = perlxs_share(aTHX_ \"$perlclass$\",\n"
+		"        $underscores$_copy(THIS), &$underscores$_class);\n"
+		"    }\n"
+		"\n"
+		"  OUTPUT:\n"
+		"    RETVAL\n"
+		"\n"
+		"\n"
+		"int\n"
+		"is_frozen(svTHIS)\n"
+		"  SV * svTHIS\n"
+		"  CODE:\n");
+  GenerateTypemapInput(descriptor, printer, "THIS");
+  printer.Print(vars,
+		"    PERL_UNUSED_VAR(THIS);\n"
+		"    RETVAL = perlxs_frozen(aTHX_ svTHIS);\n"
+		"\n"
+		"  OUTPUT:\n"
+		"    RETVAL\n"
+		"\n"
+		"\n");
+
   // is_initialized
 
   printer.Print(vars,
@@ -1426,7 +5361,7 @@ PerlXSGenerator::GenerateMessageXSCommonMethods(const Descriptor* descriptor,
 		  "discard_unkown_fields(svTHIS)\n"
 		  "  SV * svTHIS\n"
 		  "  CODE:\n");
-    GenerateTypemapInput(descriptor, printer, "THIS");
+    GenerateMutableTypemapInput(descriptor, printer, "THIS");
     printer.Print(vars,
 		  "    if ( THIS != NULL ) {\n"
 		  "      THIS->DiscardUnknownFields();\n"
@@ -1481,27 +5416,114 @@ PerlXSGenerator::GenerateMessageXSCommonMethods(const Descriptor* descriptor,
   }
 #endif // GOOGLE_PROTOBUF_VERSION
 
-  // unpack
+  // unpack, unpack_partial (no check for required fields) and
+  // merge_packed (parses into THIS as it is, without clearing it)
+
+  static const struct {
+    const char * method;
+    const char * parse;
+  } unpacks[] = {
+    { "unpack",
+      "        RETVAL = THIS->ParseFromArray(str, len);\n" },
+    { "unpack_partial",
+      "        RETVAL = THIS->ParsePartialFromArray(str, len);\n" },
+    { "merge_packed",
+      "        google::protobuf::io::CodedInputStream cis(\n"
+      "          (const google::protobuf::uint8 *)str, len);\n"
+      "\n"
+      "        RETVAL = THIS->MergeFromCodedStream(&cis) &&\n"
+      "          cis.ConsumedEntireMessage();\n" }
+  };
+
+  for ( size_t i = 0; i < sizeof(unpacks) / sizeof(unpacks[0]); i++ ) {
+    vars["method"] = unpacks[i].method;
+    printer.Print(vars,
+		  "int\n"
+		  "$method$(svTHIS, arg)\n"
+		  "  SV * svTHIS\n"
+		  "  SV * arg\n"
+		  "  PREINIT:\n"
+		  "    STRLEN len;\n"
+		  "    char * str;\n"
+		  "\n"
+		  "  CODE:\n");
+    GenerateMutableTypemapInput(descriptor, printer, "THIS");
+    printer.Print(vars,
+		  "    if ( THIS != NULL ) {\n");
+    if ( stats_ ) {
+      printer.Print("      unsigned long long t0 = perlxs_stats_now();\n"
+		    "\n");
+    }
+    printer.Print(vars,
+		  "      str = SvPV(arg, len);\n");
+    GenerateProbe(descriptor, printer, "unpack_entry", "len", 3);
+    printer.Print("      if ( str != NULL ) {\n");
+    printer.Print(unpacks[i].parse);
+    printer.Print("      } else {\n"
+		  "        RETVAL = 0;\n"
+		  "      }\n");
+    GenerateProbe(descriptor, printer, "unpack_return", "len", 3);
+    if ( stats_ ) {
+      printer.Print("\n");
+      GenerateStatsUpdate(descriptor, printer, "unpack_calls", "1", 3);
+      GenerateStatsUpdate(descriptor, printer, "bytes_in", "len", 3);
+      GenerateStatsUpdate(descriptor, printer, "parse_failures", "!RETVAL", 3);
+      GenerateStatsUpdate(descriptor, printer, "nanoseconds",
+			  "perlxs_stats_now() - t0", 3);
+      printer.Print("      perlxs_stats_resize(aTHX_ svTHIS, THIS);\n");
+    }
+    printer.Print(vars,
+		  "    } else {\n"
+		  "      RETVAL = 0;\n"
+		  "    }\n"
+		  "\n"
+		  "  OUTPUT:\n"
+		  "    RETVAL\n"
+		  "\n"
+		  "\n");
+  }
+
+  // unpack_from_fh
 
   printer.Print(vars,
 		"int\n"
-		"unpack(svTHIS, arg)\n"
+		"unpack_from_fh(svTHIS, fh, len)\n"
 		"  SV * svTHIS\n"
-		"  SV * arg\n"
+		"  SV * fh\n"
+		"  UV len\n"
 		"  PREINIT:\n"
-		"    STRLEN len;\n"
-		"    char * str;\n"
+		"    IO * io;\n"
 		"\n"
 		"  CODE:\n");
-  GenerateTypemapInput(descriptor, printer, "THIS");
+  GenerateMutableTypemapInput(descriptor, printer, "THIS");
+  printer.Print(vars,
+		"    io = sv_2io(fh);\n"
+		"    if ( IoIFP(io) == NULL ) {\n"
+		"      croak(\"unpack_from_fh() on unopened filehandle\");\n"
+		"    }\n"
+		"    if ( THIS != NULL ) {\n");
+  if ( stats_ ) {
+    printer.Print("      unsigned long long t0 = perlxs_stats_now();\n"
+		  "\n");
+  }
+  GenerateProbe(descriptor, printer, "unpack_entry", "len", 3);
+  printer.Print(vars,
+		"      $base$_InputStream is(IoIFP(io), len);\n"
+		"\n"
+		"      RETVAL = THIS->ParseFromZeroCopyStream(&is) &&\n"
+		"        (UV)is.ByteCount() == len;\n"
+		"      is.Finish();\n");
+  GenerateProbe(descriptor, printer, "unpack_return", "len", 3);
+  if ( stats_ ) {
+    printer.Print("\n");
+    GenerateStatsUpdate(descriptor, printer, "unpack_calls", "1", 3);
+    GenerateStatsUpdate(descriptor, printer, "bytes_in", "len", 3);
+    GenerateStatsUpdate(descriptor, printer, "parse_failures", "!RETVAL", 3);
+    GenerateStatsUpdate(descriptor, printer, "nanoseconds",
+			"perlxs_stats_now() - t0", 3);
+    printer.Print("      perlxs_stats_resize(aTHX_ svTHIS, THIS);\n");
+  }
   printer.Print(vars,
-		"    if ( THIS != NULL ) {\n"
-		"      str = SvPV(arg, len);\n"
-		"      if ( str != NULL ) {\n"
-		"        RETVAL = THIS->ParseFromArray(str, len);\n"
-		"      } else {\n"
-		"        RETVAL = 0;\n"
-		"      }\n"
 		"    } else {\n"
 		"      RETVAL = 0;\n"
 		"    }\n"
@@ -1515,7 +5537,7 @@ PerlXSGenerator::GenerateMessageXSCommonMethods(const Descriptor* descriptor,
 
   printer.Print(vars,
 		"SV *\n"
-		"pack(svTHIS)\n"
+		"pack(svTHIS, ...)\n"
 		"  SV * svTHIS\n");
 
   // This may be controlled by a custom option at some point.
@@ -1527,19 +5549,54 @@ PerlXSGenerator::GenerateMessageXSCommonMethods(const Descriptor* descriptor,
 #endif
 
   printer.Print(vars,
+		"  PREINIT:\n"
+		"    bool deterministic = false;\n"
+		"    bool ok;\n"
+		"\n"
 		"  CODE:\n");
   GenerateTypemapInput(descriptor, printer, "THIS");
   printer.Print(vars,
+		"    if ( items % 2 == 0 ) {\n"
+		"      croak(\"Usage: $perlclass$::pack(THIS, [deterministic => 1])\");\n"
+		"    }\n"
+		"    for ( int i = 1; i < items; i += 2 ) {\n"
+		"      const char * key = SvPV_nolen(ST(i));\n"
+		"\n"
+		"      if ( strEQ(key, \"deterministic\") ) {\n"
+		"        deterministic = SvTRUE(ST(i + 1));\n"
+		"      } else {\n"
+		"        croak(\"pack(): unknown option '%s'\", key);\n"
+		"      }\n"
+		"    }\n"
+		"#if GOOGLE_PROTOBUF_VERSION < 3001000\n"
+		"    if ( deterministic ) {\n"
+		"      croak(\"pack(): deterministic needs protobuf 3.1 or later\");\n"
+		"    }\n"
+		"#endif\n"
 		"    if ( THIS != NULL ) {\n");
-
-  vars["base"] = cpp::StripProto(descriptor->file()->name());
+  if ( stats_ ) {
+    printer.Print("      unsigned long long t0 = perlxs_stats_now();\n"
+		  "\n");
+  }
+  printer.Print("      int size = THIS->ByteSize();\n"
+		"\n");
+  GenerateProbe(descriptor, printer, "pack_entry", "size", 3);
 
   printer.Print(vars,
 		"      RETVAL = newSVpvn(\"\", 0);\n"
 		"      $base$_OutputStream os(RETVAL);\n"
 		"      if ( THIS->IsInitialized() ) {\n"
-		"        if ( THIS->SerializePartialToZeroCopyStream(&os)"
-		"!= true ) {\n"
+		"        {\n"
+		"          google::protobuf::io::CodedOutputStream cos(&os);\n"
+		"#if GOOGLE_PROTOBUF_VERSION >= 3001000\n"
+		"          if ( deterministic ) {\n"
+		"            cos.SetSerializationDeterministic(true);\n"
+		"          }\n"
+		"#endif\n"
+		"          THIS->SerializeWithCachedSizes(&cos);\n"
+		"          ok = !cos.HadError();\n"
+		"        }\n"
+		"        if ( !ok ) {\n"
 		"          SvREFCNT_dec(RETVAL);\n"
 		"          RETVAL = Nullsv;\n"
 		"        } else {\n"
@@ -1550,8 +5607,55 @@ PerlXSGenerator::GenerateMessageXSCommonMethods(const Descriptor* descriptor,
 		"'$perlclass$' because it is missing required fields: %s\",\n"
 		"              THIS->InitializationErrorString().c_str());\n"
 		"      }\n");
+  GenerateProbe(descriptor, printer, "pack_return",
+		"( RETVAL != Nullsv ) ? SvCUR(RETVAL) : 0", 3);
+
+  if ( stats_ ) {
+    printer.Print("\n");
+    GenerateStatsUpdate(descriptor, printer, "pack_calls", "1", 3);
+    GenerateStatsUpdate(descriptor, printer, "bytes_out",
+			"( RETVAL != Nullsv ) ? SvCUR(RETVAL) : 0", 3);
+    GenerateStatsUpdate(descriptor, printer, "nanoseconds",
+			"perlxs_stats_now() - t0", 3);
+  }
+
+  printer.Print(vars,
+		"    } else {\n"
+		"      RETVAL = Nullsv;\n"
+		"    }\n"
+		"\n"
+		"  OUTPUT:\n"
+		"    RETVAL\n"
+		"\n"
+		"\n");
 
+  // digest
+
+  printer.Print(vars,
+		"SV *\n"
+		"digest(svTHIS)\n"
+		"  SV * svTHIS\n"
+		"  PREINIT:\n"
+		"    char hex[17];\n"
+		"\n"
+		"  CODE:\n"
+		"#if GOOGLE_PROTOBUF_VERSION < 3001000\n"
+		"    croak(\"digest() needs protobuf 3.1 or later\");\n"
+		"#endif\n");
+  GenerateTypemapInput(descriptor, printer, "THIS");
   printer.Print(vars,
+		"    if ( THIS != NULL ) {\n"
+		"      $base$_DigestStream ds;\n"
+		"      {\n"
+		"        google::protobuf::io::CodedOutputStream cos(&ds);\n"
+		"#if GOOGLE_PROTOBUF_VERSION >= 3001000\n"
+		"        cos.SetSerializationDeterministic(true);\n"
+		"#endif\n"
+		"        THIS->ByteSize();\n"
+		"        THIS->SerializeWithCachedSizes(&cos);\n"
+		"      }\n"
+		"      snprintf(hex, sizeof(hex), \"%016llx\", ds.Digest());\n"
+		"      RETVAL = newSVpvn(hex, 16);\n"
 		"    } else {\n"
 		"      RETVAL = Nullsv;\n"
 		"    }\n"
@@ -1561,6 +5665,68 @@ PerlXSGenerator::GenerateMessageXSCommonMethods(const Descriptor* descriptor,
 		"\n"
 		"\n");
 
+  // pack_to_fh
+
+  printer.Print(vars,
+		"int\n"
+		"pack_to_fh(svTHIS, fh)\n"
+		"  SV * svTHIS\n"
+		"  SV * fh\n"
+		"  PREINIT:\n"
+		"    IO * io;\n"
+		"\n"
+		"  CODE:\n");
+  GenerateTypemapInput(descriptor, printer, "THIS");
+  printer.Print(vars,
+		"    io = sv_2io(fh);\n"
+		"    if ( IoOFP(io) == NULL ) {\n"
+		"      croak(\"pack_to_fh() on unopened filehandle\");\n"
+		"    }\n"
+		"    if ( THIS != NULL ) {\n");
+  if ( stats_ ) {
+    printer.Print("      unsigned long long t0 = perlxs_stats_now();\n"
+		  "\n");
+  }
+  printer.Print("      int size = THIS->ByteSize();\n"
+		"\n");
+  GenerateProbe(descriptor, printer, "pack_entry", "size", 3);
+  printer.Print(vars,
+		"      $base$_PerlIOOutputStream os(IoOFP(io));\n"
+		"\n"
+		"      if ( !THIS->IsInitialized() ) {\n"
+		"        croak(\"Can't serialize message of type "
+		"'$perlclass$' because it is missing required fields: %s\",\n"
+		"              THIS->InitializationErrorString().c_str());\n"
+		"      }\n"
+		"      {\n"
+		"        google::protobuf::io::CodedOutputStream cos(&os);\n"
+		"\n"
+		"        THIS->SerializeWithCachedSizes(&cos);\n"
+		"        RETVAL = !cos.HadError();\n"
+		"      }\n"
+		"      RETVAL = os.Flush() && RETVAL;\n");
+  GenerateProbe(descriptor, printer, "pack_return", "os.ByteCount()", 3);
+  if ( stats_ ) {
+    printer.Print("\n");
+    GenerateStatsUpdate(descriptor, printer, "pack_calls", "1", 3);
+    GenerateStatsUpdate(descriptor, printer, "bytes_out", "os.ByteCount()", 3);
+    GenerateStatsUpdate(descriptor, printer, "nanoseconds",
+			"perlxs_stats_now() - t0", 3);
+  }
+  printer.Print(vars,
+		"    } else {\n"
+		"      RETVAL = 0;\n"
+		"    }\n"
+		"\n"
+		"  OUTPUT:\n"
+		"    RETVAL\n"
+		"\n"
+		"\n");
+
+  if ( gzip_ && mode != FileOptions::LITE_RUNTIME ) {
+    GenerateGzipMethods(descriptor, printer);
+  }
+
   // length
 
   printer.Print(vars,
@@ -1581,6 +5747,26 @@ PerlXSGenerator::GenerateMessageXSCommonMethods(const Descriptor* descriptor,
 		"\n"
 		"\n");
 
+  // space_used
+
+  printer.Print(vars,
+		"UV\n"
+		"space_used(svTHIS)\n"
+		"  SV * svTHIS\n"
+		"  CODE:\n");
+  GenerateTypemapInput(descriptor, printer, "THIS");
+  printer.Print(vars,
+		"    if ( THIS != NULL ) {\n"
+		"      RETVAL = $underscores$_space_used(THIS);\n"
+		"    } else {\n"
+		"      RETVAL = 0;\n"
+		"    }\n"
+		"\n"
+		"  OUTPUT:\n"
+		"    RETVAL\n"
+		"\n"
+		"\n");
+
   // fields
 
   ostringstream field_count;
@@ -1613,25 +5799,27 @@ PerlXSGenerator::GenerateMessageXSCommonMethods(const Descriptor* descriptor,
 		"  SV * svTHIS\n"
 		"  CODE:\n");
   GenerateTypemapInput(descriptor, printer, "THIS");
+  printer.Print("    if ( THIS != NULL ) {\n");
+  if ( stats_ ) {
+    printer.Print("      unsigned long long t0 = perlxs_stats_now();\n");
+  }
+  printer.Print("\n");
+  GenerateProbe(descriptor, printer, "to_hashref_entry",
+		"THIS->GetCachedSize()", 3);
+
   printer.Print(vars,
-		"    if ( THIS != NULL ) {\n"
-		"      HV * hv0 = newHV();\n"
-		"      $classname$ * msg0 = THIS;\n"
-		"\n");
+		"      RETVAL = $underscores$_to_hashref(aTHX_ THIS);\n");
 
-  vars["depth"] = "0";
-  vars["fieldtype"] = classname;
+  GenerateProbe(descriptor, printer, "to_hashref_return",
+		"THIS->GetCachedSize()", 3);
 
-  printer.Indent();
-  printer.Indent();
-  printer.Indent();
-  MessageToHashref(descriptor, printer, vars, 0);
-  printer.Outdent();
-  printer.Outdent();
-  printer.Outdent();
+  if ( stats_ ) {
+    GenerateStatsUpdate(descriptor, printer, "to_hashref_calls", "1", 3);
+    GenerateStatsUpdate(descriptor, printer, "nanoseconds",
+			"perlxs_stats_now() - t0", 3);
+  }
 
-  printer.Print("      RETVAL = newRV_noinc((SV *)hv0);\n"
-		"    } else {\n"
+  printer.Print("    } else {\n"
 		"      RETVAL = Nullsv;\n"
 		"    }\n"
 		"\n"
@@ -1644,10 +5832,12 @@ PerlXSGenerator::GenerateMessageXSCommonMethods(const Descriptor* descriptor,
 void
 PerlXSGenerator::GenerateMessageXSPackage(const FileDescriptor* file,
 						const Descriptor* descriptor,
+						const string& module,
 					  io::Printer& printer) const
 {
   for ( int i = 0; i < descriptor->nested_type_count(); i++ ) {
-    GenerateMessageXSPackage(file, descriptor->nested_type(i), printer);
+    GenerateMessageXSPackage(file, descriptor->nested_type(i), module,
+			     printer);
   }
 
   map<string, string> vars;
@@ -1670,18 +5860,20 @@ PerlXSGenerator::GenerateMessageXSPackage(const FileDescriptor* file,
 	vars["perlxs_package_module"] = PerlPackageModule(perlxs_package_);
 	vars["package_module"] = PerlPackageModule(file->package());
 	vars["package_file"]   = PerlPackageFile(file->package());
+	vars["xs_module"]      = module;
 
   printer.Print(vars,
-		"MODULE = $perlxs_package_module$::$package_module$ PACKAGE = $package$\n"
+		"MODULE = $xs_module$ PACKAGE = $package$\n"
 		"PROTOTYPES: ENABLE\n"
 		"\n"
 		"\n");
 
-  // BOOT (if there are enum types)
+  // BOOT (if there are enum types).  With --perlxs-lazy-boot, the
+  // constants are left to the AUTOLOAD of the enum's package instead.
 
   int enum_count = descriptor->enum_type_count();
 
-  if ( enum_count > 0 ) {
+  if ( enum_count > 0 && !lazy_boot_ ) {
     printer.Print("BOOT:\n"
 		  "  {\n"
 		  "    HV * stash;\n\n");
@@ -1709,6 +5901,51 @@ PerlXSGenerator::GenerateMessageXSPackage(const FileDescriptor* file,
     printer.Print("  }\n\n\n");
   }
 
+  // BOOT (with --perlxs-custom-ops, if there are fields to do)
+
+  bool custom_ops = false;
+
+  for ( int i = 0; custom_ops_ && i < descriptor->field_count(); i++ ) {
+    const FieldDescriptor* field = descriptor->field(i);
+
+    if ( !CustomOpField(field) ) {
+      continue;
+    }
+    if ( !custom_ops ) {
+      printer.Print("BOOT:\n");
+      custom_ops = true;
+    }
+    printer.Print("  perlxs_custom_op(aTHX_ \"$package$::$field$\",\n"
+		  "                   $underscores$_pp_get_$field$, 0);\n"
+		  "  perlxs_custom_op(aTHX_ \"$package$::set_$field$\",\n"
+		  "                   $underscores$_pp_set_$field$, 1);\n",
+		  "package", pn,
+		  "underscores", un,
+		  "field", field->name());
+  }
+  if ( custom_ops ) {
+    printer.Print("\n\n");
+  }
+
+  // BOOT makes the frozen default instances that default_instance and
+  // the getters of unset submessages hand out, rather than the first
+  // call, which in a preforked server is made by each child.
+
+  set<const Descriptor*> defaults;
+
+  printer.Print("BOOT:\n");
+  GenerateDefaultInstanceBoot(descriptor, defaults, printer);
+  for ( int i = 0; i < descriptor->field_count(); i++ ) {
+    const FieldDescriptor* field = descriptor->field(i);
+
+    if ( field->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE &&
+	 !field->is_repeated() &&
+	 ( BorrowGetter(field) || frozen_defaults_ ) ) {
+      GenerateDefaultInstanceBoot(field->message_type(), defaults, printer);
+    }
+  }
+  printer.Print("\n\n");
+
   // Constructor
 
   printer.Print(vars,
@@ -1716,17 +5953,19 @@ PerlXSGenerator::GenerateMessageXSPackage(const FileDescriptor* file,
 		"$classname$::new (...)\n"
 		"  PREINIT:\n"
 		"    $classname$ * rv = NULL;\n"
+		"    STRLEN len = 0;\n"
 		"\n"
 		"  CODE:\n"
 		"    if ( strcmp(CLASS,\"$package$\") ) {\n"
 		"      croak(\"invalid class %s\",CLASS);\n"
-		"    }\n"
+		"    }\n");
+  GenerateProbe(descriptor, printer, "new_entry", "0", 2);
+  printer.Print(vars,
 		"    if ( items == 2 && ST(1) != Nullsv ) {\n"
 		"      if ( SvROK(ST(1)) && "
 		"SvTYPE(SvRV(ST(1))) == SVt_PVHV ) {\n"
 		"        rv = $underscores$_from_hashref(ST(1));\n"
 		"      } else {\n"
-		"        STRLEN len;\n"
 		"        char * str;\n"
 		"\n"
 		"        rv = new $classname$;\n"
@@ -1739,7 +5978,17 @@ PerlXSGenerator::GenerateMessageXSPackage(const FileDescriptor* file,
 		"      rv = new $classname$;\n"
 		"    }\n"
 		"    RETVAL = newSV(0);\n"
-		"    sv_setref_pv(RETVAL, \"$package$\", (void *)rv);\n"
+		"    sv_setref_pv(RETVAL, \"$package$\", (void *)rv);\n");
+  if ( ithreads_ ) {
+    printer.Print(vars,
+		  "    perlxs_cloneable(aTHX_ RETVAL, &$underscores$_class);\n");
+  }
+  GenerateProbe(descriptor, printer, "new_return", "len", 2);
+  if ( stats_ ) {
+    printer.Print(vars,
+		  "    perlxs_stats_track(aTHX_ &$underscores$_stats, RETVAL, rv);\n");
+  }
+  printer.Print(vars,
 		"\n"
 		"  OUTPUT:\n"
 		"    RETVAL\n"
@@ -1754,46 +6003,244 @@ PerlXSGenerator::GenerateMessageXSPackage(const FileDescriptor* file,
 		"  SV * svTHIS;\n"
 		"  CODE:\n");
   GenerateTypemapInput(descriptor, printer, "THIS");
-  printer.Print("    if ( THIS != NULL ) {\n"
-		"      delete THIS;\n"
-		"    }\n"
+  printer.Print("    if ( THIS != NULL &&\n"
+		"         !perlxs_borrowed(aTHX_ svTHIS) ) {\n");
+  GenerateProbe(descriptor, printer, "destroy_entry",
+		"THIS->GetCachedSize()", 3);
+  printer.Print("      delete THIS;\n");
+  GenerateProbe(descriptor, printer, "destroy_return", "0", 3);
+  printer.Print("    }\n"
+		"\n"
+		"\n");
+
+  // The frozen default instance
+
+  printer.Print(vars,
+		"SV *\n"
+		"default_instance (...)\n"
+		"  CODE:\n"
+		"    PERL_UNUSED_VAR(items);\n"
+		"    RETVAL = perlxs_default_instance(aTHX_ \"$package$\",\n"
+		"      &$classname$::default_instance());\n"
+		"\n"
+		"  OUTPUT:\n"
+		"    RETVAL\n"
+		"\n"
+		"\n");
+
+  // Without --perlxs-ithreads, objects are not cloned into new threads
+  // (they become undef there), rather than being deleted twice.
+
+  if ( !ithreads_ ) {
+    printer.Print("int\n"
+		  "CLONE_SKIP (...)\n"
+		  "  CODE:\n"
+		  "    PERL_UNUSED_VAR(items);\n"
+		  "    RETVAL = 1;\n"
+		  "\n"
+		  "  OUTPUT:\n"
+		  "    RETVAL\n"
+		  "\n"
+		  "\n");
+  }
+
+  // Message methods (copy_from, parse_from, etc).
+
+  GenerateMessageXSCommonMethods(descriptor, printer, cn);
+
+  // Field accessors
+
+  for ( int i = 0; i < descriptor->field_count(); i++ ) {
+    GenerateMessageXSFieldAccessors(descriptor->field(i), printer, cn);
+  }
+
+  // Nested enums
+
+  for ( int i = 0; i < enum_count; i++ ) {
+    GenerateEnumXSPackage(descriptor->enum_type(i), module, printer);
+  }
+}
+
+
+void
+PerlXSGenerator::GenerateTypemapInput(const Descriptor* descriptor,
+				      io::Printer& printer,
+				      const string& svname) const
+{
+  map<string, string> vars;
+
+  string cn = cpp::ClassName(descriptor, true);
+
+  vars["classname"]   = cn;
+  vars["perlclass"]   = MessageClassName(descriptor);
+  vars["underscores"] = StringReplace(cn, "::", "__", true);
+  vars["svname"]      = svname;
+
+  printer.Print(vars,
+		"    $classname$ * $svname$ = static_cast<$classname$ *>(\n"
+		"      perlxs_object(aTHX_ sv$svname$, \"$perlclass$\", "
+		"\"$svname$\"));\n");
+}
+
+
+// GenerateTypemapInput() for methods that change the object, which
+// croak if it is frozen.
+
+void
+PerlXSGenerator::GenerateMutableTypemapInput(const Descriptor* descriptor,
+					     io::Printer& printer,
+					     const string& svname) const
+{
+  map<string, string> vars;
+
+  string cn = cpp::ClassName(descriptor, true);
+
+  vars["classname"]   = cn;
+  vars["perlclass"]   = MessageClassName(descriptor);
+  vars["svname"]      = svname;
+
+  printer.Print(vars,
+		"    $classname$ * $svname$ = static_cast<$classname$ *>(\n"
+		"      perlxs_mutable_object(aTHX_ sv$svname$, \"$perlclass$\", "
+		"\"$svname$\"));\n");
+}
+
+// Emits the table of --perlxs-stats counters for the given messages,
+// which BOOT hands to the registry.  These are all the types with
+// counters in this module, imported ones included.
+
+void
+PerlXSGenerator::GenerateStatsTable(const vector<const Descriptor*>& messages,
+				    io::Printer& printer) const
+{
+  printer.Print("static perlxs_stats * perlxs_stats_table[] = {\n");
+  for ( size_t i = 0; i < messages.size(); i++ ) {
+    string cn = cpp::ClassName(messages[i], true);
+
+    printer.Print("  &$underscores$_stats,\n",
+		  "underscores", StringReplace(cn, "::", "__", true));
+  }
+  printer.Print("  NULL\n"
+		"};\n"
 		"\n"
 		"\n");
+}
+
+
+// Bumps a --perlxs-stats counter of the given message type.  This is
+// a no-op unless the option was given.
+
+void
+PerlXSGenerator::GenerateStatsUpdate(const Descriptor* descriptor,
+				     io::Printer& printer,
+				     const string& counter,
+				     const string& amount,
+				     int depth) const
+{
+  if ( !stats_ ) {
+    return;
+  }
+
+  string cn = cpp::ClassName(descriptor, true);
+
+  for ( int i = 0; i < depth; i++ ) {
+    printer.Indent();
+  }
+
+  printer.Print("PERLXS_STATS_ADD($underscores$_stats, $counter$, $amount$);\n",
+		"underscores", StringReplace(cn, "::", "__", true),
+		"counter", counter,
+		"amount", amount);
+
+  for ( int i = 0; i < depth; i++ ) {
+    printer.Outdent();
+  }
+}
+
+
+// Appends every message type reachable from "descriptor" (itself, its
+// nested types, and the types of its message fields, transitively) to
+// "messages", each type once.
+
+void
+PerlXSGenerator::CollectReachableMessages(const Descriptor* descriptor,
+					  set<const Descriptor*>& seen,
+					  vector<const Descriptor*>& messages) const
+{
+  if ( seen.find(descriptor) != seen.end() ) {
+    return;
+  }
+  seen.insert(descriptor);
+
+  for ( int i = 0; i < descriptor->nested_type_count(); i++ ) {
+    CollectReachableMessages(descriptor->nested_type(i), seen, messages);
+  }
+
+  for ( int i = 0; i < descriptor->field_count(); i++ ) {
+    const FieldDescriptor* field = descriptor->field(i);
+
+    if ( field->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE ) {
+      CollectReachableMessages(field->message_type(), seen, messages);
+    }
+  }
+
+  messages.push_back(descriptor);
+}
+
 
-  // Message methods (copy_from, parse_from, etc).
+// Fires a static tracepoint.  Every probe passes the message full name
+// and a byte length.  The pack probes pass the size that pack is about
+// to write.  Elsewhere (copy_from, to_hashref, DESTROY) nothing needs
+// the size, so the one cached by the last ByteSize() is reported rather
+// than computing a fresh one: it is 0 if the message was never packed.
 
-  GenerateMessageXSCommonMethods(descriptor, printer, cn);
+void
+PerlXSGenerator::GenerateProbe(const Descriptor* descriptor,
+			       io::Printer& printer,
+			       const string& probe,
+			       const string& length,
+			       int depth) const
+{
+  for ( int i = 0; i < depth; i++ ) {
+    printer.Indent();
+  }
 
-  // Field accessors
+  printer.Print("PERLXS_PROBE($probe$, \"$full_name$\", $length$);\n",
+		"probe", probe,
+		"full_name", descriptor->full_name(),
+		"length", length);
 
-  for ( int i = 0; i < descriptor->field_count(); i++ ) {
-    GenerateMessageXSFieldAccessors(descriptor->field(i), printer, cn);
+  for ( int i = 0; i < depth; i++ ) {
+    printer.Outdent();
   }
 }
 
 
+// Appends a message type and all of its nested types to "messages".
+
 void
-PerlXSGenerator::GenerateTypemapInput(const Descriptor* descriptor,
-				      io::Printer& printer,
-				      const string& svname) const
+PerlXSGenerator::CollectMessages(const Descriptor* descriptor,
+				 vector<const Descriptor*>& messages) const
 {
-  map<string, string> vars;
+  for ( int i = 0; i < descriptor->nested_type_count(); i++ ) {
+    CollectMessages(descriptor->nested_type(i), messages);
+  }
+  messages.push_back(descriptor);
+}
 
-  string cn = cpp::ClassName(descriptor, true);
+// Returns the XS MODULE name, which names the shared object and its
+// boot function.  With --perlxs-aggregate, all files share one.
 
-  vars["classname"]   = cn;
-  vars["perlclass"]   = MessageClassName(descriptor);
-  vars["underscores"] = StringReplace(cn, "::", "__", true);
-  vars["svname"]      = svname;
+string
+PerlXSGenerator::XSModuleName(const FileDescriptor* file) const
+{
+  string module = PerlPackageModule(perlxs_package_);
 
-  printer.Print(vars,
-		"    $classname$ * $svname$;\n"
-		"    if ( sv_derived_from(sv$svname$, \"$perlclass$\") ) {\n"
-		"      IV tmp = SvIV((SV *)SvRV(sv$svname$));\n"
-		"      $svname$ = INT2PTR($underscores$ *, tmp);\n"
-		"    } else {\n"
-		"      croak(\"$svname$ is not of type $perlclass$\");\n"
-		"    }\n");
+  if ( !aggregate_ ) {
+    module += "::" + PerlPackageModule(file->package());
+  }
+
+  return module;
 }
 
 // Returns the containing Perl module name for a message descriptor.
@@ -1839,53 +6286,79 @@ PerlXSGenerator::PackageName(const string& name, const string& package) const
 void
 PerlXSGenerator::PerlSVGetHelper(io::Printer& printer,
 				 const map<string, string>& vars,
-				 FieldDescriptor::CppType fieldtype,
+				 const FieldDescriptor* field,
 				 int depth) const
 {
   for ( int i = 0; i < depth; i++ ) {
     printer.Indent();
   }
 
-  switch ( fieldtype ) {
-  case FieldDescriptor::CPPTYPE_INT32:
-  case FieldDescriptor::CPPTYPE_BOOL:
-  case FieldDescriptor::CPPTYPE_ENUM:
-    printer.Print(vars,
-		  "sv = sv_2mortal(newSViv(THIS->$cppname$($i$)));\n");
-    break;
-  case FieldDescriptor::CPPTYPE_UINT32:
-    printer.Print(vars,
-		  "sv = sv_2mortal(newSVuv(THIS->$cppname$($i$)));\n");
-    break;
-  case FieldDescriptor::CPPTYPE_FLOAT:
-  case FieldDescriptor::CPPTYPE_DOUBLE:
-    printer.Print(vars,
-		  "sv = sv_2mortal(newSVnv(THIS->$cppname$($i$)));\n");
-    break;
-  case FieldDescriptor::CPPTYPE_INT64:
-  case FieldDescriptor::CPPTYPE_UINT64:
-    printer.Print(vars,
-		  "ost.str(\"\");\n"
-		  "ost << THIS->$cppname$($i$);\n"
-		  "sv = sv_2mortal(newSVpv(ost.str().c_str(),\n"
-		  "                        ost.str().length()));\n");
-    break;
-  case FieldDescriptor::CPPTYPE_STRING:
+  // A frozen parent is never changed, so what is borrowed from it is
+  // the submessage as it is.  An unset singular submessage is handed
+  // out as the frozen default instance: mutable_ would set the field.
+
+  if ( BorrowGetter(field) ) {
+    if ( !field->is_repeated() ) {
+      printer.Print(vars,
+		    "if ( !THIS->has_$cppname$() ) {\n"
+		    "  sv = sv_2mortal(perlxs_default_instance(aTHX_ "
+		    "\"$fieldclass$\",\n"
+		    "    &$fieldtype$::default_instance()));\n"
+		    "} else {\n");
+      printer.Indent();
+    }
     printer.Print(vars,
-		  "sv = sv_2mortal(newSVpv(THIS->$cppname$($i$).c_str(),\n"
-		  "                        "
-		  "THIS->$cppname$($i$).length()));\n");
-    break;
-  case FieldDescriptor::CPPTYPE_MESSAGE:
+		  "val = perlxs_frozen(aTHX_ svTHIS) ?\n"
+		  "  const_cast<$fieldtype$ *>(&THIS->$cppname$($i$)) :\n"
+		  "  THIS->mutable_$cppname$($i$);\n"
+		  "sv = sv_2mortal(perlxs_borrow(aTHX_ svTHIS, "
+		  "\"$fieldclass$\", val));\n");
+    if ( ithreads_ ) {
+      printer.Print(vars,
+		    "perlxs_cloneable(aTHX_ sv, &$fieldunderscores$_class);\n");
+    }
+    if ( !field->is_repeated() ) {
+      printer.Outdent();
+      printer.Print("}\n");
+    }
+  } else if ( field->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE ) {
+    // With --perlxs-frozen-defaults, an unset submessage is handed out
+    // as the frozen default instance of its type, rather than as a new
+    // empty message.
+
+    if ( frozen_defaults_ && !field->is_repeated() ) {
+      printer.Print(vars,
+		    "if ( !THIS->has_$cppname$() ) {\n"
+		    "  sv = sv_2mortal(perlxs_default_instance(aTHX_ "
+		    "\"$fieldclass$\",\n"
+		    "    &$fieldtype$::default_instance()));\n"
+		    "} else {\n");
+      printer.Indent();
+    }
     printer.Print(vars,
 		  "val = new $fieldtype$;\n"
 		  "val->CopyFrom(THIS->$cppname$($i$));\n"
 		  "sv = sv_newmortal();\n"
 		  "sv_setref_pv(sv, \"$fieldclass$\", (void *)val);\n");
-    break;
-  default:
-    printer.Print("sv = &PL_sv_undef;\n");
-    break;
+    if ( ithreads_ ) {
+      printer.Print(vars,
+		    "perlxs_cloneable(aTHX_ sv, &$fieldunderscores$_class);\n");
+    }
+    if ( vars.find("stats_type") != vars.end() ) {
+      printer.Print(vars,
+		    "perlxs_stats_track(aTHX_ &$stats_type$_stats, sv, val);\n");
+    }
+    if ( frozen_defaults_ && !field->is_repeated() ) {
+      printer.Outdent();
+      printer.Print("}\n");
+    }
+  } else {
+    map<string, string>::const_iterator cppname = vars.find("cppname");
+    map<string, string>::const_iterator index = vars.find("i");
+
+    printer.Print("sv = sv_2mortal($value$);\n",
+		  "value", PerlSVValue(field, "THIS->" + cppname->second +
+				       "(" + index->second + ")"));
   }
 
   for ( int i = 0; i < depth; i++ ) {
@@ -1905,6 +6378,38 @@ PerlXSGenerator::PODPrintEnumValue(const EnumValueDescriptor *value,
   printer.Print("This constant has a value of *number*.\n"
 		"\n",
 		"number", ost.str());
+
+  // Nested enum constants are made by AUTOLOAD with --perlxs-lazy-boot,
+  // so a bareword is not known to be a sub when it is compiled.
+
+  if ( lazy_boot_ && value->type()->containing_type() != NULL ) {
+    printer.Print("It is defined on first use, so under C<use strict> it\n"
+		  "must be called as C<*package*::*value*()> or\n"
+		  "C<*package*-E<gt>*value*>, not as a bareword.\n"
+		  "\n",
+		  "package", EnumClassName(value->type()),
+		  "value", value->name());
+  }
+}
+
+// The name_of and value_of functions are in the XS module, so they
+// are there once the module of the enum's file is loaded.
+
+void
+PerlXSGenerator::PODPrintEnumLookups(const EnumDescriptor* enum_descriptor,
+				     io::Printer& printer) const
+{
+  printer.Print("=item B<$name = *package*-E<gt>name_of($value)>\n"
+		"\n"
+		"Returns the name of the constant with value $value, or undef\n"
+		"if there is none.\n"
+		"\n"
+		"=item B<$value = *package*-E<gt>value_of($name)>\n"
+		"\n"
+		"Returns the value of the constant named $name, or undef if\n"
+		"there is none.\n"
+		"\n",
+		"package", EnumClassName(enum_descriptor));
 }
 
 string
@@ -1949,321 +6454,333 @@ PerlXSGenerator::PODFieldTypeString(const FieldDescriptor* field) const
   return type;
 }
 
-void
-PerlXSGenerator::StartFieldToHashref(const FieldDescriptor * field,
-				     io::Printer& printer,
-				     map<string, string>& vars,
-				     int depth) const
+// Per-field settings from perlxs_options.proto.  The int64_as of a
+// field overrides the message_int64_as of its message.
+
+bool
+PerlXSGenerator::NativeInt64(const FieldDescriptor* field) const
 {
-  SetupDepthVars(vars, depth);
+  uint64 value = 0;
 
-  if ( field->is_repeated() ) {
-    vars["i"] = "i" + vars["pdepth"];
-    printer.Print(vars,
-		  "if ( msg$pdepth$->$cppname$_size() > 0 ) {\n");
-    printer.Indent();
-    printer.Print(vars,
-		  "AV * av$pdepth$ = newAV();\n"
-		  "SV * sv$pdepth$ = newRV_noinc((SV *)av$pdepth$);\n"
-		  "\n"
-		  "for ( int $i$ = 0; "
-		  "$i$ < msg$pdepth$->$cppname$_size(); $i$++ ) {\n");
-  } else {
-    vars["i"] = "";
-    printer.Print(vars,
-		  "if ( msg$pdepth$->has_$cppname$() ) {\n");
+  if ( !FindOption(field->options(), kFieldInt64As, &value) ) {
+    FindOption(field->containing_type()->options(), kMessageInt64As, &value);
   }
-  printer.Indent();
+
+  return value == kInt64AsNative;
 }
 
-void
-PerlXSGenerator::FieldToHashrefHelper(io::Printer& printer,
-				      map<string, string>& vars,
-				      const FieldDescriptor* field) const
+bool
+PerlXSGenerator::BorrowGetter(const FieldDescriptor* field) const
 {
-  vars["msg"] = "msg" + vars["pdepth"];
-  if ( field->is_repeated() ) {
-    vars["sv"] = "sv" + vars["depth"];
-  } else {
-    vars["sv"] = "sv" + vars["pdepth"];
+  uint64 value = 0;
+
+  return ( field->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE &&
+	   FindOption(field->options(), kFieldGetter, &value) &&
+	   value == kGetterBorrow );
+}
+
+bool
+PerlXSGenerator::LazyField(const FieldDescriptor* field) const
+{
+  uint64 value = 0;
+
+  return ( field->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE &&
+	   FindOption(field->options(), kFieldLazy, &value) && value != 0 );
+}
+
+bool
+PerlXSGenerator::SkipHashref(const FieldDescriptor* field) const
+{
+  uint64 value = 0;
+
+  return FindOption(field->options(), kFieldSkipHashref, &value) &&
+    value != 0;
+}
+
+bool
+PerlXSGenerator::EnumAsName(const FieldDescriptor* field) const
+{
+  uint64 value = enum_as_name_;
+
+  if ( field->cpp_type() != FieldDescriptor::CPPTYPE_ENUM ) {
+    return false;
   }
+  FindOption(field->options(), kFieldEnumAsName, &value);
+
+  return value != 0;
+}
+
 
+// Returns an expression for a new SV holding "value", which is of the
+// C++ type of "field".  Submessages are converted by their own
+// to_hashref helper.
+
+string
+PerlXSGenerator::PerlSVValue(const FieldDescriptor* field,
+			     const string& value) const
+{
   switch ( field->cpp_type() ) {
   case FieldDescriptor::CPPTYPE_INT32:
   case FieldDescriptor::CPPTYPE_BOOL:
   case FieldDescriptor::CPPTYPE_ENUM:
-    printer.Print(vars,
-		  "SV * $sv$ = newSViv($msg$->$cppname$($i$));\n");
-    break;
+    return "newSViv(" + value + ")";
   case FieldDescriptor::CPPTYPE_UINT32:
-    printer.Print(vars,
-		  "SV * $sv$ = newSVuv($msg$->$cppname$($i$));\n");
-    break;
+    return "newSVuv(" + value + ")";
   case FieldDescriptor::CPPTYPE_FLOAT:
   case FieldDescriptor::CPPTYPE_DOUBLE:
-    printer.Print(vars,
-		  "SV * $sv$ = newSVnv($msg$->$cppname$($i$));\n");
-    break;
+    return "newSVnv(" + value + ")";
   case FieldDescriptor::CPPTYPE_INT64:
+    if ( NativeInt64(field) ) {
+      return "perlxs_newSViv64(aTHX_ " + value + ")";
+    }
+    return "perlxs_newSVi64(aTHX_ " + value + ")";
   case FieldDescriptor::CPPTYPE_UINT64:
-    printer.Print(vars,
-		  "ostringstream ost$pdepth$;\n"
-		  "\n"
-		  "ost$pdepth$ << $msg$->$cppname$($i$);\n"
-		  "SV * $sv$ = newSVpv(ost$pdepth$.str().c_str(),"
-		  " ost$pdepth$.str().length());\n");
-    break;
+    if ( NativeInt64(field) ) {
+      return "perlxs_newSVuv64(aTHX_ " + value + ")";
+    }
+    return "perlxs_newSVu64(aTHX_ " + value + ")";
   case FieldDescriptor::CPPTYPE_STRING:
+    return "perlxs_newSVstring(aTHX_ " + value + ")";
   case FieldDescriptor::CPPTYPE_MESSAGE:
+    return StringReplace(cpp::ClassName(field->message_type(), true),
+			 "::", "__", true) +
+      "_to_hashref(aTHX_ &" + value + ")";
   default:
-    printer.Print(vars,
-		  "SV * $sv$ = newSVpv($msg$->"
-		  "$cppname$($i$).c_str(), $msg$->"
-		  "$cppname$($i$).length());\n");
-    break;
+    return "newSV(0)";
   }
 }
 
-void
-PerlXSGenerator::EndFieldToHashref(const FieldDescriptor * field,
-				   io::Printer& printer,
-				   map<string, string>& vars,
-				   int depth) const
-{
-  vars["field"] = field->name();
-
-  SetupDepthVars(vars, depth);
 
-  if ( field->is_repeated() ) {
-    printer.Print(vars,
-		  "av_push(av$pdepth$, sv$depth$);\n");
-    printer.Outdent();
-    printer.Print(vars,
-		  "}\n"
-		  "hv_store(hv$pdepth$, \"$field$\", "
-		  "sizeof(\"$field$\") - 1, sv$pdepth$, 0);\n");
-  } else {
-    if ( field->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE ) {
-      printer.Print(vars,
-		    "hv_store(hv$pdepth$, \"$field$\", "
-		    "sizeof(\"$field$\") - 1, sv$depth$, 0);\n");
-    } else {
-      printer.Print(vars,
-		    "hv_store(hv$pdepth$, \"$field$\", "
-		    "sizeof(\"$field$\") - 1, sv$pdepth$, 0);\n");
-    }
-  }
-  printer.Outdent();
-  printer.Print("}\n");
-}
+// The to_hashref helper for one message type.  Each type gets exactly
+// one, and submessages call the helper of their own type, so the code
+// size is linear in the number of types and recursive types work.
 
 void
-PerlXSGenerator::MessageToHashref(const Descriptor * descriptor,
-				  io::Printer& printer,
-				  map<string, string>& vars,
-				  int depth) const
+PerlXSGenerator::GenerateToHashrefHelper(const Descriptor* descriptor,
+					 io::Printer& printer) const
 {
-  int i;
+  map<string, string> vars;
+  string cn = cpp::ClassName(descriptor, true);
 
-  // Iterate the fields
+  vars["classname"]   = cn;
+  vars["underscores"] = StringReplace(cn, "::", "__", true);
+
+  printer.Print(vars,
+		"static SV *\n"
+		"$underscores$_to_hashref ( pTHX_ const $classname$ * msg )\n"
+		"{\n"
+		"  HV * hv = newHV();\n"
+		"\n");
 
-  for ( i = 0; i < descriptor->field_count(); i++ ) {
+  for ( int i = 0; i < descriptor->field_count(); i++ ) {
     const FieldDescriptor* field = descriptor->field(i);
-    FieldDescriptor::CppType fieldtype = field->cpp_type();
+    string                 index = field->is_repeated() ? "i" : "";
 
-    vars["field"] = field->name();
+    if ( SkipHashref(field) ) {
+      continue;
+    }
+
+    vars["field"]   = field->name();
     vars["cppname"] = cpp::FieldName(field);
 
-    StartFieldToHashref(field, printer, vars, depth);
+    // A lazy submessage goes into the hash as an object of its own.
+
+    if ( LazyField(field) ) {
+      vars["value"] =
+	"perlxs_newobject(aTHX_ \"" + MessageClassName(field->message_type()) +
+	"\", new " + cpp::ClassName(field->message_type(), true) +
+	"(msg->" + vars["cppname"] + "(" + index + ")))";
+      if ( ithreads_ ) {
+	vars["value"] =
+	  "perlxs_cloneable(aTHX_ " + vars["value"] + ", &" +
+	  StringReplace(cpp::ClassName(field->message_type(), true),
+			"::", "__", true) + "_class)";
+      }
+    } else if ( EnumAsName(field) ) {
+      string value = "msg->" + vars["cppname"] + "(" + index + ")";
+
+      vars["value"] =
+	"perlxs_newSVenum(aTHX_ " +
+	StringReplace(cpp::ClassName(field->enum_type(), true),
+		      "::", "__", true) +
+	"_name_of(" + value + "), " + value + ")";
+    } else {
+      vars["value"] =
+	PerlSVValue(field, "msg->" + vars["cppname"] + "(" + index + ")");
+    }
 
-    if ( fieldtype == FieldDescriptor::CPPTYPE_MESSAGE ) {
-      vars["fieldtype"] = cpp::ClassName(field->message_type(), true);
+    if ( field->is_repeated() ) {
       printer.Print(vars,
-		    "$fieldtype$ * msg$ndepth$ = msg$pdepth$->"
-		    "mutable_$cppname$($i$);\n"
-		    "HV * hv$ndepth$ = newHV();\n"
-		    "SV * sv$depth$ = newRV_noinc((SV *)hv$ndepth$);\n"
-		    "\n");
-      MessageToHashref(field->message_type(), printer, vars, depth + 2);
-      SetupDepthVars(vars, depth);
+		    "  if ( msg->$cppname$_size() > 0 ) {\n"
+		    "    AV * av = newAV();\n"
+		    "\n"
+		    "    av_extend(av, msg->$cppname$_size() - 1);\n"
+		    "    for ( int i = 0; i < msg->$cppname$_size(); i++ ) {\n"
+		    "      av_push(av, $value$);\n"
+		    "    }\n"
+		    "    perlxs_hv_store(aTHX_ hv, \"$field$\", "
+		    "sizeof(\"$field$\") - 1,\n"
+		    "                    newRV_noinc((SV *)av));\n"
+		    "  }\n");
     } else {
-      FieldToHashrefHelper(printer, vars, field);
+      printer.Print(vars,
+		    "  if ( msg->has_$cppname$() ) {\n"
+		    "    perlxs_hv_store(aTHX_ hv, \"$field$\", "
+		    "sizeof(\"$field$\") - 1,\n"
+		    "                    $value$);\n"
+		    "  }\n");
     }
-
-    EndFieldToHashref(field, printer, vars, depth);
   }
+
+  printer.Print("\n"
+		"  return newRV_noinc((SV *)hv);\n"
+		"}\n"
+		"\n");
 }
 
+
+// Emits the statement(s) that store the value of the SV * expression
+// "sv" into "field" of "msg".
+
 void
-PerlXSGenerator::FieldFromHashrefHelper(io::Printer& printer,
-					map<string, string>& vars,
-					const FieldDescriptor * field) const
+PerlXSGenerator::GenerateFieldFromSV(const FieldDescriptor* field,
+				     io::Printer& printer,
+				     const string& sv) const
 {
-  vars["msg"] = "msg" + vars["pdepth"];
-  vars["var"] = "*sv" + vars["depth"];
+  map<string, string> vars;
 
-  if ( field->is_repeated() ) {
-    vars["do"]  = "add";
-  } else {
-    vars["do"]  = "set";
-  }
+  vars["cppname"] = cpp::FieldName(field);
+  vars["do"]      = field->is_repeated() ? "add" : "set";
+  vars["sv"]      = sv;
 
   switch ( field->cpp_type() ) {
   case FieldDescriptor::CPPTYPE_INT32:
   case FieldDescriptor::CPPTYPE_BOOL:
-    printer.Print(vars,
-		  "$msg$->$do$_$cppname$(SvIV($var$));\n");
+    printer.Print(vars, "msg->$do$_$cppname$(SvIV($sv$));\n");
     break;
   case FieldDescriptor::CPPTYPE_ENUM:
     vars["etype"] = cpp::ClassName(field->enum_type(), true);
-    printer.Print(vars,
-		  "$msg$->$do$_$cppname$"
-		  "(($etype$)SvIV($var$));\n");
+    if ( EnumAsName(field) ) {
+      vars["eunderscores"] = StringReplace(vars["etype"], "::", "__", true);
+      vars["epackage"]     = EnumClassName(field->enum_type());
+      printer.Print(vars,
+		    "msg->$do$_$cppname$(($etype$)perlxs_SvEnum(aTHX_ $sv$,\n"
+		    "  $eunderscores$_value_of, \"$epackage$\"));\n");
+    } else {
+      printer.Print(vars, "msg->$do$_$cppname$(($etype$)SvIV($sv$));\n");
+    }
     break;
   case FieldDescriptor::CPPTYPE_UINT32:
-    printer.Print(vars,
-		  "$msg$->$do$_$cppname$(SvUV($var$));\n");
+    printer.Print(vars, "msg->$do$_$cppname$(SvUV($sv$));\n");
     break;
   case FieldDescriptor::CPPTYPE_FLOAT:
   case FieldDescriptor::CPPTYPE_DOUBLE:
-    printer.Print(vars,
-		  "$msg$->$do$_$cppname$(SvNV($var$));\n");
+    printer.Print(vars, "msg->$do$_$cppname$(SvNV($sv$));\n");
     break;
   case FieldDescriptor::CPPTYPE_INT64:
     printer.Print(vars,
-		  "int64_t iv$pdepth$ = "
-		  "strtoll(SvPV_nolen($var$), NULL, 0);\n"
-		  "\n"
-		  "$msg$->$do$_$cppname$(iv$pdepth$);\n");
+		  "msg->$do$_$cppname$(perlxs_SvI64(aTHX_ $sv$));\n");
     break;
   case FieldDescriptor::CPPTYPE_UINT64:
     printer.Print(vars,
-		  "uint64_t uv$pdepth$ = "
-		  "strtoull(SvPV_nolen($var$), NULL, 0);\n"
-		  "\n"
-		  "$msg$->$do$_$cppname$(uv$pdepth$);\n");
+		  "msg->$do$_$cppname$(perlxs_SvU64(aTHX_ $sv$));\n");
     break;
   case FieldDescriptor::CPPTYPE_STRING:
-    printer.Print("STRLEN len;\n"
-		  "char * str;\n");
-
-    if ( field->type() == FieldDescriptor::TYPE_STRING ) {
-      printer.Print("string sval;\n");
-    }
-
     printer.Print(vars,
+		  "STRLEN len;\n"
+		  "const char * str = SvPV($sv$, len);\n"
 		  "\n"
-		  "str = SvPV($var$, len);\n");
-
-    if ( field->type() == FieldDescriptor::TYPE_STRING ) {
-      printer.Print(vars,
-		    "sval.assign(str, len);\n"
-		    "$msg$->$do$_$cppname$(sval);\n");
-    } else if ( field->type() == FieldDescriptor::TYPE_BYTES ) {
+		  "msg->$do$_$cppname$(str, len);\n");
+    break;
+  case FieldDescriptor::CPPTYPE_MESSAGE:
+    vars["fieldtype"] = StringReplace(cpp::ClassName(field->message_type(),
+						     true),
+				      "::", "__", true);
+    vars["get"] = field->is_repeated() ? "add" : "mutable";
+    if ( LazyField(field) ) {
+      vars["classname"] = cpp::ClassName(field->message_type(), true);
+      vars["perlclass"] = MessageClassName(field->message_type());
       printer.Print(vars,
-		    "$msg$->$do$_$cppname$(str, len);\n");
+		    "$classname$ * sub = msg->$get$_$cppname$();\n"
+		    "\n"
+		    "if ( sv_isobject($sv$) && "
+		    "sv_derived_from($sv$, \"$perlclass$\") ) {\n"
+		    "  sub->CopyFrom(*INT2PTR($classname$ *, "
+		    "SvIV(SvRV($sv$))));\n"
+		    "} else {\n"
+		    "  $fieldtype$_from_hashref_into(aTHX_ sub, $sv$);\n"
+		    "}\n");
     } else {
-      // Can't get here
+      printer.Print(vars,
+		    "$fieldtype$_from_hashref_into(aTHX_ "
+		    "msg->$get$_$cppname$(), $sv$);\n");
     }
     break;
-  case FieldDescriptor::CPPTYPE_MESSAGE:
-  // Should never get here.
   default:
     break;
   }
 }
 
+
+// The from_hashref helper for one message type, which fills in an
+// existing message.  Like the to_hashref helper, submessages call the
+// helper of their own type.
+
 void
-PerlXSGenerator::MessageFromHashref(const Descriptor * descriptor,
-				    io::Printer& printer,
-				    map<string, string>& vars,
-				    int depth) const
+PerlXSGenerator::GenerateFromHashrefHelper(const Descriptor* descriptor,
+					   io::Printer& printer) const
 {
-  int i;
+  map<string, string> vars;
+  string cn = cpp::ClassName(descriptor, true);
 
-  SetupDepthVars(vars, depth);
+  vars["classname"]   = cn;
+  vars["underscores"] = StringReplace(cn, "::", "__", true);
 
   printer.Print(vars,
-		"if ( SvROK(sv$pdepth$) && "
-		"SvTYPE(SvRV(sv$pdepth$)) == SVt_PVHV ) {\n");
-  printer.Indent();
-  printer.Print(vars,
-		"HV *  hv$pdepth$ = (HV *)SvRV(sv$pdepth$);\n"
-		"SV ** sv$depth$;\n"
+		"static void\n"
+		"$underscores$_from_hashref_into ( pTHX_ $classname$ * msg, "
+		"SV * sv )\n"
+		"{\n"
+		"  HV *  hv = perlxs_hashref(aTHX_ sv);\n"
+		"  SV ** svp;\n"
+		"\n"
+		"  if ( hv == NULL ) {\n"
+		"    return;\n"
+		"  }\n"
 		"\n");
 
-  // Iterate the fields
+  printer.Indent();
 
-  for ( i = 0; i < descriptor->field_count(); i++ ) {
+  for ( int i = 0; i < descriptor->field_count(); i++ ) {
     const FieldDescriptor* field = descriptor->field(i);
 
-    vars["field"]   = field->name();
-    vars["cppname"] = cpp::FieldName(field);
-
-    if ( field->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE ) {
-      vars["fieldtype"] = cpp::ClassName(field->message_type(), true);
+    if ( SkipHashref(field) ) {
+      continue;
     }
 
-    printer.Print(vars,
-		  "if ( (sv$depth$ = hv_fetch(hv$pdepth$, "
-		  "\"$field$\", sizeof(\"$field$\") - 1, 0)) != NULL ) {\n");
+    vars["field"] = field->name();
 
+    printer.Print(vars,
+		  "if ( (svp = hv_fetch(hv, \"$field$\", "
+		  "sizeof(\"$field$\") - 1, 0)) != NULL ) {\n");
     printer.Indent();
 
     if ( field->is_repeated() ) {
-      printer.Print(vars,
-		    "if ( SvROK(*sv$depth$) && "
-		    "SvTYPE(SvRV(*sv$depth$)) == SVt_PVAV ) {\n");
-      printer.Indent();
-      printer.Print(vars,
-		    "AV * av$depth$ = (AV *)SvRV(*sv$depth$);\n"
+      printer.Print("AV * av = perlxs_arrayref(aTHX_ *svp);\n"
 		    "\n"
-		    "for ( int i$depth$ = 0; "
-		    "i$depth$ <= av_len(av$depth$); i$depth$++ ) {\n");
+		    "for ( int i = 0; av != NULL && i <= av_len(av); i++ ) {\n"
+		    "  SV ** elem = av_fetch(av, i, 0);\n"
+		    "\n"
+		    "  if ( elem != NULL ) {\n");
       printer.Indent();
-
-      if ( field->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE ) {
-	printer.Print(vars,
-		      "$fieldtype$ * msg$ndepth$ = "
-		      "msg$pdepth$->add_$cppname$();\n"
-		      "SV ** sv$depth$;\n"
-		      "SV *  sv$ndepth$;\n"
-		      "\n"
-		      "if ( (sv$depth$ = "
-		      "av_fetch(av$depth$, i$depth$, 0)) != NULL ) {\n"
-		      "  sv$ndepth$ = *sv$depth$;\n");
-      } else {
-	printer.Print(vars,
-		      "SV ** sv$depth$;\n"
-		      "\n"
-		      "if ( (sv$depth$ = "
-		      "av_fetch(av$depth$, i$depth$, 0)) != NULL ) {\n");
-      }
       printer.Indent();
-    } else {
-      if ( field->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE ) {
-	printer.Print(vars,
-		      "$fieldtype$ * msg$ndepth$ = "
-		      "msg$pdepth$->mutable_$cppname$();\n"
-		      "SV * sv$ndepth$ = *sv$depth$;\n"
-		      "\n");
-      }
-    }
-
-    if ( field->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE ) {
-      MessageFromHashref(field->message_type(), printer, vars, depth + 2);
-      SetupDepthVars(vars, depth);
-    } else {
-      FieldFromHashrefHelper(printer, vars, field);
-    }
-
-    if ( field->is_repeated() ) {
-      printer.Outdent();
-      printer.Print("}\n");
+      GenerateFieldFromSV(field, printer, "*elem");
       printer.Outdent();
-      printer.Print("}\n");
       printer.Outdent();
-      printer.Print("}\n");
+      printer.Print("  }\n"
+		    "}\n");
+    } else {
+      GenerateFieldFromSV(field, printer, "*svp");
     }
 
     printer.Outdent();
@@ -2271,7 +6788,8 @@ PerlXSGenerator::MessageFromHashref(const Descriptor * descriptor,
   }
 
   printer.Outdent();
-  printer.Print("}\n");
+  printer.Print("}\n"
+		"\n");
 }
 
 }  // namespace perlxs
@@ -53,27 +53,90 @@ class LIBPROTOC_EXPORT PerlXSGenerator : public CodeGenerator {
 			OutputDirectory* output_directory,
 			string* error) const;
 
+  // With --perlxs-aggregate, all files go into one XS module and one
+  // shared object.  Otherwise each file gets a module of its own.
+  virtual bool GenerateAll(const vector<const FileDescriptor*>& files,
+			   const string& parameter,
+			   OutputDirectory* output_directory,
+			   string* error) const;
+
   const string& GetVersionInfo() const;
   bool ProcessOption(const string& option);
 
+  // Applies the options in a generator parameter such as
+  // "package=Foo,stats".  Returns false, with "error" set, on an
+  // unknown option.
+  bool ParseParameter(const string& parameter, string* error);
+
  private:
   GOOGLE_DISALLOW_EVIL_CONSTRUCTORS(PerlXSGenerator);
 
  private:
+  void CopyOptions(const PerlXSGenerator& other);
+
   string PerlPackageName(const string& name) const;
   string PerlPackageFile(const string& name) const;
   string PerlPackageModule(const string& name) const;
   string StripLast(const string& name,const char seperator) const;
   
-  void GenerateMakefilePL(const FileDescriptor* file,
+  void GenerateFiles(const vector<const FileDescriptor*>& files,
+		     OutputDirectory* outdir) const;
+
+  void GenerateFile(const FileDescriptor* file,
+		    OutputDirectory* outdir) const;
+
+  struct GenerateTask;
+  struct GenerateJob;
+
+  void RunTask(const GenerateJob& job, size_t t,
+	       OutputDirectory* outdir) const;
+
+  static void* GenerateWorker(void* arg);
+
+  void RunTasks(GenerateJob& job, OutputDirectory* outdir) const;
+
+  void GenerateMakefilePL(const vector<const FileDescriptor*>& files,
 													OutputDirectory* outdir) const;
 
-  void GenerateXS(const FileDescriptor* file,
+  void GenerateXS(const vector<const FileDescriptor*>& files,
 		              OutputDirectory* output_directory) const;
 
+  void GenerateRuntime(OutputDirectory* outdir) const;
+
+  void GenerateShardedXS(const vector<const FileDescriptor*>& files,
+			 OutputDirectory* outdir) const;
+
+  string XSShardModuleName(const vector<const FileDescriptor*>& files,
+			   size_t k) const;
+
+  void GenerateXSShard(const vector<const FileDescriptor*>& files,
+		       const vector<const Descriptor*>& messages,
+		       size_t k,
+		       OutputDirectory* outdir) const;
+
+  void GenerateXSShardBoot(const vector<const FileDescriptor*>& files,
+			   size_t count,
+			   OutputDirectory* outdir) const;
+
+  void GenerateXSPreamble(const vector<const FileDescriptor*>& files,
+			  io::Printer& printer) const;
+
+  void GenerateXSMessages(const vector<const Descriptor*>& messages,
+			  const vector<const EnumDescriptor*>& enums,
+			  const string& module,
+			  io::Printer& printer) const;
+
+  void ShardMessages(const vector<const FileDescriptor*>& files,
+		     vector<vector<const Descriptor*> >& shards) const;
+
+  void GenerateFileModules(const FileDescriptor* file,
+			   OutputDirectory* outdir) const;
+
   void GenerateModule(const FileDescriptor* file,
                   		OutputDirectory* outdir) const;
 
+  void GenerateLoaderModule(OutputDirectory* outdir) const;
+
   void GenerateServiceModule(const FileDescriptor* file,
  																						OutputDirectory* outdir) const;
 
@@ -89,6 +152,15 @@ class LIBPROTOC_EXPORT PerlXSGenerator : public CodeGenerator {
   void GenerateEnumModule(const EnumDescriptor* enum_descriptor,
 			  OutputDirectory* outdir) const;
 
+  void GenerateBench(const FileDescriptor* file,
+		     const Descriptor* descriptor,
+		     OutputDirectory* outdir) const;
+
+  void GenerateBenchRandom(const Descriptor* descriptor,
+			   io::Printer& printer) const;
+
+  string BenchRandomValue(const FieldDescriptor* field) const;
+
   void GenerateMessageXSFieldAccessors(const FieldDescriptor* field,
 				       io::Printer& printer,
 				       const string& classname) const;
@@ -97,8 +169,12 @@ class LIBPROTOC_EXPORT PerlXSGenerator : public CodeGenerator {
 				      io::Printer& printer,
 				      const string& classname) const;
 
+  void GenerateGzipMethods(const Descriptor* descriptor,
+			   io::Printer& printer) const;
+
   void GenerateFileXSTypedefs(const FileDescriptor* file,
 			      io::Printer& printer,
+			      set<const FileDescriptor*>& walked,
 			      set<const Descriptor*>& seen) const;
 
   void GenerateMessageXSTypedefs(const Descriptor* descriptor,
@@ -108,14 +184,71 @@ class LIBPROTOC_EXPORT PerlXSGenerator : public CodeGenerator {
   void GenerateMessageStatics(const Descriptor* descriptor,
 			      io::Printer& printer) const;
 
+  void GenerateMessageHelpers(const vector<const Descriptor*>& messages,
+			      io::Printer& printer) const;
+
+  void GenerateEnumHelpers(const EnumDescriptor* enum_descriptor,
+			   io::Printer& printer) const;
+
+  void GenerateEnumXSPackage(const EnumDescriptor* enum_descriptor,
+			     const string& module,
+			     io::Printer& printer) const;
+
+  void GenerateClassHelpers(const Descriptor* descriptor,
+			    io::Printer& printer) const;
+
+  void GenerateSpaceUsedHelper(const Descriptor* descriptor,
+			       io::Printer& printer) const;
+
+  void GenerateCustomOps(const Descriptor* descriptor,
+			 io::Printer& printer) const;
+
+  bool CustomOpField(const FieldDescriptor* field) const;
+
+  void GenerateDefaultInstanceBoot(const Descriptor* descriptor,
+				   set<const Descriptor*>& seen,
+				   io::Printer& printer) const;
+
   void GenerateMessageXSPackage(const FileDescriptor* file,
         const Descriptor* descriptor,
+				const string& module,
 				io::Printer& printer) const;
 
   void GenerateTypemapInput(const Descriptor* descriptor,
 			    io::Printer& printer,
 			    const string& svname) const;
 
+  void GenerateMutableTypemapInput(const Descriptor* descriptor,
+				   io::Printer& printer,
+				   const string& svname) const;
+
+  void GenerateStatsCounters(const Descriptor* descriptor,
+			     io::Printer& printer) const;
+
+  void GenerateStatsTable(const vector<const Descriptor*>& messages,
+			  io::Printer& printer) const;
+
+  void GenerateStatsUpdate(const Descriptor* descriptor,
+			   io::Printer& printer,
+			   const string& counter,
+			   const string& amount,
+			   int depth) const;
+
+  void GenerateProbe(const Descriptor* descriptor,
+		     io::Printer& printer,
+		     const string& probe,
+		     const string& length,
+		     int depth) const;
+
+  void CollectMessages(const Descriptor* descriptor,
+		       vector<const Descriptor*>& messages) const;
+
+  void CollectReachableMessages(const Descriptor* descriptor,
+				set<const Descriptor*>& seen,
+				vector<const Descriptor*>& messages) const;
+
+  string XSModuleName(const FileDescriptor* file) const;
+
   string MessageModuleName(const Descriptor* descriptor) const;
 
   string MessageClassName(const Descriptor* descriptor) const;
@@ -126,46 +259,79 @@ class LIBPROTOC_EXPORT PerlXSGenerator : public CodeGenerator {
 
   void PerlSVGetHelper(io::Printer& printer,
 		       const map<string, string>& vars,
-		       FieldDescriptor::CppType fieldtype,
+		       const FieldDescriptor* field,
 		       int depth) const;
 
   void PODPrintEnumValue(const EnumValueDescriptor *value,
 			 io::Printer& printer) const;
 
+  void PODPrintEnumLookups(const EnumDescriptor* enum_descriptor,
+			   io::Printer& printer) const;
+
   string PODFieldTypeString(const FieldDescriptor* field) const;
 
-  void StartFieldToHashref(const FieldDescriptor * field,
-			   io::Printer& printer,
-			   map<string, string>& vars,
-			   int depth) const;
+  string PerlSVValue(const FieldDescriptor* field,
+		     const string& value) const;
 
-  void FieldToHashrefHelper(io::Printer& printer,
-			    map<string, string>& vars,
-			    const FieldDescriptor* field) const;
+  bool NativeInt64(const FieldDescriptor* field) const;
 
-  void EndFieldToHashref(const FieldDescriptor * field,
-			 io::Printer& printer,
-			 map<string, string>& vars,
-			 int depth) const;
+  bool BorrowGetter(const FieldDescriptor* field) const;
 
-  void MessageToHashref(const Descriptor * descriptor,
-			io::Printer& printer,
-			map<string, string>& vars,
-			int depth) const;
+  bool LazyField(const FieldDescriptor* field) const;
 
-  void FieldFromHashrefHelper(io::Printer& printer,
-			      map<string, string>& vars,
-			      const FieldDescriptor * field) const;
+  bool SkipHashref(const FieldDescriptor* field) const;
 
-  void MessageFromHashref(const Descriptor * descriptor,
-			  io::Printer& printer,
-			  map<string, string>& vars,
-			  int depth) const;
+  bool EnumAsName(const FieldDescriptor* field) const;
+
+  void GenerateToHashrefHelper(const Descriptor* descriptor,
+			       io::Printer& printer) const;
+
+  void GenerateDiffHelper(const Descriptor* descriptor,
+			  io::Printer& printer) const;
+
+  void GenerateDeltaHelpers(const Descriptor* descriptor,
+			    io::Printer& printer) const;
+
+  void GenerateFromHashrefHelper(const Descriptor* descriptor,
+				 io::Printer& printer) const;
+
+  void GenerateFieldFromSV(const FieldDescriptor* field,
+			   io::Printer& printer,
+			   const string& sv) const;
 
  private:
   // --perlxs-package option (if given)
   std::string perlxs_package_;
   std::string grpc_base_;
+  // --perlxs-stats option (if given)
+  bool stats_;
+  // --perlxs-bench option (if given)
+  bool bench_;
+  // --perlxs-aggregate option (if given)
+  bool aggregate_;
+  // --perlxs-shards option (if given)
+  int shards_;
+  // --perlxs-incremental option (if given)
+  bool incremental_;
+  // --perlxs-enum-as-name option (if given)
+  bool enum_as_name_;
+  // --perlxs-lazy-boot option (if given)
+  bool lazy_boot_;
+  // --perlxs-frozen-defaults option (if given)
+  bool frozen_defaults_;
+  // --perlxs-ithreads option (if given)
+  bool ithreads_;
+  // --perlxs-custom-ops option (if given)
+  bool custom_ops_;
+  // --perlxs-gzip option (if given)
+  bool gzip_;
+  // --perlxs-jobs option (if given)
+  int jobs_;
+  // protoc's --out directory, where --perlxs-incremental looks for the
+  // previous output
+  std::string out_dir_;
+  // why an option value was rejected, reported by GenerateAll
+  std::string option_error_;
 };
 
 }  // namespace perlxs
@@ -1,8 +1,12 @@
+#include <cctype>
+#include <climits>
 #include <vector>
 #include <sstream>
 #include <google/protobuf/compiler/perlxs/perlxs_helpers.h>
 #include <google/protobuf/io/printer.h>
 #include <google/protobuf/descriptor.pb.h>
+#include <google/protobuf/message.h>
+#include <google/protobuf/unknown_field_set.h>
 
 namespace google {
 namespace protobuf {
@@ -29,6 +33,83 @@ SetupDepthVars(map<string, string>& vars, int depth)
   vars["ndepth"] = ost_ndepth.str();
 }
 
+bool
+FindOption(const Message& options, int number, uint64* value)
+{
+  const UnknownFieldSet& unknown =
+    options.GetReflection()->GetUnknownFields(options);
+  bool found = false;
+
+  // As for any non-repeated field, the last value wins.
+
+  for ( int i = 0; i < unknown.field_count(); i++ ) {
+    const UnknownField& field = unknown.field(i);
+
+    if ( field.number() == number &&
+	 field.type() == UnknownField::TYPE_VARINT ) {
+      *value = field.varint();
+      found = true;
+    }
+  }
+
+  return found;
+}
+
+uint32
+EnumNameHash(const string& name, uint32 seed)
+{
+  uint32 h = 2166136261U ^ seed;
+
+  for ( size_t i = 0; i < name.length(); i++ ) {
+    h ^= (unsigned char)name[i];
+    h *= 16777619U;
+  }
+
+  return h;
+}
+
+string
+OutputDirectoryName(const string& value)
+{
+  size_t colon = value.find_last_of(':');
+
+  // A drive letter ("C:\dir" or "opt:C:/dir") is part of the directory.
+
+  if ( colon != string::npos && colon > 0 && colon + 1 < value.length() &&
+       isalpha((unsigned char)value[colon - 1]) &&
+       (colon == 1 || value[colon - 2] == ':') &&
+       (value[colon + 1] == '\\' || value[colon + 1] == '/') ) {
+    colon = (colon == 1) ? string::npos : colon - 2;
+  }
+
+  return (colon == string::npos) ? value : value.substr(colon + 1);
+}
+
+bool
+ParsePositive(const string& value, int* n)
+{
+  long long result = 0;
+
+  if ( value.empty() ) {
+    return false;
+  }
+  for ( size_t i = 0; i < value.length(); i++ ) {
+    if ( !isdigit((unsigned char)value[i]) ) {
+      return false;
+    }
+    result = result * 10 + (value[i] - '0');
+    if ( result > INT_MAX ) {
+      return false;
+    }
+  }
+  if ( result == 0 ) {
+    return false;
+  }
+
+  *n = static_cast<int>(result);
+  return true;
+}
+
 }  // namespace perlxs
 }  // namespace compiler
 }  // namespace protobuf
@@ -3,10 +3,13 @@
 
 #include <map>
 #include <string>
+#include <google/protobuf/stubs/common.h>
 
 namespace google {
 namespace protobuf {
 
+class Message;
+
 extern std::string StringReplace(const std::string& s,
 				 const std::string& oldsub,
 				 const std::string& newsub,
@@ -17,6 +20,45 @@ namespace perlxs {
 
 void SetupDepthVars(std::map<std::string, std::string>& vars, int depth);
 
+// Field numbers of the custom options in perlxs_options.proto.  Field
+// and message options are separate extension ranges, so they overlap.
+
+const int kFieldInt64As      = 51001;
+const int kFieldGetter       = 51002;
+const int kFieldLazy         = 51003;
+const int kFieldSkipHashref  = 51004;
+const int kFieldEnumAsName   = 51005;
+const int kMessageInt64As    = 51001;
+
+// Values of the perlxs.Int64As and perlxs.Getter enums.
+
+const uint64 kInt64AsNative  = 1;
+const uint64 kGetterBorrow   = 1;
+
+// Looks up the custom option "number" in "options" and stores its value
+// in "value".  protoxs is not linked with the code generated from
+// perlxs_options.proto, so the options are left among the unknown
+// fields of the options message.  Returns false if the option is not
+// set.
+
+bool FindOption(const Message& options, int number, uint64* value);
+
+// The hash the generated enum name tables are indexed by: 32-bit FNV-1a
+// with "seed" folded into the offset basis.  perlxs_enum_hash() in
+// perlxs_runtime.h must compute the same value.
+
+uint32 EnumNameHash(const std::string& name, uint32 seed);
+
+// The output directory in the value of a --out=opt1,opt2:dir option:
+// whatever follows the last ':' that is not a drive letter's.
+
+std::string OutputDirectoryName(const std::string& value);
+
+// Parses "value" as a positive decimal integer into "n".  Returns false
+// if it is anything else, or too large for an int.
+
+bool ParsePositive(const std::string& value, int* n);
+
 }  // namespace perlxs
 }  // namespace compiler
 }  // namespace protobuf
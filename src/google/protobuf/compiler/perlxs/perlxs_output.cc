@@ -0,0 +1,97 @@
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <google/protobuf/compiler/perlxs/perlxs_output.h>
+#include <google/protobuf/io/zero_copy_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+
+namespace google {
+namespace protobuf {
+namespace compiler {
+namespace perlxs {
+
+BufferedOutputDirectory::BufferedOutputDirectory(
+    OutputDirectory* output_directory,
+    const string& dir)
+  : output_directory_(output_directory),
+    dir_(dir)
+{
+}
+
+BufferedOutputDirectory::~BufferedOutputDirectory() {}
+
+
+io::ZeroCopyOutputStream*
+BufferedOutputDirectory::Open(const string& filename)
+{
+  string& contents = files_[filename];
+
+  contents.clear();
+  return new io::StringOutputStream(&contents);
+}
+
+
+// Compares the generated contents with the file already on disk.  With
+// no output directory to look in, everything counts as changed.
+
+bool
+BufferedOutputDirectory::Unchanged(const string& filename,
+				   const string& contents) const
+{
+  if ( dir_.empty() ) {
+    return false;
+  }
+
+  ifstream in((dir_ + "/" + filename).c_str(), ios::in | ios::binary);
+
+  if ( !in ) {
+    return false;
+  }
+
+  ostringstream existing;
+
+  existing << in.rdbuf();
+  return existing.str() == contents;
+}
+
+
+int
+BufferedOutputDirectory::Flush()
+{
+  int unchanged = 0;
+
+  for ( map<string, string>::const_iterator i = files_.begin();
+	i != files_.end(); ++i ) {
+    if ( Unchanged(i->first, i->second) ) {
+      unchanged++;
+      continue;
+    }
+
+    scoped_ptr<io::ZeroCopyOutputStream>
+      output(output_directory_->Open(i->first));
+    void*  data;
+    int    size;
+    size_t written = 0;
+
+    while ( written < i->second.size() && output->Next(&data, &size) ) {
+      size_t n = i->second.size() - written;
+
+      if ( n > static_cast<size_t>(size) ) {
+	n = size;
+      }
+      memcpy(data, i->second.data() + written, n);
+      written += n;
+      if ( n < static_cast<size_t>(size) ) {
+	output->BackUp(size - n);
+      }
+    }
+  }
+
+  files_.clear();
+  return unchanged;
+}
+
+}  // namespace perlxs
+}  // namespace compiler
+}  // namespace protobuf
+}  // namespace google
@@ -0,0 +1,51 @@
+#ifndef GOOGLE_PROTOBUF_COMPILER_PERLXS_OUTPUT_H__
+#define GOOGLE_PROTOBUF_COMPILER_PERLXS_OUTPUT_H__
+
+#include <map>
+#include <string>
+#include <google/protobuf/compiler/code_generator.h>
+#include <google/protobuf/stubs/common.h>
+
+namespace google {
+namespace protobuf {
+
+namespace io { class ZeroCopyOutputStream; }
+
+namespace compiler {
+namespace perlxs {
+
+// An OutputDirectory that holds the generated files in memory until
+// Flush(), then passes on only those whose contents differ from the
+// copy already on disk under "dir".  Files that are not passed on are
+// never opened on the underlying directory, so protoc leaves them and
+// their mtimes alone.
+
+class BufferedOutputDirectory : public OutputDirectory {
+ public:
+  BufferedOutputDirectory(OutputDirectory* output_directory,
+			  const std::string& dir);
+  virtual ~BufferedOutputDirectory();
+
+  virtual io::ZeroCopyOutputStream* Open(const std::string& filename);
+
+  // Writes the changed files to the underlying directory.  Returns the
+  // number of files left untouched.
+  int Flush();
+
+ private:
+  bool Unchanged(const std::string& filename,
+		 const std::string& contents) const;
+
+  OutputDirectory*                   output_directory_;
+  std::string                        dir_;
+  std::map<std::string, std::string> files_;
+
+  GOOGLE_DISALLOW_EVIL_CONSTRUCTORS(BufferedOutputDirectory);
+};
+
+}  // namespace perlxs
+}  // namespace compiler
+}  // namespace protobuf
+}  // namespace google
+
+#endif  // GOOGLE_PROTOBUF_COMPILER_PERLXS_OUTPUT_H__
@@ -0,0 +1,18 @@
+#include <google/protobuf/compiler/plugin.h>
+#include <google/protobuf/compiler/perlxs/perlxs_generator.h>
+
+// protoc-gen-perlxs: the Perl/XS generator as a protoc plugin, so it
+// can run in the same protoc invocation as other generators:
+//
+//   protoc --cpp_out=out --perlxs_out=package=Foo.Bar,stats:out foo.proto
+//
+// The options before the colon are those of protoxs without the
+// leading "--perlxs-" (see PerlXSGenerator::ParseParameter).  protoc
+// splits at the first colon, so package names are written with "."
+// instead of "::".
+
+int main(int argc, char* argv[]) {
+  google::protobuf::compiler::perlxs::PerlXSGenerator generator;
+
+  return google::protobuf::compiler::PluginMain(argc, argv, &generator);
+}